@@ -17,6 +17,8 @@
 //------------------------------------------------------------------------------
 
 #include <iostream>
+#include <limits>
+#include <string>
 #include "server.hpp"
 
 int main(int argc, char* argv[])
@@ -25,13 +27,24 @@ int main(int argc, char* argv[])
   spdlog::set_level(spdlog::level::level_enum::trace);
   try
   {
-    if (argc != 1)
+    if (argc > 2)
     {
-      std::cerr << "Usage: node\n";
+      std::cerr << "Usage: node [max frame size in bytes]\n";
       return 1;
     }
+    uint32_t maxFrameSize = default_max_frame_size;
+    if (argc == 2)
+    {
+      unsigned long long size = std::stoull(argv[1]);
+      if (size == 0 || size > std::numeric_limits<uint32_t>::max())
+      {
+        std::cerr << "Max frame size out of range: " << argv[1] << "\n";
+        return 1;
+      }
+      maxFrameSize = uint32_t(size);
+    }
 
-    fetch::oef::Server s;
+    fetch::oef::Server s{4, 256, maxFrameSize};
     s.run_in_thread();
 
   } catch (std::exception& e)
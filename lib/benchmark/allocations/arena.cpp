@@ -0,0 +1,222 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <hayai.hpp>
+#include "hayai_main.hpp"
+#include "allocations.hpp"
+#include "clientmsg.hpp"
+#include "common.hpp"
+#include "wireframe.hpp"
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+// Built as its own program: the replaced operator new counts the allocations of the thread
+// while a Counting scope is alive, and only forwards to malloc otherwise.
+namespace {
+  thread_local size_t nbAllocations = 0;
+  thread_local bool counting = false;
+
+  struct Counting {
+    Counting() { counting = true; }
+    ~Counting() { counting = false; }
+  };
+}
+
+// Not inlined: GCC would otherwise pair the malloc of operator new with the free of operator
+// delete at each call site and warn about mismatched allocation functions.
+namespace {
+  __attribute__((noinline)) void *allocate(std::size_t size) noexcept {
+    if(counting) {
+      ++nbAllocations;
+    }
+    return std::malloc(size == 0 ? 1 : size);
+  }
+
+  __attribute__((noinline)) void release(void *p) noexcept {
+    std::free(p);
+  }
+}
+
+void *operator new(std::size_t size) {
+  if(void *p = allocate(size)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+
+void *operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void *p) noexcept {
+  release(p);
+}
+
+void operator delete[](void *p) noexcept {
+  release(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  release(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+  release(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  release(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  release(p);
+}
+
+using namespace fetch::oef;
+
+namespace {
+  constexpr size_t nbMessages = 10000;
+
+  // Frames received by the node: a CFP with a query relayed to another agent and a service
+  // registration.
+  struct Frames {
+    Buffer cfp;
+    Buffer registration;
+    Frames() {
+      DataModel car{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"price", Type::Int, true},
+                            Attribute{"luxury", Type::Bool, true}}};
+      QueryModel query{{Constraint{"manufacturer", Relation{Relation::Op::Eq, std::string{"Tesla"}}},
+                        Constraint{"price", Range{std::make_pair(10000, 50000)}},
+                        Constraint{"luxury", Relation{Relation::Op::Eq, true}}}, car};
+      cfp = *serialize(CFP{1, "Agent2", CFPType{query}, 2}.handle());
+      Instance tesla{car, {{"manufacturer", VariantType{std::string{"Tesla"}}}, {"price", VariantType{45000}},
+                           {"luxury", VariantType{true}}}};
+      registration = *serialize(Register{3, tesla}.handle());
+    }
+  };
+
+  const Frames &frames() {
+    static Frames f;
+    return f;
+  }
+
+  // What the node does with a relayed message, before the payload is written.
+  void relay(fetch::oef::pb::Agent_Message &msg, fetch::oef::pb::Server_AgentMessage &message) {
+    message.set_answer_id(1);
+    auto *content = message.mutable_content();
+    content->set_dialogue_id(msg.dialogue_id());
+    content->set_origin("Agent1");
+    if(msg.has_fipa()) {
+      content->mutable_fipa()->Swap(msg.mutable_fipa());
+    }
+    (void)serialize(message);
+  }
+
+  void heapFrame(const Buffer &buffer) {
+    auto envelope = deserialize<fetch::oef::pb::Envelope>(buffer);
+    if(envelope.has_send_message()) {
+      fetch::oef::pb::Server_AgentMessage message;
+      relay(*envelope.mutable_send_message(), message);
+    }
+  }
+
+  void arenaFrame(const Buffer &buffer) {
+    FrameArena arena;
+    auto *envelope = deserialize<fetch::oef::pb::Envelope>(buffer, arena.get());
+    if(envelope->has_send_message()) {
+      auto *message = google::protobuf::Arena::CreateMessage<fetch::oef::pb::Server_AgentMessage>(&arena.get());
+      relay(*envelope->mutable_send_message(), *message);
+    }
+  }
+
+  // Relay without parsing the payload: only the header of the relayed message is encoded.
+  void scannedFrame(const Buffer &buffer) {
+    fetch::oef::RelayFrame frame;
+    if(frame.scan(buffer)) {
+      (void)frame.header("Agent1", stde::nullopt);
+    }
+  }
+
+  template <typename F>
+  double allocations(const Buffer &buffer, F f) {
+    f(buffer); // warm up the thread arena
+    size_t before = nbAllocations;
+    {
+      Counting scope;
+      for(size_t i = 0; i < nbMessages; ++i) {
+        f(buffer);
+      }
+    }
+    return double(nbAllocations - before) / nbMessages;
+  }
+
+  class FramesFixture : public ::hayai::Fixture {
+  public:
+    void SetUp() override {
+      (void)frames();
+    }
+  };
+}
+
+BENCHMARK_F(FramesFixture, HeapRelay10kCFP, 10, 1)
+{
+  for(size_t i = 0; i < nbMessages; ++i) {
+    heapFrame(frames().cfp);
+  }
+}
+
+BENCHMARK_F(FramesFixture, ArenaRelay10kCFP, 10, 1)
+{
+  for(size_t i = 0; i < nbMessages; ++i) {
+    arenaFrame(frames().cfp);
+  }
+}
+
+BENCHMARK_F(FramesFixture, ScannedRelay10kCFP, 10, 1)
+{
+  for(size_t i = 0; i < nbMessages; ++i) {
+    scannedFrame(frames().cfp);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  auto &f = frames();
+  std::cout << "Allocations per frame (serialization of the relayed message included)\n";
+  std::cout << "  relayed CFP: " << allocations(f.cfp, heapFrame) << " heap, "
+            << allocations(f.cfp, arenaFrame) << " arena, " << allocations(f.cfp, scannedFrame) << " scanned\n";
+  std::cout << "  registration: " << allocations(f.registration, heapFrame) << " heap, "
+            << allocations(f.registration, arenaFrame) << " arena\n";
+  std::cout << "Heap bytes per stored instance (100k five-attribute cars): " << instanceBytes(100000) << "\n";
+
+  ::hayai::MainRunner runner;
+  int result = runner.ParseArgs(argc, argv);
+  if(result) {
+    return result;
+  }
+  return runner.Run();
+}
@@ -0,0 +1,48 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+
+#include "allocations.hpp"
+#include "schema.hpp"
+#include <malloc.h>
+#include <vector>
+
+using namespace fetch::oef;
+
+// Five-attribute cars. The vector of instances is included, the received protobufs are not.
+double instanceBytes(size_t nbInstances) {
+  DataModel car{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"model", Type::String, true},
+                        Attribute{"price", Type::Int, true}, Attribute{"year", Type::Int, true},
+                        Attribute{"luxury", Type::Bool, true}}};
+  std::vector<fetch::oef::pb::Query_Instance> received;
+  received.reserve(nbInstances);
+  for(size_t i = 0; i < nbInstances; ++i) {
+    Instance instance{car, {{"manufacturer", VariantType{"manufacturer" + std::to_string(i % 100)}},
+                            {"model", VariantType{"model" + std::to_string((i / 100) % 100)}},
+                            {"price", VariantType{int(1000 + (i / 1000) * 500)}},
+                            {"year", VariantType{int(1990 + i % 30)}},
+                            {"luxury", VariantType{i % 7 == 0}}}};
+    received.emplace_back(instance.handle());
+  }
+  size_t before = mallinfo2().uordblks;
+  std::vector<Instance> instances;
+  instances.reserve(nbInstances);
+  for(auto &instance : received) {
+    instances.emplace_back(instance);
+  }
+  size_t after = mallinfo2().uordblks;
+  return double(after - before) / double(nbInstances);
+}
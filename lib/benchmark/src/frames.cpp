@@ -0,0 +1,90 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <hayai.hpp>
+#include "common.hpp"
+#include "agent.pb.h"
+
+namespace {
+  constexpr size_t nbFrames = 10000;
+
+  // Messages sent by the node: a relayed message with a small and a large content.
+  struct Messages {
+    fetch::oef::pb::Server_AgentMessage small;
+    fetch::oef::pb::Server_AgentMessage large;
+    Messages() {
+      for(auto p : {std::make_pair(&small, size_t(64)), std::make_pair(&large, size_t(256 * 1024))}) {
+        p.first->set_answer_id(1);
+        auto *content = p.first->mutable_content();
+        content->set_dialogue_id(2);
+        content->set_origin("Agent1");
+        content->set_content(std::string(p.second, 'x'));
+      }
+    }
+  };
+
+  const Messages &messages() {
+    static Messages m;
+    return m;
+  }
+
+  // Previous path: serialized in a local buffer then copied in the shared one, the length prefix
+  // being written separately.
+  std::shared_ptr<Buffer> copied(const fetch::oef::pb::Server_AgentMessage &msg) {
+    size_t size = msg.ByteSizeLong();
+    Buffer data;
+    data.resize(size);
+    (void)msg.SerializeWithCachedSizesToArray(data.data());
+    return std::make_shared<Buffer>(data);
+  }
+
+  class MessagesFixture : public ::hayai::Fixture {
+  public:
+    void SetUp() override {
+      (void)messages();
+    }
+  };
+}
+
+BENCHMARK_F(MessagesFixture, Copied10kSmall, 10, 1)
+{
+  for(size_t i = 0; i < nbFrames; ++i) {
+    auto f = copied(messages().small);
+  }
+}
+
+BENCHMARK_F(MessagesFixture, Pooled10kSmall, 10, 1)
+{
+  for(size_t i = 0; i < nbFrames; ++i) {
+    auto f = frame(messages().small);
+  }
+}
+
+BENCHMARK_F(MessagesFixture, Copied1kLarge, 10, 1)
+{
+  for(size_t i = 0; i < nbFrames / 10; ++i) {
+    auto f = copied(messages().large);
+  }
+}
+
+BENCHMARK_F(MessagesFixture, Pooled1kLarge, 10, 1)
+{
+  for(size_t i = 0; i < nbFrames / 10; ++i) {
+    auto f = frame(messages().large);
+  }
+}
@@ -0,0 +1,126 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <hayai.hpp>
+#include "schema.hpp"
+#include <unordered_set>
+
+using namespace fetch::oef;
+
+namespace {
+  constexpr int nbInstances = 100000;
+
+  // The hash Instance used before: order dependent, values combined with shifts.
+  size_t legacyHash(const Instance &instance) {
+    size_t h = std::hash<std::string>{}(instance.model().name());
+    instance.for_each_value([&h](const std::string &key, const VariantType &value) {
+        size_t hs = std::hash<std::string>{}(key);
+        h = hs ^ (h << 1);
+        value.match([&hs](int i) { hs = std::hash<int>{}(i);},
+                    [&hs](double d) { hs = std::hash<double>{}(d);},
+                    [&hs](const std::string &s) { hs = std::hash<std::string>{}(s);},
+                    [&hs](const Location &l) {
+                      size_t h1 = std::hash<double>{}(l.lon);
+                      hs = h1 ^ (std::hash<double>{}(l.lat) << 1);},
+                    [&hs](bool b) { hs = std::hash<bool>{}(b);});
+        h = hs ^ (h << 2);
+      });
+    return h;
+  }
+  struct LegacyHash {
+    size_t operator()(const Instance &instance) const { return legacyHash(instance); }
+  };
+
+  // Distinct cars (strings, ints and bools) and weather stations (locations and doubles).
+  struct Instances {
+    std::vector<Instance> cars;
+    std::vector<Instance> stations;
+    Instances() {
+      DataModel car{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"model", Type::String, true},
+                            Attribute{"price", Type::Int, true}, Attribute{"year", Type::Int, true},
+                            Attribute{"luxury", Type::Bool, true}}};
+      DataModel station{"weather_station", {Attribute{"location", Type::Location, true},
+                                            Attribute{"temperature", Type::Double, true},
+                                            Attribute{"wind", Type::Bool, true}}};
+      cars.reserve(nbInstances);
+      stations.reserve(nbInstances);
+      for(int i = 0; i < nbInstances; ++i) {
+        cars.emplace_back(car, std::unordered_map<std::string,VariantType>{
+            {"manufacturer", VariantType{"manufacturer" + std::to_string(i % 100)}},
+            {"model", VariantType{"model" + std::to_string((i / 100) % 100)}},
+            {"price", VariantType{1000 + (i / 10000) * 500}},
+            {"year", VariantType{1990 + i % 30}},
+            {"luxury", VariantType{i % 7 == 0}}});
+        stations.emplace_back(station, std::unordered_map<std::string,VariantType>{
+            {"location", VariantType{Location{double(i % 3600) / 10.0 - 180.0, double(i / 3600) / 10.0 - 90.0}}},
+            {"temperature", VariantType{double(i % 400) / 10.0 - 20.0}},
+            {"wind", VariantType{i % 2 == 0}}});
+      }
+    }
+  };
+
+  Instances &instances() {
+    static Instances i;
+    return i;
+  }
+
+  template <typename H>
+  class LookupFixture : public ::hayai::Fixture {
+  public:
+    std::unordered_set<Instance,H> cars;
+    std::unordered_set<Instance,H> stations;
+    void SetUp() override {
+      cars.insert(instances().cars.begin(), instances().cars.end());
+      stations.insert(instances().stations.begin(), instances().stations.end());
+    }
+    void TearDown() override {
+      cars.clear();
+      stations.clear();
+    }
+  };
+  using LegacyLookupFixture = LookupFixture<LegacyHash>;
+  using CachedLookupFixture = LookupFixture<std::hash<Instance>>;
+}
+
+BENCHMARK_F(LegacyLookupFixture, Lookup100kCars, 5, 1)
+{
+  for(auto &instance : instances().cars) {
+    (void)cars.count(instance);
+  }
+}
+
+BENCHMARK_F(CachedLookupFixture, Lookup100kCars, 5, 1)
+{
+  for(auto &instance : instances().cars) {
+    (void)cars.count(instance);
+  }
+}
+
+BENCHMARK_F(LegacyLookupFixture, Lookup100kStations, 5, 1)
+{
+  for(auto &instance : instances().stations) {
+    (void)stations.count(instance);
+  }
+}
+
+BENCHMARK_F(CachedLookupFixture, Lookup100kStations, 5, 1)
+{
+  for(auto &instance : instances().stations) {
+    (void)stations.count(instance);
+  }
+}
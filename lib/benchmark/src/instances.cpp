@@ -0,0 +1,92 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+#include <hayai.hpp>
+#include "schema.hpp"
+
+using namespace fetch::oef;
+
+namespace {
+  constexpr int nbInstances = 100000;
+  int64_t result = 0; // keeps the measured loops
+
+  const DataModel &car() {
+    static DataModel model{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"model", Type::String, true},
+                                   Attribute{"price", Type::Int, true}, Attribute{"year", Type::Int, true},
+                                   Attribute{"luxury", Type::Bool, true}}};
+    return model;
+  }
+
+  // 100k five-attribute cars as received from the network, and parsed.
+  struct Cars {
+    std::vector<fetch::oef::pb::Query_Instance> received;
+    std::vector<Instance> instances;
+    QueryModel query{{Constraint{"manufacturer", Relation{Relation::Op::Eq, std::string{"manufacturer7"}}},
+                      Constraint{"price", Range{std::make_pair(1000, 20000)}},
+                      Constraint{"luxury", Relation{Relation::Op::Eq, true}}}, car()};
+    Cars() {
+      received.reserve(nbInstances);
+      instances.reserve(nbInstances);
+      for(int i = 0; i < nbInstances; ++i) {
+        Instance instance{car(), {{"manufacturer", VariantType{"manufacturer" + std::to_string(i % 100)}},
+                                  {"model", VariantType{"model" + std::to_string((i / 100) % 100)}},
+                                  {"price", VariantType{1000 + (i / 1000) * 500}},
+                                  {"year", VariantType{1990 + i % 30}},
+                                  {"luxury", VariantType{i % 7 == 0}}}};
+        received.emplace_back(instance.handle());
+        instances.emplace_back(received.back());
+      }
+    }
+  };
+
+  Cars &cars() {
+    static Cars c;
+    return c;
+  }
+
+  class CarsFixture : public ::hayai::Fixture {
+  public:
+    void SetUp() override {
+      (void)cars();
+    }
+  };
+}
+
+BENCHMARK_F(CarsFixture, Parse100kCars, 5, 1)
+{
+  std::vector<Instance> instances;
+  instances.reserve(nbInstances);
+  for(auto &instance : cars().received) {
+    instances.emplace_back(instance);
+  }
+}
+
+// QueryModel::check with three constraints.
+BENCHMARK_F(CarsFixture, Check100kCars, 10, 1)
+{
+  for(auto &instance : cars().instances) {
+    result += cars().query.check(instance);
+  }
+}
+
+// Attribute access by name, as the constraints do.
+BENCHMARK_F(CarsFixture, Find100kCarsPrice, 10, 1)
+{
+  for(auto &instance : cars().instances) {
+    result += instance.find("price")->get<int>();
+  }
+}
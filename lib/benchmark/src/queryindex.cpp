@@ -0,0 +1,106 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <hayai.hpp>
+#include "queryindex.hpp"
+
+using namespace fetch::oef;
+
+namespace {
+  constexpr size_t nbQueries = 100000;
+  constexpr int nbManufacturers = 1000;
+
+  const DataModel &car() {
+    static DataModel model{"car", {Attribute{"manufacturer", Type::String, true},
+                                   Attribute{"price", Type::Int, true},
+                                   Attribute{"luxury", Type::Bool, true}}};
+    return model;
+  }
+
+  Instance makeCar(int i) {
+    return Instance{car(), {{"manufacturer", VariantType{"manufacturer" + std::to_string(i % nbManufacturers)}},
+                            {"price", VariantType{(i * 7919) % 100000}},
+                            {"luxury", VariantType{i % 2 == 0}}}};
+  }
+
+  // 100k stored queries: mostly manufacturer equalities combined with price ranges,
+  // a few price ranges only and a few disjunctions.
+  struct Queries {
+    std::vector<QueryModel> queries;
+    QueryIndex index;
+    std::vector<Instance> instances;
+    Queries() {
+      queries.reserve(nbQueries);
+      for(size_t i = 0; i < nbQueries; ++i) {
+        int lo = int((i * 31) % 100000);
+        Constraint manufacturer{"manufacturer", Relation{Relation::Op::Eq, "manufacturer" + std::to_string(i % nbManufacturers)}};
+        Constraint price{"price", Range{std::make_pair(lo, lo + 5000)}};
+        switch(i % 10) {
+        case 0:
+          queries.emplace_back(QueryModel{{price}, car()});
+          break;
+        case 1:
+          queries.emplace_back(QueryModel{{manufacturer || Constraint{"luxury", Relation{Relation::Op::Eq, true}}}, car()});
+          break;
+        default:
+          queries.emplace_back(QueryModel{{manufacturer, price}, car()});
+        }
+        index.add(i, queries.back());
+      }
+      for(int i = 0; i < 100; ++i) {
+        instances.emplace_back(makeCar(i));
+      }
+    }
+  };
+
+  Queries &queries() {
+    static Queries q;
+    return q;
+  }
+
+  // builds the queries outside of the measured runs.
+  class QueriesFixture : public ::hayai::Fixture {
+  public:
+    void SetUp() override {
+      (void)queries();
+    }
+  };
+}
+
+BENCHMARK_F(QueriesFixture, Match1Instance100kQueries, 10, 100)
+{
+  auto &q = queries();
+  auto res = q.index.match(q.instances[0]);
+}
+
+BENCHMARK_F(QueriesFixture, Batch100Instances100kQueries, 10, 1)
+{
+  auto &q = queries();
+  auto res = q.index.match(q.instances);
+}
+
+BENCHMARK_F(QueriesFixture, Naive1Instance100kQueries, 10, 1)
+{
+  auto &q = queries();
+  std::vector<QueryIndex::Id> res;
+  for(size_t i = 0; i < q.queries.size(); ++i) {
+    if(q.queries[i].check(q.instances[0])) {
+      res.emplace_back(i);
+    }
+  }
+}
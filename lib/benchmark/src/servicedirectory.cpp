@@ -0,0 +1,96 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <hayai.hpp>
+#include "servicedirectory.hpp"
+
+using namespace fetch::oef;
+
+namespace {
+  constexpr int nbServices = 100000;
+
+  // Instances as received from the network.
+  const std::vector<Instance> &services() {
+    static std::vector<Instance> instances = []() {
+      DataModel car{"car", {Attribute{"manufacturer", Type::String, true},
+                            Attribute{"price", Type::Int, true},
+                            Attribute{"luxury", Type::Bool, true}}};
+      std::vector<Instance> res;
+      res.reserve(nbServices);
+      for(int i = 0; i < nbServices; ++i) {
+        Instance instance{car, {{"manufacturer", VariantType{"manufacturer" + std::to_string(i % 1000)}},
+                                {"price", VariantType{i}},
+                                {"luxury", VariantType{i % 2 == 0}}}};
+        res.emplace_back(instance.handle());
+      }
+      return res;
+    }();
+    return instances;
+  }
+
+  class ServicesFixture : public ::hayai::Fixture {
+  public:
+    void SetUp() override {
+      (void)services();
+    }
+  };
+}
+
+BENCHMARK_F(ServicesFixture, Register100kOneByOne, 5, 1)
+{
+  ServiceDirectory sd;
+  for(auto &instance : services()) {
+    sd.registerAgent(instance, "Agent1");
+  }
+}
+
+BENCHMARK_F(ServicesFixture, Register100kMany, 5, 1)
+{
+  ServiceDirectory sd;
+  sd.registerMany(services(), "Agent1");
+}
+
+namespace {
+  // registered before each run.
+  class RegisteredFixture : public ::hayai::Fixture {
+  public:
+    std::unique_ptr<ServiceDirectory> sd;
+    std::vector<uint64_t> handles;
+    void SetUp() override {
+      sd = std::make_unique<ServiceDirectory>();
+      handles = sd->registerMany(services(), "Agent1");
+    }
+    void TearDown() override {
+      sd.reset();
+    }
+  };
+}
+
+BENCHMARK_F(RegisteredFixture, Unregister100kByInstance, 5, 1)
+{
+  for(auto &instance : services()) {
+    sd->unregisterAgent(instance, "Agent1");
+  }
+}
+
+BENCHMARK_F(RegisteredFixture, Unregister100kByHandle, 5, 1)
+{
+  for(auto handle : handles) {
+    sd->unregisterAgent(handle, "Agent1");
+  }
+}
@@ -19,7 +19,9 @@
 
 #include "logger.hpp"
 #include "schema.hpp"
+#include <functional>
 #include <memory>
+#include <unordered_set>
 
 namespace fetch {
     namespace oef {
@@ -39,10 +41,14 @@ namespace fetch {
             bool exist(const std::string &id) const {
                 return sessions_.find(id) != sessions_.end();
             }
-            bool add(const std::string &id, std::shared_ptr<AgentSession> session) {
+            // added is called before the session can be found by other sessions.
+            bool add(const std::string &id, std::shared_ptr<AgentSession> session,
+                     const std::function<void()> &added = nullptr) {
                 std::lock_guard<std::mutex> lock(lock_);
                 if(exist(id))
                     return false;
+                if(added)
+                    added();
                 sessions_[id] = std::move(session);
                 return true;
             }
@@ -67,6 +73,10 @@ namespace fetch {
                 return sessions_.size();
             }
             const std::vector<std::string> search(const QueryModel &query) const;
+            // At most max agents (0 means no limit) matching query which are not in skip: the scan
+            // stops once there are max of them.
+            std::vector<std::string> search(const QueryModel &query, size_t max,
+                                            const std::unordered_set<std::string> &skip = {}) const;
         };
     }
 }
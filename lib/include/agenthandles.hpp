@@ -0,0 +1,127 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "agent.pb.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace fetch {
+  namespace oef {
+    // Server side dictionary of the agent keys sent on a connection: a key is sent once with
+    // its handle, then only the handle. Thread safe, relayed messages are encoded by the
+    // sending agent's session: it holds lock() until the encoded frame is queued, so that a frame
+    // with only a handle cannot be written before the one with its key.
+    class AgentHandles {
+    private:
+      mutable std::recursive_mutex lock_;
+      uint64_t next_handle_ = 1;
+      std::unordered_map<std::string,uint64_t> handles_;
+
+      // returns the handle of agent, created is set if it was not known yet.
+      uint64_t handle(const std::string &agent, bool &created) {
+        auto iter = handles_.find(agent);
+        created = iter == handles_.end();
+        if(created) {
+          iter = handles_.emplace(agent, next_handle_++).first;
+        }
+        return iter->second;
+      }
+    public:
+      std::unique_lock<std::recursive_mutex> lock() const { return std::unique_lock<std::recursive_mutex>(lock_); }
+      size_t size() const {
+        std::lock_guard<std::recursive_mutex> lock(lock_);
+        return handles_.size();
+      }
+      // Replaces the agents of result by their handles, adding the unknown ones to its dictionary.
+      void encode(fetch::oef::pb::Server_SearchResult &result) {
+        std::lock_guard<std::recursive_mutex> lock(lock_);
+        auto *handles = result.mutable_handles();
+        handles->Reserve(result.agents_size());
+        for(auto &agent : *result.mutable_agents()) {
+          bool created;
+          uint64_t h = handle(agent, created);
+          handles->Add(h);
+          if(created) {
+            auto *entry = result.add_dictionary();
+            entry->set_handle(h);
+            entry->set_agent(std::move(agent));
+          }
+        }
+        result.clear_agents();
+      }
+      // origin is sent in full the first time only with its handle, then it is empty
+      // (it is a required field).
+      void encode(fetch::oef::pb::Server_AgentMessage_Content &content) {
+        bool created;
+        content.set_origin_handle(encode(content.origin(), created));
+        if(!created) {
+          content.set_origin("");
+        }
+      }
+      // Same for a message relayed without being parsed: the handle of origin, which is sent
+      // in full only if created is set.
+      uint64_t encode(const std::string &origin, bool &created) {
+        std::lock_guard<std::recursive_mutex> lock(lock_);
+        return handle(origin, created);
+      }
+    };
+
+    // Client side dictionary: rebuilds the agent keys sent as handles. Not thread safe.
+    class AgentDictionary {
+    private:
+      std::unordered_map<uint64_t,std::string> agents_;
+    public:
+      size_t size() const { return agents_.size(); }
+      // Fills the agents of result from its handles, false if a handle is unknown.
+      bool decode(fetch::oef::pb::Server_SearchResult &result) {
+        for(auto &entry : *result.mutable_dictionary()) {
+          agents_[entry.handle()] = std::move(*entry.mutable_agent());
+        }
+        result.clear_dictionary();
+        for(auto h : result.handles()) {
+          auto iter = agents_.find(h);
+          if(iter == agents_.end()) {
+            return false;
+          }
+          result.add_agents(iter->second);
+        }
+        result.clear_handles();
+        return true;
+      }
+      bool decode(fetch::oef::pb::Server_AgentMessage_Content &content) {
+        if(!content.has_origin_handle()) {
+          return true;
+        }
+        if(!content.origin().empty()) {
+          agents_[content.origin_handle()] = content.origin();
+        } else {
+          auto iter = agents_.find(content.origin_handle());
+          if(iter == agents_.end()) {
+            return false;
+          }
+          content.set_origin(iter->second);
+        }
+        content.clear_origin_handle();
+        return true;
+      }
+    };
+  }
+}
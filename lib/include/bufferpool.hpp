@@ -0,0 +1,133 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+using Buffer = std::vector<uint8_t>;
+
+namespace fetch {
+  namespace oef {
+    class BufferPool;
+
+    // Reference to a buffer of the BufferPool. The reference count is stored with the buffer:
+    // copies share it, the last one gives it back to the pool.
+    class SharedBuffer {
+    private:
+      friend class BufferPool;
+      struct Block {
+        std::atomic<uint32_t> refs{1};
+        uint32_t size_class;
+        Buffer buffer;
+      };
+      Block *block_ = nullptr;
+
+      explicit SharedBuffer(Block *block) : block_{block} {}
+      void release();
+    public:
+      SharedBuffer() = default;
+      SharedBuffer(std::nullptr_t) {}
+      SharedBuffer(const SharedBuffer &other) : block_{other.block_} {
+        if(block_) {
+          block_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      SharedBuffer(SharedBuffer &&other) noexcept : block_{other.block_} {
+        other.block_ = nullptr;
+      }
+      SharedBuffer &operator=(SharedBuffer other) noexcept {
+        std::swap(block_, other.block_);
+        return *this;
+      }
+      ~SharedBuffer() { release(); }
+      Buffer &operator*() const { return block_->buffer; }
+      Buffer *operator->() const { return &block_->buffer; }
+      Buffer *get() const { return block_ ? &block_->buffer : nullptr; }
+      explicit operator bool() const { return block_ != nullptr; }
+      void reset() {
+        release();
+        block_ = nullptr;
+      }
+      uint32_t use_count() const { return block_ ? block_->refs.load(std::memory_order_relaxed) : 0; }
+    };
+
+    // Pool of the buffers of the frames read and written, by size class (powers of two from
+    // 256 bytes to 4 MiB): a released buffer keeps its capacity and is reused for a frame of the
+    // same class, bigger frames are not pooled. Each thread caches a few buffers per class, the
+    // other ones are shared. Thread safe.
+    class BufferPool {
+    public:
+      struct Stats {
+        uint64_t hits;           // buffers acquired from the pool
+        uint64_t misses;         // buffers allocated
+        size_t retained_buffers; // free buffers kept by the pool
+        size_t retained_bytes;
+        double hitRate() const { return hits + misses == 0 ? 0.0 : double(hits) / double(hits + misses); }
+      };
+    private:
+      using Block = SharedBuffer::Block;
+      static constexpr size_t min_size = 256;
+      static constexpr uint32_t nb_classes = 15;
+      static constexpr size_t thread_cached = 16; // per class and thread
+      static constexpr size_t max_shared = 256;   // per class
+      using FreeLists = std::array<std::vector<Block*>,nb_classes>;
+      struct ThreadCache;
+
+      mutable std::mutex lock_;
+      FreeLists shared_;
+      std::atomic<uint64_t> hits_{0};
+      std::atomic<uint64_t> misses_{0};
+      std::atomic<size_t> retained_buffers_{0};
+      std::atomic<size_t> retained_bytes_{0};
+
+      BufferPool() = default;
+      static uint32_t sizeClass(size_t size) {
+        uint32_t c = 0;
+        while(c < nb_classes && (min_size << c) < size) {
+          ++c;
+        }
+        return c;
+      }
+      static ThreadCache *cache();
+      void retain(Block *block);
+      void destroy(Block *block);
+      // Moves the buffers of cache over keep to the shared lists, freed if they are full.
+      void drain(std::vector<Block*> &cache, uint32_t c, size_t keep);
+    public:
+      // Never destroyed: buffers can be released by the static objects' destructors.
+      static BufferPool &instance();
+      BufferPool(const BufferPool &) = delete;
+      BufferPool &operator=(const BufferPool &) = delete;
+      // Buffer of size bytes (not initialized if it is reused), back in the pool once released.
+      SharedBuffer acquire(size_t size);
+      void recycle(SharedBuffer::Block *block);
+      Stats stats() const;
+    };
+
+    inline void SharedBuffer::release() {
+      if(block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        BufferPool::instance().recycle(block_);
+      }
+    }
+  }
+}
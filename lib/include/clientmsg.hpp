@@ -23,15 +23,56 @@
 namespace fetch {
   namespace oef {
 
+    class RegisterSchema {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit RegisterSchema(uint32_t msg_id, const DataModel &model) {
+        envelope_.set_msg_id(msg_id);
+        envelope_.mutable_register_schema()->CopyFrom(model.handle());
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    // With a schema_id (see RegisterSchema), the data model of the instance is not sent.
     class Register {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit Register(uint32_t msg_id, const Instance &instance) {
+      explicit Register(uint32_t msg_id, const Instance &instance, bool return_handle = false, uint32_t schema_id = 0) {
         envelope_.set_msg_id(msg_id);
         auto *reg = envelope_.mutable_register_service();
         auto *inst = reg->mutable_description();
-        inst->CopyFrom(instance.handle());
+        *inst = schema_id > 0 ? instance.handle(schema_id) : instance.handle();
+        if(return_handle) {
+          reg->set_return_handle(true);
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class UpdateService {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit UpdateService(uint32_t msg_id, uint64_t handle, const std::unordered_map<std::string,VariantType> &values) {
+        envelope_.set_msg_id(msg_id);
+        auto *update = envelope_.mutable_update_service();
+        update->set_handle(handle);
+        for(auto &v : values) {
+          auto *kv = update->add_values();
+          kv->set_key(v.first);
+          auto *value = kv->mutable_value();
+          v.second.match([value](int i) { value->set_i(i); },
+                         [value](double d) { value->set_d(d); },
+                         [value](const std::string &s) { value->set_s(s); },
+                         [value](const Location &l) {
+                           auto *loc = value->mutable_l();
+                           loc->set_lon(l.lon);
+                           loc->set_lat(l.lat);
+                         },
+                         [value](bool b) { value->set_b(b); });
+        }
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
@@ -40,11 +81,22 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit Unregister(uint32_t msg_id, const Instance &instance) {
+      explicit Unregister(uint32_t msg_id, const Instance &instance, uint32_t schema_id = 0) {
         envelope_.set_msg_id(msg_id);
         auto *reg = envelope_.mutable_unregister_service();
         auto *inst = reg->mutable_description();
-        inst->CopyFrom(instance.handle());
+        *inst = schema_id > 0 ? instance.handle(schema_id) : instance.handle();
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class UnregisterHandle {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit UnregisterHandle(uint32_t msg_id, uint64_t handle) {
+        envelope_.set_msg_id(msg_id);
+        envelope_.mutable_unregister_handle()->set_handle(handle);
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
@@ -64,11 +116,91 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit SearchServices(uint32_t msg_id, const QueryModel &model) {
+      explicit SearchServices(uint32_t msg_id, const QueryModel &model, uint32_t limit = 0, uint32_t chunk_size = 0) {
+        envelope_.set_msg_id(msg_id);
+        auto *desc = envelope_.mutable_search_services();
+        auto *mod = desc->mutable_query();
+        mod->CopyFrom(model.handle());
+        if(limit > 0) {
+          desc->set_limit(limit);
+        }
+        if(chunk_size > 0) {
+          desc->set_chunk_size(chunk_size);
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class SearchServicesChanges {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit SearchServicesChanges(uint32_t msg_id, const QueryModel &model, uint64_t generation) {
         envelope_.set_msg_id(msg_id);
         auto *desc = envelope_.mutable_search_services();
         auto *mod = desc->mutable_query();
         mod->CopyFrom(model.handle());
+        desc->set_generation(generation);
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class AggregateServices {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit AggregateServices(uint32_t msg_id, const QueryModel &model, const std::string &numeric = "",
+                                 const std::string &group_by = "") {
+        envelope_.set_msg_id(msg_id);
+        auto *desc = envelope_.mutable_aggregate_services();
+        auto *mod = desc->mutable_query();
+        mod->CopyFrom(model.handle());
+        if(!numeric.empty()) {
+          desc->set_numeric(numeric);
+        }
+        if(!group_by.empty()) {
+          desc->set_group_by(group_by);
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class SearchNext {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit SearchNext(uint32_t msg_id, uint64_t cursor, uint32_t limit = 0) {
+        envelope_.set_msg_id(msg_id);
+        auto *next = envelope_.mutable_search_next();
+        next->set_cursor(cursor);
+        if(limit > 0) {
+          next->set_limit(limit);
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class SubscribeServices {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit SubscribeServices(uint32_t subscription_id, const QueryModel &model) {
+        envelope_.set_msg_id(subscription_id);
+        auto *desc = envelope_.mutable_subscribe_services();
+        auto *mod = desc->mutable_query();
+        mod->CopyFrom(model.handle());
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    class UnsubscribeServices {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit UnsubscribeServices(uint32_t msg_id, uint32_t subscription_id) {
+        envelope_.set_msg_id(msg_id);
+        auto *sub = envelope_.mutable_unsubscribe_services();
+        sub->set_subscription_id(subscription_id);
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
@@ -171,12 +303,35 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit SearchAgents(uint32_t search_id, const QueryModel &model) {
+      explicit SearchAgents(uint32_t search_id, const QueryModel &model, uint32_t limit = 0, uint32_t chunk_size = 0) {
         envelope_.set_msg_id(search_id);
         auto *desc = envelope_.mutable_search_agents();
         auto *mod = desc->mutable_query();
         mod->CopyFrom(model.handle());
+        if(limit > 0) {
+          desc->set_limit(limit);
+        }
+        if(chunk_size > 0) {
+          desc->set_chunk_size(chunk_size);
+        }
+      }
+      const fetch::oef::pb::Envelope &handle() const { return envelope_; }
+    };
+    
+    // Envelopes processed in one pass, answered with a single batch answer.
+    class Batch {
+    private:
+      fetch::oef::pb::Envelope envelope_;
+    public:
+      explicit Batch(uint32_t msg_id) {
+        envelope_.set_msg_id(msg_id);
+        (void) envelope_.mutable_batch();
+      }
+      template <typename T>
+      void add(const T &msg) {
+        envelope_.mutable_batch()->add_envelopes()->CopyFrom(msg.handle());
       }
+      size_t size() const { return size_t(envelope_.batch().envelopes_size()); }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
     
@@ -184,11 +339,11 @@ namespace fetch {
     private:
       fetch::oef::pb::Envelope envelope_;
     public:
-      explicit Description(uint32_t msg_id, const Instance &instance) {
+      explicit Description(uint32_t msg_id, const Instance &instance, uint32_t schema_id = 0) {
         envelope_.set_msg_id(msg_id);
         auto *desc = envelope_.mutable_register_description();
         auto *inst = desc->mutable_description();
-        inst->CopyFrom(instance.handle());
+        *inst = schema_id > 0 ? instance.handle(schema_id) : instance.handle();
       }
       const fetch::oef::pb::Envelope &handle() const { return envelope_; }
     };
@@ -18,17 +18,21 @@
 //------------------------------------------------------------------------------
 
 #include "asio.hpp"
+#include "bufferpool.hpp"
 //#include "asio/yield.hpp"
+#include <google/protobuf/arena.h>
+#include <cstring>
 #include <iostream>
 #include <functional>
+#include <memory>
 #include <thread>
+#include <type_traits>
 
 enum class Ports {
   ServiceDiscovery = 2222, Agents = 3333
 };
 
 using asio::ip::tcp;
-using Buffer = std::vector<uint8_t>;
 
 template <typename T>
 T from_string(const std::string &s) {
@@ -39,11 +43,21 @@ T from_string(const std::string &s) {
 
 template <typename T>
 std::shared_ptr<Buffer> serialize(const T &t) {
-  size_t size = t.ByteSize();
-  Buffer data;
-  data.resize(size);
-  (void)t.SerializeWithCachedSizesToArray(data.data());
-  return std::make_shared<Buffer>(data);
+  size_t size = t.ByteSizeLong();
+  auto data = std::make_shared<Buffer>(size);
+  (void)t.SerializeWithCachedSizesToArray(data->data());
+  return data;
+}
+
+// Frame ready to be written: the length prefix followed by the message, serialized in place in a
+// pooled buffer.
+template <typename T>
+fetch::oef::SharedBuffer frame(const T &t) {
+  uint32_t size = uint32_t(t.ByteSizeLong());
+  auto data = fetch::oef::BufferPool::instance().acquire(sizeof(size) + size);
+  std::memcpy(data->data(), &size, sizeof(size));
+  (void)t.SerializeWithCachedSizesToArray(data->data() + sizeof(size));
+  return data;
 }
 
 template <typename T>
@@ -53,9 +67,167 @@ T deserialize(const Buffer &buffer) {
   return t;
 }
 
-void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, std::function<void(std::error_code,std::shared_ptr<Buffer>)> handler);
-void asyncWriteBuffer(asio::ip::tcp::socket &socket, std::shared_ptr<Buffer> s, uint32_t timeout);
-void asyncWriteBuffer(asio::ip::tcp::socket &socket, std::shared_ptr<Buffer> s, uint32_t timeout, std::function<void(std::error_code, std::size_t length)> handler);
+// Arena for the messages of one frame, all released at once when the frame is processed
+// (destructor). Each thread reuses its own arena and initial block, a frame processed while
+// another one is (on the same thread) gets a new arena.
+class FrameArena {
+private:
+  struct Local {
+    std::vector<char> block = std::vector<char>(64 * 1024);
+    google::protobuf::Arena arena{block.data(), block.size()};
+    bool busy = false;
+  };
+  static Local &local() {
+    static thread_local Local l;
+    return l;
+  }
+  Local *local_ = nullptr;
+  std::unique_ptr<google::protobuf::Arena> own_;
+public:
+  explicit FrameArena() {
+    auto &l = local();
+    if(l.busy) {
+      own_ = std::make_unique<google::protobuf::Arena>();
+    } else {
+      l.busy = true;
+      local_ = &l;
+    }
+  }
+  ~FrameArena() {
+    if(local_) {
+      local_->arena.Reset();
+      local_->busy = false;
+    }
+  }
+  FrameArena(const FrameArena &) = delete;
+  FrameArena &operator=(const FrameArena &) = delete;
+  google::protobuf::Arena &get() { return local_ ? local_->arena : *own_; }
+};
+
+// The message is owned by arena.
+template <typename T>
+T *deserialize(const Buffer &buffer, google::protobuf::Arena &arena) {
+  T *t = google::protobuf::Arena::CreateMessage<T>(&arena);
+  t->ParseFromArray(buffer.data(), int(buffer.size()));
+  return t;
+}
+
+// Memory of the asynchronous operation in progress on a socket, so that asio does not allocate it
+// for each operation: an operation started while it is in use, or too big, is allocated.
+class HandlerMemory {
+private:
+  typename std::aligned_storage<512>::type storage_;
+  bool in_use_ = false;
+public:
+  HandlerMemory() = default;
+  HandlerMemory(const HandlerMemory &) = delete;
+  HandlerMemory &operator=(const HandlerMemory &) = delete;
+  void *allocate(std::size_t size) {
+    if(!in_use_ && size <= sizeof(storage_)) {
+      in_use_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+  void deallocate(void *p) {
+    if(p == &storage_) {
+      in_use_ = false;
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+template <typename T>
+class HandlerAllocator {
+private:
+  template <typename> friend class HandlerAllocator;
+  HandlerMemory *memory_;
+public:
+  using value_type = T;
+  explicit HandlerAllocator(HandlerMemory *memory) : memory_{memory} {}
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U> &other) noexcept : memory_{other.memory_} {}
+  T *allocate(std::size_t n) const {
+    return static_cast<T*>(memory_ ? memory_->allocate(sizeof(T) * n) : ::operator new(sizeof(T) * n));
+  }
+  void deallocate(T *p, std::size_t) const {
+    if(memory_) {
+      memory_->deallocate(p);
+    } else {
+      ::operator delete(p);
+    }
+  }
+  bool operator==(const HandlerAllocator &other) const noexcept { return memory_ == other.memory_; }
+  bool operator!=(const HandlerAllocator &other) const noexcept { return memory_ != other.memory_; }
+};
+
+// Handler whose operations are allocated in memory (the heap if it is null).
+template <typename Handler>
+class MemoryHandler {
+private:
+  HandlerMemory *memory_;
+  Handler handler_;
+public:
+  using allocator_type = HandlerAllocator<Handler>;
+  MemoryHandler(HandlerMemory *memory, Handler handler) : memory_{memory}, handler_{std::move(handler)} {}
+  allocator_type get_allocator() const noexcept { return allocator_type{memory_}; }
+  template <typename... Args>
+  void operator()(Args &&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+};
+
+template <typename Handler>
+MemoryHandler<Handler> withMemory(HandlerMemory *memory, Handler handler) {
+  return MemoryHandler<Handler>{memory, std::move(handler)};
+}
+
+// Frames over it are not read unless a bigger maximum is configured, bigger messages are chunked.
+constexpr uint32_t default_max_frame_size = 16 * 1024 * 1024;
+
+// The frames read and written are pooled buffers, a written frame starts with its length prefix.
+// handler(std::error_code, fetch::oef::SharedBuffer) is not type erased, so that it is not allocated,
+// and the read operations are allocated in memory if it is given. A frame of more than max_size bytes
+// is an error (message_size), it is not allocated.
+template <typename Handler>
+void asyncReadBuffer(asio::ip::tcp::socket &socket, uint32_t timeout, Handler handler, HandlerMemory *memory = nullptr,
+                     uint32_t max_size = default_max_frame_size)
+{
+  // the buffer of the length prefix is the one of the frame if it is big enough.
+  auto prefix = fetch::oef::BufferPool::instance().acquire(sizeof(uint32_t));
+  auto *data = prefix->data();
+  asio::async_read(socket, asio::buffer(data, sizeof(uint32_t)), withMemory(memory, [prefix,handler=std::move(handler),&socket,memory,max_size](std::error_code ec, std::size_t length) mutable {
+      uint32_t len = 0;
+      if(!ec) {
+        assert(length == sizeof(uint32_t));
+        std::memcpy(&len, prefix->data(), sizeof(len));
+        if(len > max_size) {
+          ec = std::make_error_code(std::errc::message_size);
+        }
+      }
+      if(ec) {
+        handler(ec, fetch::oef::SharedBuffer{});
+      } else {
+        fetch::oef::SharedBuffer buffer;
+        if(len <= prefix->capacity()) {
+          buffer = std::move(prefix);
+          buffer->resize(len);
+        } else {
+          buffer = fetch::oef::BufferPool::instance().acquire(len);
+        }
+        auto *data = buffer->data();
+        asio::async_read(socket, asio::buffer(data, len), withMemory(memory, [buffer=std::move(buffer),handler=std::move(handler)](std::error_code ec, std::size_t length) mutable {
+            if(ec) {
+              std::cerr << "asyncRead2 error " << ec.value() << std::endl;
+            }
+            handler(ec, std::move(buffer));
+          }));
+      }
+    }));
+}
+void asyncWriteBuffer(asio::ip::tcp::socket &socket, fetch::oef::SharedBuffer frame, uint32_t timeout);
+void asyncWriteBuffer(asio::ip::tcp::socket &socket, fetch::oef::SharedBuffer frame, uint32_t timeout, std::function<void(std::error_code, std::size_t length)> handler);
 
 /*
 class Connection : asio::coroutine {
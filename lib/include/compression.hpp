@@ -0,0 +1,68 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "framing.hpp"
+#include "agent.pb.h"
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    class RelayFrame;
+
+    // Message of a compressed frame (FrameHeader::Compressed, Framing::V2): a sequence of segments
+    // whose bytes, once the deflated ones are inflated, are the message.
+    //   raw segment:      varint (size << 1), size bytes
+    //   deflated segment: varint (size << 1 | 1), varint inflated size, size bytes of zlib stream
+    // A send_message envelope whose payload bytes are a deflated segment of their own, the rest of
+    // the envelope being a raw segment, is relayed without inflating the payload.
+    class CompressedFrame {
+    public:
+      static constexpr uint32_t default_threshold = 1024; // smaller messages are not compressed
+      struct Segment {
+        size_t offset; // of its bytes in the frame
+        size_t size;
+        size_t inflated; // size of its bytes once inflated
+        bool deflated;
+      };
+    private:
+      std::vector<Segment> segments_;
+      size_t inflated_ = 0;
+    public:
+      // False if frame is not a sequence of segments, or if it inflates to more than max_size bytes.
+      bool scan(const Buffer &frame, size_t max_size = default_max_frame_size);
+      const std::vector<Segment> &segments() const { return segments_; }
+      size_t inflatedSize() const { return inflated_; }
+      // The message, null if a segment cannot be inflated to its size.
+      SharedBuffer inflate(const Buffer &frame) const;
+      // False if the scanned frame is not a send_message envelope with its payload deflated on its
+      // own (the last segment), or if it cannot be relayed without being parsed.
+      bool scanRelay(const Buffer &frame, RelayFrame &relay) const;
+
+      static size_t segmentHeaderSize(size_t size, bool deflated, size_t inflated);
+      static uint8_t *writeSegmentHeader(size_t size, bool deflated, size_t inflated, uint8_t *out);
+    };
+
+    // Frame (Framing::V2) with its message deflated if it has at least threshold bytes and
+    // deflating makes it smaller, frame otherwise.
+    SharedBuffer compressFrame(SharedBuffer frame, size_t threshold);
+    // Frame of a send_message envelope with its payload deflated on its own, so that it is relayed
+    // without being inflated; other envelopes are compressed as a whole.
+    SharedBuffer compressedEnvelope(const fetch::oef::pb::Envelope &envelope, FrameHeader header);
+  }
+}
@@ -0,0 +1,116 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "compression.hpp"
+#include <atomic>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Socket of an agent with its queue of frames to write. The frames queued while a write is in
+    // progress are written together (gathered) once it completes, so that the sessions relaying
+    // messages to the agent cannot interleave their frames. Kept alive by its pending writes.
+    // The frames written after the handshake are in its negotiated Framing, the messages sent are
+    // compressed from the negotiated threshold if there is one. A multiplexed connection (Framing::V2)
+    // is shared by several agents, the stream of a frame being its agent.
+    // Thread safe.
+    class Connection : public std::enable_shared_from_this<Connection> {
+    public:
+      // Told the outcome of the write of a frame, with the owner of its payload if it has one.
+      using Handler = std::function<void(std::error_code, const SharedBuffer &owner)>;
+    private:
+      struct Write {
+        SharedBuffer frame;         // starts with the length prefix
+        SharedBuffer owner;         // of payload
+        asio::const_buffer payload; // written after frame if not empty
+        Handler handler;
+        std::shared_ptr<void> keep; // what handler uses
+      };
+      // buffers_ as given to async_write, which copies its buffer sequence.
+      struct Gathered {
+        const asio::const_buffer *first;
+        const asio::const_buffer *last;
+        const asio::const_buffer *begin() const { return first; }
+        const asio::const_buffer *end() const { return last; }
+      };
+      static constexpr size_t max_gathered = 64; // frames per write
+      static constexpr uint32_t server_streams = 0x80000000;
+
+      tcp::socket socket_;
+      const Framing framing_;
+      const uint32_t compression_; // threshold, 0 if the frames are not compressed
+      const bool multiplexed_;
+      std::atomic<uint32_t> next_stream_{1};
+      mutable std::mutex lock_;
+      std::vector<Write> queue_;
+      bool writing_ = false;
+      std::vector<Write> written_;              // being written, swapped with queue_ to reuse them
+      std::vector<asio::const_buffer> buffers_; // of written_
+      HandlerMemory write_memory_;              // of the write in progress
+
+      void push(Write &&write);
+      void writeQueued(); // lock_ held
+    public:
+      explicit Connection(tcp::socket socket, Framing framing = Framing::V1, uint32_t compression = 0,
+                          bool multiplexed = false)
+        : socket_{std::move(socket)}, framing_{framing}, compression_{framing == Framing::V1 ? 0 : compression},
+          multiplexed_{framing != Framing::V1 && multiplexed} {}
+      Connection(const Connection &) = delete;
+      Connection &operator=(const Connection &) = delete;
+      tcp::socket &socket() { return socket_; }
+      Framing framing() const { return framing_; }
+      uint32_t compression() const { return compression_; }
+      bool multiplexed() const { return multiplexed_; }
+      // Stream of the frames of a chunked message written to the socket. Its high bit is set, so
+      // that it is not the stream of a request of the agent, whose answers have it.
+      uint32_t openStream() {
+        return server_streams | (next_stream_.fetch_add(1, std::memory_order_relaxed) & ~server_streams);
+      }
+      // handler is called once the frame is written, or with the error if it could not be.
+      void write(SharedBuffer frame, Handler handler = nullptr) {
+        push(Write{std::move(frame), nullptr, asio::const_buffer{}, std::move(handler), nullptr});
+      }
+      // Frame made of header, holding the length prefix, followed by payload which is kept alive
+      // by owner: the payload bytes are not copied. handler can refer to objects kept alive by keep,
+      // so that it only captures pointers and is not allocated.
+      void write(SharedBuffer header, SharedBuffer owner, asio::const_buffer payload,
+                 Handler handler = nullptr, std::shared_ptr<void> keep = nullptr) {
+        push(Write{std::move(header), std::move(owner), payload, std::move(handler), std::move(keep)});
+      }
+      template <typename T>
+      void send(const T &t, Handler handler = nullptr) {
+        send(t, FrameHeader{}, std::move(handler));
+      }
+      // Only the stream and priority of header are used.
+      template <typename T>
+      void send(const T &t, const FrameHeader &header, Handler handler = nullptr) {
+        auto f = frame(t, framing_, header);
+        if(compression_ > 0) {
+          f = compressFrame(std::move(f), compression_);
+        }
+        write(std::move(f), std::move(handler));
+      }
+      // Frames not written yet.
+      size_t queued() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        return queue_.size();
+      }
+    };
+  }
+}
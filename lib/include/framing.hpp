@@ -0,0 +1,155 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "common.hpp"
+#include <cstring>
+#include <system_error>
+
+namespace fetch {
+  namespace oef {
+    // Frame formats, negotiated with Capabilities.framing at the handshake (whose frames are V1).
+    //   V1: uint32_t length (host order), message.
+    //   V2: uint8_t flags (FrameHeader flags, Priority in the two high bits), varint length,
+    //       varint stream id if flags has FrameHeader::Stream, message.
+    enum class Framing : uint32_t { V1 = 1, V2 = 2 };
+
+    // Framing used with an agent that supports up to requested (0 if it did not say).
+    inline Framing negotiateFraming(uint32_t requested) {
+      return requested >= uint32_t(Framing::V2) ? Framing::V2 : Framing::V1;
+    }
+
+    enum class Priority : uint8_t { Low = 0, Normal = 1, High = 2, Control = 3 };
+
+    // What precedes the message of a frame. Only length is written and read with Framing::V1.
+    struct FrameHeader {
+      static constexpr uint8_t Stream = 0x01;     // a stream id follows the length
+      static constexpr uint8_t Compressed = 0x02; // the message is compressed, see CompressedFrame
+      static constexpr uint8_t More = 0x04;       // the message goes on in the next frame of the stream
+      static constexpr uint8_t Abort = 0x08;      // the message of the stream is dropped, the frame is empty
+      static constexpr uint8_t known_flags = Stream | Compressed | More | Abort; // a frame with other flags is rejected
+      static constexpr size_t max_size = 1 + 5 + 5;
+      enum class Parsed { Complete, Partial, Invalid };
+
+      uint32_t length = 0; // of the message
+      uint8_t flags = 0;
+      uint32_t stream = 0; // logical stream of the connection, 0 if there is none
+      Priority priority = Priority::Normal;
+
+      void setStream(uint32_t id) {
+        stream = id;
+        flags = id == 0 ? uint8_t(flags & ~Stream) : uint8_t(flags | Stream);
+      }
+      size_t size(Framing framing) const;
+      // Returns the end of the header written at out.
+      uint8_t *write(Framing framing, uint8_t *out) const;
+      // V2 header at the start of the size bytes of data: header_size is its size when it is
+      // Complete, the minimum size it can have when it is Partial.
+      static Parsed parse(const uint8_t *data, size_t size, FrameHeader &header, size_t &header_size);
+    };
+  }
+}
+
+// Frame of t in the given format, written in place in a pooled buffer: header.length is set.
+template <typename T>
+fetch::oef::SharedBuffer frame(const T &t, fetch::oef::Framing framing, fetch::oef::FrameHeader header) {
+  header.length = uint32_t(t.ByteSizeLong());
+  auto data = fetch::oef::BufferPool::instance().acquire(header.size(framing) + header.length);
+  (void)t.SerializeWithCachedSizesToArray(header.write(framing, data->data()));
+  return data;
+}
+
+namespace fetch {
+  namespace oef {
+    // Completion condition of the read of a V2 frame in the capacity bytes of data: reads its
+    // header, then its message if the whole frame fits and it is not over max_size.
+    class FrameCondition {
+    private:
+      const uint8_t *data_;
+      size_t capacity_;
+      uint32_t max_size_;
+    public:
+      FrameCondition(const uint8_t *data, size_t capacity, uint32_t max_size)
+        : data_{data}, capacity_{capacity}, max_size_{max_size} {}
+      size_t operator()(const std::error_code &ec, std::size_t transferred) const {
+        if(ec) {
+          return 0;
+        }
+        FrameHeader header;
+        size_t size;
+        switch(FrameHeader::parse(data_, transferred, header, size)) {
+        case FrameHeader::Parsed::Partial:
+          return size - transferred; // does not read past the header
+        case FrameHeader::Parsed::Complete:
+          return header.length <= max_size_ && size + header.length <= capacity_ ? size + header.length - transferred : 0;
+        case FrameHeader::Parsed::Invalid:
+          break;
+        }
+        return 0;
+      }
+    };
+
+    // Reads a frame of the given format: handler(std::error_code, const FrameHeader &, SharedBuffer)
+    // gets its header and message. A V2 frame that fits in a small pooled buffer is read by a
+    // single operation, its header is an error (protocol_error) if it is invalid. A message of more
+    // than max_size bytes is an error (message_size), it is not allocated.
+    template <typename Handler>
+    void asyncReadFrame(asio::ip::tcp::socket &socket, Framing framing, uint32_t max_size, Handler handler,
+                        HandlerMemory *memory = nullptr) {
+      if(framing == Framing::V1) {
+        asyncReadBuffer(socket, 5, [handler=std::move(handler)](std::error_code ec, SharedBuffer buffer) mutable {
+            FrameHeader header;
+            if(buffer) {
+              header.length = uint32_t(buffer->size());
+            }
+            handler(ec, header, std::move(buffer));
+          }, memory, max_size);
+        return;
+      }
+      auto buffer = BufferPool::instance().acquire(FrameHeader::max_size);
+      buffer->resize(buffer->capacity());
+      auto *data = buffer->data();
+      asio::async_read(socket, asio::buffer(data, buffer->size()), FrameCondition{data, buffer->size(), max_size},
+                       withMemory(memory, [buffer,handler=std::move(handler),&socket,memory,max_size](std::error_code ec, std::size_t length) mutable {
+          FrameHeader header;
+          size_t size = 0;
+          if(!ec && FrameHeader::parse(buffer->data(), length, header, size) != FrameHeader::Parsed::Complete) {
+            ec = std::make_error_code(std::errc::protocol_error);
+          } else if(!ec && header.length > max_size) {
+            ec = std::make_error_code(std::errc::message_size);
+          }
+          if(ec) {
+            handler(ec, header, SharedBuffer{});
+            return;
+          }
+          if(length == size + header.length) { // read with its header
+            std::memmove(buffer->data(), buffer->data() + size, header.length);
+            buffer->resize(header.length);
+            handler(ec, header, std::move(buffer));
+            return;
+          }
+          auto message = BufferPool::instance().acquire(header.length);
+          auto *data = message->data();
+          asio::async_read(socket, asio::buffer(data, header.length),
+                           withMemory(memory, [message=std::move(message),header,handler=std::move(handler)](std::error_code ec, std::size_t) mutable {
+              handler(ec, header, std::move(message));
+            }));
+        }));
+    }
+  }
+}
@@ -62,9 +62,12 @@ namespace fetch {
       
       template <typename Arg1, typename... Args>
       void log(const LogLevel level, const char *fmt, const Arg1 &arg1, const Args &... args) {
+        auto lvl = static_cast<spdlog::level::level_enum>(level);
+        if(!logger_->should_log(lvl)) { // the format is not built for the disabled levels
+          return;
+        }
         auto new_fmt = "[{}] " + std::string(fmt);
-        logger_->log(static_cast<spdlog::level::level_enum>(level), new_fmt.c_str(), section(),
-                     arg1, args...);
+        logger_->log(lvl, new_fmt.c_str(), section_, arg1, args...);
       }
 
       template <typename Arg1, typename... Args>
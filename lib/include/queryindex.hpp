@@ -0,0 +1,210 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "schema.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Reverse matching engine: stores many QueryModels and returns the ones satisfied by an
+    // Instance without checking each of them (counting algorithm).
+    // A query is split in conjunctive units: its top level constraints (and the children of
+    // top level Ands) and its top level disjunctions of constraints. The constraints of a unit
+    // are posted on their attribute: equalities and set memberships in hash tables, numeric
+    // ranges in lists sorted by lower bound, anything else in a list checked once per
+    // instance value. A query matches when all its units were hit, then its data model and
+    // the remaining expressions (Not, Or of And, ...) are checked.
+    // Constraints whose value type does not match the attribute type (rejected by
+    // QueryModel::valid) never match.
+    // Not thread safe, match() included: it reuses the counters of the index.
+    class QueryIndex {
+    public:
+      using Id = uint64_t;
+    private:
+      struct Entry {
+        Id id;
+        QueryModel query;
+        std::vector<uint32_t> units;
+        std::vector<const fetch::oef::pb::Query_ConstraintExpr *> residual; // owned by query
+        explicit Entry(Id i, const QueryModel &q) : id{i}, query{q} {}
+      };
+      // Intervals sorted by lower bound, in blocks of at most 2 * block intervals ordered by a
+      // key no greater than their lower bounds. Each block keeps its greatest upper bound so
+      // that blocks ending before the value are skipped. An update changes one block and
+      // finds it in O(log n): the index is updated while the directory lock is held.
+      template <typename T>
+      class Intervals {
+      private:
+        static constexpr size_t block = 32;
+        struct Interval {
+          T lo;
+          T hi;
+          uint32_t unit;
+        };
+        struct Block {
+          std::vector<Interval> items;
+          T max;
+          void refresh() {
+            max = std::max_element(items.begin(), items.end(), [](const Interval &lhs, const Interval &rhs) {
+                return lhs.hi < rhs.hi; })->hi;
+          }
+        };
+        // key -> block: the lower bounds of a block are at least its key, and at most the key
+        // of the next block.
+        using Blocks = std::multimap<T,Block>;
+        Blocks blocks_;
+
+        void add(T lo, T hi, uint32_t unit) {
+          auto iter = blocks_.upper_bound(lo);
+          if(iter == blocks_.begin()) { // before every block: the first one starts at lo.
+            Block first;
+            if(iter != blocks_.end()) {
+              first = std::move(iter->second);
+              blocks_.erase(iter);
+            }
+            iter = blocks_.emplace_hint(blocks_.begin(), lo, std::move(first));
+          } else {
+            --iter;
+          }
+          auto &items = iter->second.items;
+          items.insert(std::upper_bound(items.begin(), items.end(), lo, [](T v, const Interval &i) { return v < i.lo; }),
+                       Interval{lo, hi, unit});
+          if(items.size() > 2 * block) {
+            Block second;
+            second.items.assign(items.begin() + block, items.end());
+            items.resize(block);
+            second.refresh();
+            blocks_.emplace_hint(std::next(iter), second.items.front().lo, std::move(second));
+          }
+          iter->second.refresh();
+        }
+        void remove(T lo, uint32_t unit) {
+          // the intervals starting at lo are in the last block keyed before lo and the ones keyed lo.
+          auto iter = blocks_.lower_bound(lo);
+          if(iter != blocks_.begin()) {
+            --iter;
+          }
+          for(; iter != blocks_.end() && !(lo < iter->first); ++iter) {
+            auto &items = iter->second.items;
+            auto item = std::lower_bound(items.begin(), items.end(), lo, [](const Interval &i, T v) { return i.lo < v; });
+            for(; item != items.end() && !(lo < item->lo); ++item) {
+              if(item->unit == unit) {
+                items.erase(item);
+                if(items.empty()) {
+                  blocks_.erase(iter);
+                } else {
+                  iter->second.refresh();
+                }
+                return;
+              }
+            }
+          }
+        }
+      public:
+        bool empty() const { return blocks_.empty(); }
+        void update(T lo, T hi, uint32_t unit, bool add) {
+          if(add) {
+            this->add(lo, hi, unit);
+          } else {
+            remove(lo, unit);
+          }
+        }
+        template <typename Hit>
+        void hits(T v, Hit hit) const {
+          for(const auto &b : blocks_) {
+            if(v < b.first) {
+              return;
+            }
+            if(b.second.max < v) {
+              continue;
+            }
+            for(const auto &i : b.second.items) {
+              if(v < i.lo) {
+                return;
+              }
+              if(v <= i.hi) {
+                hit(i.unit);
+              }
+            }
+          }
+        }
+      };
+      struct AttributeIndex {
+        std::unordered_map<std::string,std::vector<uint32_t>> strings;
+        std::unordered_map<int64_t,std::vector<uint32_t>> ints;
+        std::vector<uint32_t> bools[2];
+        Intervals<int64_t> int_ranges;
+        Intervals<double> double_ranges;
+        std::vector<std::pair<uint32_t,const fetch::oef::pb::Query_ConstraintExpr_Constraint *>> others; // unit, constraint
+        bool empty() const {
+          return strings.empty() && ints.empty() && bools[0].empty() && bools[1].empty()
+            && int_ranges.empty() && double_ranges.empty() && others.empty();
+        }
+      };
+      // Scratch space of a match, kept by the index: a match only clears the entries it set.
+      struct Counters {
+        std::vector<uint32_t> counts; // slot -> number of units hit
+        std::vector<uint32_t> touched;
+        std::vector<uint8_t> hit; // unit -> already hit
+        std::vector<uint32_t> hit_units;
+      };
+
+      std::vector<std::unique_ptr<Entry>> slots_;
+      std::vector<uint32_t> free_;
+      std::unordered_map<Id,uint32_t> ids_;
+      std::unordered_map<std::string,AttributeIndex> attributes_;
+      std::vector<uint32_t> uncounted_; // queries without any unit
+      std::vector<uint32_t> units_;     // unit -> slot
+      std::vector<uint32_t> free_units_;
+      mutable Counters counters_;
+
+      void post(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, uint32_t unit, bool add);
+      void post(uint32_t slot, Entry &entry, bool add);
+      // counters_ sized for the current slots and units.
+      Counters &counters() const;
+      void match(const Instance &instance, Counters &counters, std::vector<Id> &res) const;
+    public:
+      explicit QueryIndex() = default;
+      QueryIndex(const QueryIndex &) = delete;
+      QueryIndex operator=(const QueryIndex &) = delete;
+      // returns false if id is already used.
+      bool add(Id id, const QueryModel &query);
+      bool remove(Id id);
+      size_t size() const { return ids_.size(); }
+      bool empty() const { return ids_.empty(); }
+      const QueryModel *get(Id id) const {
+        auto iter = ids_.find(id);
+        if(iter == ids_.end()) {
+          return nullptr;
+        }
+        return &slots_[iter->second]->query;
+      }
+      // ids of the queries satisfied by instance, in no particular order.
+      std::vector<Id> match(const Instance &instance) const;
+      std::vector<std::vector<Id>> match(const std::vector<Instance> &instances) const;
+      std::vector<std::vector<Id>> match(const std::vector<const Instance *> &instances) const;
+    };
+  }
+}
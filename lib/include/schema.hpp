@@ -19,10 +19,14 @@
 
 #include "agent.pb.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <cstring>
 #include <experimental/optional>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include "mapbox/variant.hpp"
 #include <mutex>
 #include <stdexcept>
@@ -463,11 +467,113 @@ namespace fetch {
       }
     };
     
-    class DataModel {
+    // Node wide registry of interned data models: equal models (same serialized content) share
+    // one immutable copy and one id, so that instances only keep a pointer to their model and
+    // models are compared with an integer.
+    // An id is never reused. Models nobody refers to anymore are dropped from time to time.
+    // Thread safe.
+    class DataModels {
+    public:
+      struct Entry {
+        uint32_t id;
+        std::size_t hash; // of the serialized model
+        std::string bytes;
+        fetch::oef::pb::Query_DataModel model;
+        std::unordered_map<std::string,uint32_t> slots; // attribute name -> index in model.attributes()
+        explicit Entry(uint32_t i, std::size_t h, std::string b, const fetch::oef::pb::Query_DataModel &m)
+          : id{i}, hash{h}, bytes{std::move(b)}, model{m} {
+          for(int slot = 0; slot < model.attributes_size(); ++slot) {
+            slots.emplace(model.attributes(slot).name(), uint32_t(slot));
+          }
+        }
+        // -1 if name is not an attribute of the model.
+        int slot(const std::string &name) const {
+          auto iter = slots.find(name);
+          return iter == slots.end() ? -1 : int(iter->second);
+        }
+      };
+      using Ptr = std::shared_ptr<const Entry>;
     private:
-      fetch::oef::pb::Query_DataModel model_;
+      std::mutex lock_;
+      std::unordered_multimap<std::size_t,std::weak_ptr<const Entry>> models_;
+      uint32_t next_id_ = 1;
+      std::size_t purge_at_ = 64;
+
+      // Models recently interned by the thread, by hash, looked up before the registry: the
+      // messages a thread processes carry few different models, so the lock is only taken for
+      // new ones. The cache does not keep the models alive.
+      struct Recent {
+        std::size_t hash = 0;
+        std::weak_ptr<const Entry> entry;
+      };
+      static constexpr std::size_t nb_recent = 16;
+      static std::array<Recent,nb_recent> &recent() {
+        thread_local std::array<Recent,nb_recent> models;
+        return models;
+      }
+      static DataModels &registry() {
+        static DataModels models;
+        return models;
+      }
+      void purge() {
+        for(auto iter = models_.begin(); iter != models_.end();) {
+          if(iter->second.expired()) {
+            iter = models_.erase(iter);
+          } else {
+            ++iter;
+          }
+        }
+        purge_at_ = std::max(std::size_t(64), 2 * models_.size());
+      }
+      // The registered entry of the model serialized as bytes, added if there is none.
+      static Ptr find(std::size_t hash, std::string bytes, const fetch::oef::pb::Query_DataModel &model) {
+        auto &self = registry();
+        std::lock_guard<std::mutex> lock(self.lock_);
+        auto range = self.models_.equal_range(hash);
+        for(auto iter = range.first; iter != range.second; ++iter) {
+          // the entry is not released while the lock is held, an expired one is reused.
+          Ptr entry = iter->second.lock();
+          if(entry && entry->bytes == bytes) {
+            return entry;
+          }
+        }
+        if(self.models_.size() >= self.purge_at_) {
+          self.purge();
+        }
+        // not allocated with make_shared: an expired weak pointer does not keep the model alive.
+        Ptr entry{new Entry{self.next_id_++, hash, std::move(bytes), model}};
+        self.models_.emplace(hash, entry);
+        return entry;
+      }
     public:
-      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes) {
+      static Ptr intern(const fetch::oef::pb::Query_DataModel &model) {
+        std::string bytes = model.SerializePartialAsString(); // the default model has no name
+        std::size_t hash = std::hash<std::string>{}(bytes);
+        auto &cached = recent()[hash % nb_recent];
+        if(cached.hash == hash) {
+          Ptr entry = cached.entry.lock();
+          if(entry && entry->bytes == bytes) {
+            return entry;
+          }
+        }
+        Ptr entry = find(hash, std::move(bytes), model);
+        cached.hash = hash;
+        cached.entry = entry;
+        return entry;
+      }
+      // number of models, including the ones not purged yet.
+      static std::size_t size() {
+        auto &self = registry();
+        std::lock_guard<std::mutex> lock(self.lock_);
+        return self.models_.size();
+      }
+    };
+
+    class DataModel {
+    private:
+      DataModels::Ptr model_;
+
+      static fetch::oef::pb::Query_DataModel build(const std::string &name, const std::vector<Attribute> &attributes) {
         std::unordered_set<std::string> att_set;
         for(auto &a : attributes) {
           auto pair = att_set.insert(a.name());
@@ -475,22 +581,41 @@ namespace fetch {
             throw std::invalid_argument("Duplicate attribute name");
           }
         }
-        model_.set_name(name);
-        auto *atts = model_.mutable_attributes();
+        fetch::oef::pb::Query_DataModel model;
+        model.set_name(name);
+        auto *atts = model.mutable_attributes();
         for(auto &a : attributes) {
           auto *att = atts->Add();
           att->CopyFrom(a.handle());
         }
+        return model;
       }
-      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes, const std::string &description)
-        : DataModel{name, attributes} {
-        model_.set_description(description);
+    public:
+      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes)
+        : model_{DataModels::intern(build(name, attributes))} {}
+      explicit DataModel(const std::string &name, const std::vector<Attribute> &attributes, const std::string &description) {
+        auto model = build(name, attributes);
+        model.set_description(description);
+        model_ = DataModels::intern(model);
+      }
+      // not checked, see valid().
+      explicit DataModel(const fetch::oef::pb::Query_DataModel &model) : model_{DataModels::intern(model)} {}
+      const fetch::oef::pb::Query_DataModel &handle() const { return model_->model; }
+      const DataModels::Ptr &interned() const { return model_; }
+      // Checks the attribute names are unique, as the other constructors do.
+      bool valid() const {
+        std::unordered_set<std::string> att_set;
+        for(auto &a : model_->model.attributes()) {
+          if(!att_set.insert(a.name()).second) {
+            return false;
+          }
+        }
+        return true;
       }
-      const fetch::oef::pb::Query_DataModel &handle() const { return model_; }
+      uint32_t id() const { return model_->id; }
       bool operator==(const DataModel &other) const
       {
-        return model_.name() == other.model_.name();
-        // TODO: should check more.
+        return model_->id == other.model_->id;
       }
       static stde::optional<fetch::oef::pb::Query_Attribute> attribute(const fetch::oef::pb::Query_DataModel &model,
                                                                        const std::string &name) {
@@ -501,7 +626,7 @@ namespace fetch {
         }
         return stde::nullopt;
       }
-      std::string name() const { return model_.name(); }
+      std::string name() const { return model_->model.name(); }
       static std::vector<std::pair<std::string,std::string>>
       instantiate(const fetch::oef::pb::Query_DataModel &model, const std::unordered_map<std::string,VariantType> &values) {
         std::vector<std::pair<std::string,std::string>> res;
@@ -512,12 +637,179 @@ namespace fetch {
       }
     };
     
+    // The values are stored by slot, the index of their attribute in the interned data model,
+    // so that attribute names are not stored per instance. The protobuf form is only built
+    // when the instance is sent, see handle().
     class Instance {
+    public:
+      using Value = std::pair<uint32_t,VariantType>; // slot, value
     private:
-      fetch::oef::pb::Query_Instance instance_;
-      std::unordered_map<std::string,VariantType> values_;
+      // The protobuf form, built by the first handle() call: the thread that publishes it first
+      // wins. Not copied with the instance, it is built again if needed.
+      class Handle {
+      private:
+        mutable std::atomic<const fetch::oef::pb::Query_Instance*> handle_{nullptr};
+      public:
+        Handle() = default;
+        Handle(const Handle &) {}
+        Handle(Handle &&other) noexcept : handle_{other.handle_.exchange(nullptr)} {}
+        Handle &operator=(const Handle &other) {
+          if(this != &other) {
+            delete handle_.exchange(nullptr);
+          }
+          return *this;
+        }
+        Handle &operator=(Handle &&other) noexcept {
+          if(this != &other) {
+            delete handle_.exchange(other.handle_.exchange(nullptr));
+          }
+          return *this;
+        }
+        ~Handle() { delete handle_.load(); }
+        template <typename F>
+        const fetch::oef::pb::Query_Instance &get(F build) const {
+          const auto *handle = handle_.load(std::memory_order_acquire);
+          if(handle) {
+            return *handle;
+          }
+          auto *built = new fetch::oef::pb::Query_Instance;
+          build(*built);
+          if(handle_.compare_exchange_strong(handle, built, std::memory_order_acq_rel)) {
+            return *built;
+          }
+          delete built;
+          return *handle;
+        }
+      };
+
+      DataModels::Ptr model_;
+      std::vector<Value> values_; // sorted by slot
+      std::size_t hash_; // computed once, an Instance is not modified after construction
+      bool unknown_ = false; // values received for unknown attributes, without value or twice: not valid()
+      Handle handle_;
+
+      // splitmix64 finalizer: every input bit affects every output bit.
+      static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+      }
+      static uint64_t bits(double d) {
+        if(d == 0.0) { // -0.0 == 0.0
+          d = 0.0;
+        }
+        uint64_t b;
+        std::memcpy(&b, &d, sizeof(b));
+        return b;
+      }
+      // The value type is part of the hash, as for operator==.
+      static uint64_t hashValue(const VariantType &v) {
+        uint64_t h = 0;
+        v.match([&h](int i) { h = mix(uint64_t(int64_t(i)) ^ 0x1ULL); },
+                [&h](double d) { h = mix(bits(d) ^ 0x2ULL); },
+                [&h](const std::string &s) { h = mix(std::hash<std::string>{}(s) ^ 0x3ULL); },
+                [&h](const Location &l) { h = mix(mix(bits(l.lon)) + bits(l.lat) + 0x4ULL); },
+                [&h](bool b) { h = mix(uint64_t(b) + 0x5ULL); });
+        return h;
+      }
+      // Independent of the order of the values: the mixed (slot, value) hashes are summed.
+      // The slot is not mixed as the values are, they could cancel each other.
+      std::size_t computeHash() const {
+        uint64_t sum = 0;
+        for(const auto &v : values_) {
+          sum += mix(((uint64_t(v.first) + 1) * 0x9e3779b97f4a7c15ULL) ^ hashValue(v.second));
+        }
+        return std::size_t(mix(mix(model_->hash + values_.size()) ^ sum));
+      }
+      static fetch::oef::pb::Query_Attribute_Type type(const VariantType &v) {
+        auto t = fetch::oef::pb::Query_Attribute_Type_INT;
+        v.match([&t](int) { t = fetch::oef::pb::Query_Attribute_Type_INT; },
+                [&t](double) { t = fetch::oef::pb::Query_Attribute_Type_DOUBLE; },
+                [&t](const std::string &) { t = fetch::oef::pb::Query_Attribute_Type_STRING; },
+                [&t](const Location &) { t = fetch::oef::pb::Query_Attribute_Type_LOCATION; },
+                [&t](bool) { t = fetch::oef::pb::Query_Attribute_Type_BOOL; });
+        return t;
+      }
+      // false if value is not set.
+      static bool fromPb(const fetch::oef::pb::Query_Value &value, VariantType &v) {
+        switch(value.value_case()) {
+        case fetch::oef::pb::Query_Value::kS:
+          v = VariantType{value.s()};
+          return true;
+        case fetch::oef::pb::Query_Value::kD:
+          v = VariantType{value.d()};
+          return true;
+        case fetch::oef::pb::Query_Value::kB:
+          v = VariantType{value.b()};
+          return true;
+        case fetch::oef::pb::Query_Value::kI:
+          v = VariantType{int(value.i())};
+          return true;
+        case fetch::oef::pb::Query_Value::kL:
+          v = VariantType{Location{value.l().lon(), value.l().lat()}};
+          return true;
+        case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
+        default:
+          return false;
+        }
+      }
+      static void toPb(const VariantType &v, fetch::oef::pb::Query_Value &value) {
+        v.match([&value](int i) { value.set_i(i); },
+                [&value](double d) { value.set_d(d); },
+                [&value](const std::string &s) { value.set_s(s); },
+                [&value](const Location &l) {
+                  auto *loc = value.mutable_l();
+                  loc->set_lon(l.lon);
+                  loc->set_lat(l.lat);
+                },
+                [&value](bool b) { value.set_b(b); });
+      }
+      // Sorts the values by slot, only the last of the values of a slot is kept.
+      void sort() {
+        std::stable_sort(values_.begin(), values_.end(), [](const Value &lhs, const Value &rhs) { return lhs.first < rhs.first; });
+        auto out = values_.begin();
+        for(auto iter = values_.begin(); iter != values_.end(); ++iter) {
+          if(iter + 1 != values_.end() && (iter + 1)->first == iter->first) {
+            unknown_ = true;
+            continue;
+          }
+          if(out != iter) {
+            *out = std::move(*iter);
+          }
+          ++out;
+        }
+        values_.erase(out, values_.end());
+      }
+      void fill(fetch::oef::pb::Query_Instance &instance) const {
+        auto *vals = instance.mutable_values();
+        vals->Reserve(int(values_.size()));
+        for(const auto &v : values_) {
+          auto *kv = vals->Add();
+          kv->set_key(model_->model.attributes(int(v.first)).name());
+          toPb(v.second, *kv->mutable_value());
+        }
+      }
+      explicit Instance(DataModels::Ptr model, const fetch::oef::pb::Query_Instance &instance) : model_{std::move(model)}
+      {
+        values_.reserve(size_t(instance.values_size()));
+        for(auto &kv : instance.values()) {
+          int slot = model_->slot(kv.key());
+          VariantType v;
+          if(slot < 0 || !fromPb(kv.value(), v)) {
+            unknown_ = true;
+            continue;
+          }
+          values_.emplace_back(uint32_t(slot), std::move(v));
+        }
+        sort();
+        hash_ = computeHash();
+      }
     public:
-      explicit Instance(const DataModel &model, const std::unordered_map<std::string,VariantType> &values) : values_{values} {
+      explicit Instance(const DataModel &model, const std::unordered_map<std::string,VariantType> &values)
+        : model_{model.interned()} {
         if(values.size() > size_t(model.handle().attributes_size())) {
           throw std::invalid_argument("Too many attributes");
         }
@@ -529,135 +821,155 @@ namespace fetch {
         if(values.size() < nb_required) {
           throw std::invalid_argument("Not enough attributes");
         }
-        auto *mod = instance_.mutable_model();
-        mod->CopyFrom(model.handle());
-        auto *vals = instance_.mutable_values();
+        values_.reserve(values.size());
         for(auto &v : values) {
-          const auto iter = std::find_if(model.handle().attributes().begin(), model.handle().attributes().end(),
-                                         [&v](const fetch::oef::pb::Query_Attribute &a) {
-                                           return v.first == a.name();
-                                         });
-          if(iter == model.handle().attributes().end()) {
+          int slot = model_->slot(v.first);
+          if(slot < 0) {
             // attribute does not exist in datamodel
             throw std::invalid_argument("Attribute does not exist in data model.");
           }
-          auto att_type = iter->type();
-          if(iter->required())
+          const auto &att = model.handle().attributes(slot);
+          if(type(v.second) != att.type()) {
+            std::string expected;
+            v.second.match([&expected](int) { expected = "an int"; },
+                           [&expected](double) { expected = "a double"; },
+                           [&expected](const std::string &) { expected = "a string"; },
+                           [&expected](const Location &) { expected = "a location"; },
+                           [&expected](bool) { expected = "a bool"; });
+            throw std::invalid_argument("Attribute is not " + expected + " in data model.");
+          }
+          if(att.required())
             --nb_required;
-          auto *val = vals->Add();
-          val->set_key(v.first);
-          auto *value = val->mutable_value();
-          v.second.match(
-                         [att_type, value](int i) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_INT) {
-                             throw std::invalid_argument("Attribute is not an int in data model.");
-                           }
-                           value->set_i(i);
-                         },
-                         [att_type, value](double d) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_DOUBLE) {
-                             throw std::invalid_argument("Attribute is not a double in data model.");
-                           }
-                           value->set_d(d);
-                         },
-                         [att_type, value](const std::string &s) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_STRING) {
-                             throw std::invalid_argument("Attribute is not a string in data model.");
-                           }
-                           value->set_s(s);
-                         },
-                         [att_type, value](const Location &l) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_LOCATION) {
-                             throw std::invalid_argument("Attribute is not a location in data model.");
-                           }
-                           auto *loc = value->mutable_l();
-                           loc->set_lon(l.lon);
-                           loc->set_lat(l.lat);
-                         },
-                         [att_type, value](bool b) {
-                           if(att_type != fetch::oef::pb::Query_Attribute_Type_BOOL) {
-                             throw std::invalid_argument("Attribute is not a bool in data model.");
-                           }
-                           value->set_b(b);
-                         });
+          values_.emplace_back(uint32_t(slot), v.second);
         }
         if(nb_required > 0) {
           throw std::invalid_argument("Not enough attributes.");
         }
+        sort();
+        hash_ = computeHash();
+      }
+      explicit Instance(const fetch::oef::pb::Query_Instance &instance) : Instance{DataModels::intern(instance.model()), instance} {}
+      // instance whose data model was sent as a schema id.
+      explicit Instance(const DataModel &model, const fetch::oef::pb::Query_Instance &instance) : Instance{model.interned(), instance} {}
+      // Built on the first call, when the instance is sent, and kept with the instance.
+      const fetch::oef::pb::Query_Instance &handle() const {
+        return handle_.get([this](fetch::oef::pb::Query_Instance &instance) {
+            instance.mutable_model()->CopyFrom(model_->model);
+            fill(instance);
+          });
+      }
+      // the values only, the data model being referenced by schema_id (see SchemaDirectory).
+      // Built on each call.
+      fetch::oef::pb::Query_Instance handle(uint32_t schema_id) const {
+        fetch::oef::pb::Query_Instance instance;
+        instance.set_schema_id(schema_id);
+        fill(instance);
+        return instance;
       }
-      explicit Instance(const fetch::oef::pb::Query_Instance &instance) : instance_{instance}
+      bool operator==(const Instance &other) const
       {
-        const auto &values = instance_.values();
+        return hash_ == other.hash_ && model_->id == other.model_->id && values_ == other.values_;
+      }
+      std::size_t hash() const {
+        return hash_;
+      }
+      // Copy of this instance with the given values replaced or added.
+      Instance updated(const google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> &values) const {
+        fetch::oef::pb::Query_Instance instance;
+        fill(instance);
+        auto *vals = instance.mutable_values();
         for(auto &v : values) {
-          switch(v.value().value_case()) {
-          case fetch::oef::pb::Query_Value::kS:
-            values_[v.key()] = VariantType{v.value().s()};
-            break;
-          case fetch::oef::pb::Query_Value::kD:
-            values_[v.key()] = VariantType{v.value().d()};
-            break;
-          case fetch::oef::pb::Query_Value::kB:
-            values_[v.key()] = VariantType{v.value().b()};
-            break;
-          case fetch::oef::pb::Query_Value::kI:
-            values_[v.key()] = VariantType{int(v.value().i())};
-            break;
-          case fetch::oef::pb::Query_Value::kL:
-            values_[v.key()] = VariantType{Location{v.value().l().lon(), v.value().l().lat()}};
-            break;
-          case fetch::oef::pb::Query_Value::VALUE_NOT_SET:
-          default:
-            break;
+          auto iter = std::find_if(vals->begin(), vals->end(), [&v](const fetch::oef::pb::Query_KeyValue &kv) {
+              return kv.key() == v.key(); });
+          if(iter == vals->end()) {
+            vals->Add()->CopyFrom(v);
+          } else {
+            iter->mutable_value()->CopyFrom(v.value());
           }
         }
+        return Instance{model_, instance};
       }
-      const fetch::oef::pb::Query_Instance &handle() const { return instance_; }
-      bool operator==(const Instance &other) const
-      {
-        if(!(instance_.model().name() == other.instance_.model().name())) {
+      // Checks the values against the data model, as the DataModel constructor does: instances
+      // received from the network are not checked.
+      bool valid() const {
+        if(unknown_) {
           return false;
         }
-        for(const auto &p : values_) {
-          const auto &iter = other.values_.find(p.first);
-          if(iter == other.values_.end()) {
-            return false;
-          }
-          if(iter->second != p.second) {
+        size_t nb_required = 0;
+        for(auto &att : model_->model.attributes()) {
+          if(att.required())
+            ++nb_required;
+        }
+        for(const auto &v : values_) {
+          const auto &att = model_->model.attributes(int(v.first));
+          if(type(v.second) != att.type()) {
             return false;
           }
+          if(att.required())
+            --nb_required;
         }
-        return true;
-      }
-      std::size_t hash() const {
-        std::size_t h = std::hash<std::string>{}(instance_.model().name());
-        for(const auto &p : values_) {
-          std::size_t hs = std::hash<std::string>{}(p.first);
-          h = hs ^ (h << 1);
-          p.second.match([&hs](int i) { hs = std::hash<int>{}(i);},
-                         [&hs](double d) { hs = std::hash<double>{}(d);},
-                         [&hs](const std::string &s) { hs = std::hash<std::string>{}(s);},
-                         [&hs](const Location &l) {
-                           std::size_t h1 = std::hash<double>{}(l.lon);
-                           hs = h1 ^ (std::hash<double>{}(l.lat) << 1);},
-                         [&hs](bool b) { hs = std::hash<bool>{}(b);});
-          h = hs ^ (h << 2);
-        }
-        return h;
+        return nb_required == 0;
       }
       
       std::vector<std::pair<std::string,std::string>>
       instantiate() const {
-        return DataModel::instantiate(instance_.model(), values_);
+        std::vector<std::pair<std::string,std::string>> res;
+        const auto &attributes = model_->model.attributes();
+        for(int slot = 0; slot < attributes.size(); ++slot) {
+          const auto &a = attributes.Get(slot);
+          const auto *v = find(uint32_t(slot));
+          if(!v) {
+            if(a.required()) {
+              throw std::invalid_argument(std::string("Missing value: ") + a.name());
+            }
+            res.emplace_back(a.name(), "");
+          } else if(type(*v) != a.type()) {
+            throw std::invalid_argument(a.name() + std::string(" has a wrong type of value ") + to_string(*v));
+          } else {
+            res.emplace_back(a.name(), to_string(*v));
+          }
+        }
+        return res;
       }
       const fetch::oef::pb::Query_DataModel &model() const {
-        return instance_.model();
+        return model_->model;
+      }
+      // id of the interned data model.
+      uint32_t modelId() const {
+        return model_->id;
       }
       stde::optional<VariantType> value(const std::string &name) const {
-        auto iter = values_.find(name);
-        if(iter == values_.end()) {
+        const auto *v = find(name);
+        if(!v) {
           return stde::nullopt;
         }
-        return stde::optional<VariantType>{iter->second};
+        return stde::optional<VariantType>{*v};
+      }
+      // no copy version of value(), nullptr if the attribute at slot has no value.
+      const VariantType *find(uint32_t slot) const {
+        if(slot < values_.size() && values_[slot].first == slot) { // all the values before are set
+          return &values_[slot].second;
+        }
+        auto iter = std::lower_bound(values_.begin(), values_.end(), slot,
+                                     [](const Value &v, uint32_t s) { return v.first < s; });
+        if(iter == values_.end() || iter->first != slot) {
+          return nullptr;
+        }
+        return &iter->second;
+      }
+      // nullptr if name has no value.
+      const VariantType *find(const std::string &name) const {
+        int slot = model_->slot(name);
+        if(slot < 0) {
+          return nullptr;
+        }
+        return find(uint32_t(slot));
+      }
+      template <typename F>
+      void for_each_value(F f) const {
+        for(const auto &v : values_) {
+          f(model_->model.attributes(int(v.first)).name(), v.second);
+        }
       }
     };
 
@@ -734,14 +1046,8 @@ namespace fetch {
       }
       static bool check(const fetch::oef::pb::Query_ConstraintExpr_Constraint &constraint, const Instance &i) {
         auto &attribute_name = constraint.attribute_name();
-        auto attr = DataModel::attribute(i.model(), attribute_name);
-        if(attr) {
-          // Need to check attr->type with the constraint admissible types -> tricky
-          // if(attr->type() != attribute.type()) {
-          //   return false;
-          // }
-        }
-        auto v = i.value(attribute_name);
+        // Need to check the attribute type with the constraint admissible types -> tricky
+        const auto *v = i.find(attribute_name);
         if(!v) {
           // if(attribute.required()) {
           //   std::cerr << "Should not happen!\n"; // Exception ?
@@ -889,6 +1195,7 @@ namespace fetch {
     class QueryModel {
     private:
       fetch::oef::pb::Query_Model model_;
+      DataModels::Ptr data_model_; // nullptr without data model
     public:
       explicit QueryModel(const std::vector<ConstraintExpr> &constraints) {
         if(constraints.size() < 1) {
@@ -900,16 +1207,30 @@ namespace fetch {
           ct->CopyFrom(c.handle());
         }
       }
-      explicit QueryModel(const std::vector<ConstraintExpr> &constraints, const DataModel &model) : QueryModel{constraints} {
-        auto *m = model_.mutable_model();
-        m->CopyFrom(model.handle());
+      explicit QueryModel(const std::vector<ConstraintExpr> &constraints, const DataModel &model) : QueryModel{constraints, model, 0} {}
+      // The data model is sent as schema_id (see SchemaDirectory) unless it is 0.
+      explicit QueryModel(const std::vector<ConstraintExpr> &constraints, const DataModel &model, uint32_t schema_id) : QueryModel{constraints} {
+        if(schema_id > 0) {
+          model_.set_schema_id(schema_id);
+        } else {
+          model_.mutable_model()->CopyFrom(model.handle());
+        }
+        data_model_ = model.interned();
         for(auto &c : model_.constraints()) {
-          if(!ConstraintExpr::valid(c, model_.model())) {
+          if(!ConstraintExpr::valid(c, model.handle())) {
             throw std::invalid_argument("Mismatch between constraints in data model.");
           }
         }
       }
-      explicit QueryModel(const fetch::oef::pb::Query_Model &model) : model_{model} {}
+      // A schema id not resolved with the constructor below only matches instances without data model.
+      explicit QueryModel(const fetch::oef::pb::Query_Model &model) : model_{model} {
+        if(model_.has_model() || model_.has_schema_id()) {
+          data_model_ = DataModels::intern(model_.model());
+        }
+      }
+      // query whose data model was sent as a schema id.
+      explicit QueryModel(const fetch::oef::pb::Query_Model &model, const DataModel &data_model)
+        : model_{model}, data_model_{data_model.interned()} {}
       const fetch::oef::pb::Query_Model &handle() const { return model_; }
       template <typename T>
       bool check_value(const T &v) const {
@@ -925,22 +1246,23 @@ namespace fetch {
         if(model_.constraints_size() < 1) {
           return false;
         }
-        if(!model_.has_model()) { // no model, so we cannot check.
+        if(!data_model_) { // no model, so we cannot check.
           return true;
         }
         for(auto &c : model_.constraints()) {
-          if(!ConstraintExpr::valid(c, model_.model())) {
+          if(!ConstraintExpr::valid(c, data_model_->model)) {
             return false;
           }
         }
         return true;
       }
+      // true if the query has no data model or the same one as i.
+      bool checkModel(const Instance &i) const {
+        return !data_model_ || data_model_->id == i.modelId();
+      }
       bool check(const Instance &i) const {
-        if(model_.has_model()) {
-          if(model_.model().name() != i.model().name()) {
-            return false;
-          }
-          // TODO: more to compare ?
+        if(!checkModel(i)) {
+          return false;
         }
         for(auto &c : model_.constraints()) {
           if(!ConstraintExpr::check(c, i)) {
@@ -968,54 +1290,145 @@ namespace fetch {
     public:
       explicit Schema(uint32_t version, const DataModel &schema) : version_{version}, schema_{schema} {}
       uint32_t version() const { return version_; }
-      DataModel schema() const { return schema_; }
+      const DataModel &schema() const { return schema_; }
     };
     
+    // Versions of a schema, sorted by version.
+    // Not thread safe: SchemaDirectory only publishes copies that are not modified anymore.
     class Schemas {
     private:
-      mutable std::mutex lock_;
-      std::vector<Schema> schemas_;
+      std::vector<std::shared_ptr<const Schema>> schemas_;
     public:
       explicit Schemas() = default;
+      // version max means the last version + 1. Returns the version, 0 if it is already registered.
       uint32_t add(uint32_t version, const DataModel &schema) {
-        std::lock_guard<std::mutex> lock(lock_);
         if(version == std::numeric_limits<uint32_t>::max()) {
-          version = schemas_.size() + 1;
+          version = schemas_.empty() ? 1 : schemas_.back()->version() + 1;
         }
-        schemas_.emplace_back(Schema(version, schema));
+        auto iter = std::lower_bound(schemas_.begin(), schemas_.end(), version,
+                                     [](const std::shared_ptr<const Schema> &s, uint32_t v) { return s->version() < v; });
+        if(iter != schemas_.end() && (*iter)->version() == version) {
+          return 0;
+        }
+        schemas_.insert(iter, std::make_shared<const Schema>(version, schema));
         return version;
       }
-      stde::optional<Schema> get(uint32_t version) const {
-        std::lock_guard<std::mutex> lock(lock_);
+      // The first schema whose version is at least version, the last one if there is none.
+      std::shared_ptr<const Schema> get(uint32_t version) const {
         if(schemas_.empty()) {
-          return stde::nullopt;
+          return nullptr;
         }
-        if(version == std::numeric_limits<uint32_t>::max()) {
+        auto iter = std::lower_bound(schemas_.begin(), schemas_.end(), version,
+                                     [](const std::shared_ptr<const Schema> &s, uint32_t v) { return s->version() < v; });
+        if(iter == schemas_.end()) {
           return schemas_.back();
         }
-        for(auto &p : schemas_) { // TODO: binary search
-          if(p.version() >= version) {
-            return p;
-          }
-        }
-        return schemas_.back();
+        return *iter;
       }
     };
     
+    // Data models registered by the agents, by name and version, and by schema id: the id of
+    // the interned model (see DataModels), so that all the instances of a schema share its model.
+    // Thread safe. Readers take no lock: they count themselves in readers_ and load the current
+    // immutable snapshot. Writers (rare) copy it, which is linear in the number of schemas since
+    // the maps of pointers are copied, and publish the copy; the snapshots they replace are freed
+    // once a writer sees no reader in progress.
     class SchemaDirectory {
     private:
-      std::unordered_map<std::string, Schemas> schemas_;
+      struct Snapshot {
+        std::unordered_map<std::string, std::shared_ptr<const Schemas>> names;
+        std::unordered_map<uint32_t, std::shared_ptr<const Schema>> ids;
+      };
+      std::atomic<const Snapshot*> snapshot_;
+      mutable std::atomic<uint64_t> readers_{0};
+      std::mutex write_lock_;
+      std::vector<std::unique_ptr<const Snapshot>> retired_; // under write_lock_
+
+      // The snapshot loaded when it is created, which is not freed while it exists.
+      class Reader {
+      private:
+        const SchemaDirectory &directory_;
+        const Snapshot *snapshot_;
+      public:
+        explicit Reader(const SchemaDirectory &directory) : directory_{directory} {
+          directory_.readers_.fetch_add(1);
+          snapshot_ = directory_.snapshot_.load();
+        }
+        ~Reader() { directory_.readers_.fetch_sub(1); }
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+        const Snapshot *operator->() const { return snapshot_; }
+      };
+      // under write_lock_. A reader counted after readers_ is seen at 0 loads next (or a later one).
+      void publish(std::unique_ptr<const Snapshot> next) {
+        retired_.emplace_back(snapshot_.exchange(next.release()));
+        if(readers_.load() == 0) {
+          retired_.clear();
+        }
+      }
+      // under write_lock_, 0 if version is already registered under key.
+      uint32_t add(Snapshot &next, const std::string &key, const DataModel &schema, uint32_t version) {
+        auto iter = next.names.find(key);
+        auto schemas = iter == next.names.end() ? std::make_shared<Schemas>() : std::make_shared<Schemas>(*iter->second);
+        version = schemas->add(version, schema);
+        if(version == 0) {
+          return 0;
+        }
+        next.ids.emplace(schema.id(), schemas->get(version));
+        next.names[key] = std::move(schemas);
+        return version;
+      }
     public:
-      explicit SchemaDirectory() = default;
-      stde::optional<Schema> get(const std::string &key, uint32_t version = std::numeric_limits<uint32_t>::max()) const {
-        const auto &iter = schemas_.find(key);
-        if(iter != schemas_.end()) {
-          return iter->second.get(version);
+      explicit SchemaDirectory() : snapshot_{new Snapshot} {}
+      ~SchemaDirectory() { delete snapshot_.load(); }
+      SchemaDirectory(const SchemaDirectory &) = delete;
+      SchemaDirectory &operator=(const SchemaDirectory &) = delete;
+      std::shared_ptr<const Schema> get(const std::string &key, uint32_t version = std::numeric_limits<uint32_t>::max()) const {
+        Reader snapshot{*this};
+        const auto &iter = snapshot->names.find(key);
+        if(iter != snapshot->names.end()) {
+          return iter->second->get(version);
         }
-        return stde::nullopt;
+        return nullptr;
       }
+      // Returns the version of schema, 0 if version is already registered under key.
       uint32_t add(const std::string &key, const DataModel &schema, uint32_t version = std::numeric_limits<uint32_t>::max()) {
-        return schemas_[key].add(version, schema);
+        std::lock_guard<std::mutex> lock(write_lock_);
+        auto next = std::make_unique<Snapshot>(*snapshot_.load());
+        version = add(*next, key, schema, version);
+        if(version > 0) {
+          publish(std::move(next));
+        }
+        return version;
+      }
+      // Registers model under its name, as a new version unless the same model is already
+      // registered. Returns its version, model.id() being its schema id.
+      uint32_t registerSchema(const DataModel &model) {
+        auto registered = find(model.id());
+        if(registered) {
+          return registered->version();
+        }
+        std::lock_guard<std::mutex> lock(write_lock_);
+        const Snapshot &current = *snapshot_.load();
+        auto iter = current.ids.find(model.id()); // registered meanwhile
+        if(iter != current.ids.end()) {
+          return iter->second->version();
+        }
+        auto next = std::make_unique<Snapshot>(current);
+        uint32_t version = add(*next, model.name(), model, std::numeric_limits<uint32_t>::max());
+        publish(std::move(next));
+        return version;
+      }
+      std::shared_ptr<const Schema> find(uint32_t schema_id) const {
+        Reader snapshot{*this};
+        auto iter = snapshot->ids.find(schema_id);
+        if(iter == snapshot->ids.end()) {
+          return nullptr;
+        }
+        return iter->second;
+      }
+      size_t size() const {
+        return Reader{*this}->ids.size();
       }
     };
     
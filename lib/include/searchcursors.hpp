@@ -0,0 +1,121 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "agent.pb.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Server side cursors of an agent session: the search of a result not sent yet, which is
+    // run again for each page, skipping the agents already sent. Nothing but the agents sent
+    // is kept, so that a page can include agents registered since the previous one.
+    // When too many cursors are open, the oldest one is dropped.
+    // Not thread safe.
+    class SearchCursors {
+    public:
+      // At most max agents (0 means no limit) of the result which are not in skip.
+      using Search = std::function<std::vector<std::string>(size_t max, const std::unordered_set<std::string> &skip)>;
+    private:
+      struct Cursor {
+        Search search;
+        std::unordered_set<std::string> sent;
+      };
+      size_t max_cursors_;
+      uint64_t next_id_ = 1;
+      std::map<uint64_t,Cursor> cursors_; // oldest first
+
+      // Fills result with at most limit agents of search(limit + 1), or with all of them if limit
+      // is 0. True if some are left, those filled are then added to sent.
+      static bool fill(std::vector<std::string> agents, uint32_t limit, fetch::oef::pb::Server_SearchResult &result,
+                       std::unordered_set<std::string> *sent) {
+        bool more = limit > 0 && agents.size() > limit;
+        if(more) {
+          agents.resize(limit);
+          sent->insert(agents.begin(), agents.end());
+        }
+        auto *res = result.mutable_agents();
+        res->Reserve(int(agents.size()));
+        for(auto &a : agents) {
+          res->Add(std::move(a));
+        }
+        return more;
+      }
+      static size_t max(uint32_t limit) {
+        return limit > 0 ? size_t(limit) + 1 : 0;
+      }
+    public:
+      explicit SearchCursors(size_t max_cursors = 16) : max_cursors_{max_cursors} {}
+      size_t size() const { return cursors_.size(); }
+      // Fills result with at most limit (0 means no limit) agents of search, result.cursor() is
+      // set if there are some more. agents is search(limit + 1, {}), or all of them if limit is 0.
+      void page(std::vector<std::string> agents, Search search, uint32_t limit, fetch::oef::pb::Server_SearchResult &result) {
+        Cursor cursor{std::move(search), {}};
+        if(!fill(std::move(agents), limit, result, &cursor.sent)) {
+          return;
+        }
+        if(cursors_.size() >= max_cursors_) {
+          cursors_.erase(cursors_.begin());
+        }
+        uint64_t id = next_id_++;
+        cursors_.emplace(id, std::move(cursor));
+        result.set_cursor(id);
+      }
+      void page(Search search, uint32_t limit, fetch::oef::pb::Server_SearchResult &result) {
+        auto agents = search(max(limit), {});
+        page(std::move(agents), std::move(search), limit, result);
+      }
+      // Pages through agents.
+      void page(std::vector<std::string> agents, uint32_t limit, fetch::oef::pb::Server_SearchResult &result) {
+        auto all = std::make_shared<const std::vector<std::string>>(std::move(agents));
+        page([all](size_t max, const std::unordered_set<std::string> &skip) {
+            std::vector<std::string> res;
+            for(auto iter = all->begin(); iter != all->end() && (max == 0 || res.size() < max); ++iter) {
+              if(skip.find(*iter) == skip.end()) {
+                res.emplace_back(*iter);
+              }
+            }
+            return res;
+          }, limit, result);
+      }
+      // Same as page() from the cursor's search, false if the cursor is unknown.
+      bool next(uint64_t id, uint32_t limit, fetch::oef::pb::Server_SearchResult &result) {
+        auto iter = cursors_.find(id);
+        if(iter == cursors_.end()) {
+          return false;
+        }
+        auto &cursor = iter->second;
+        if(fill(cursor.search(max(limit), cursor.sent), limit, result, &cursor.sent)) {
+          result.set_cursor(id);
+        } else {
+          cursors_.erase(iter);
+        }
+        return true;
+      }
+      void clear() {
+        cursors_.clear();
+      }
+    };
+  }
+}
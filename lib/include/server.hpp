@@ -39,15 +39,20 @@ namespace fetch {
       tcp::acceptor acceptor_;
       AgentDirectory agentDirectory_;
       ServiceDirectory serviceDirectory_;
+      SchemaDirectory schemaDirectory_;
+      const uint32_t maxFrameSize_;
+      static constexpr uint32_t max_handshake_frame_size = 64 * 1024;
 
       static fetch::oef::Logger logger;
 
-      void secretHandshake(const std::string &publicKey, const std::shared_ptr<Context> &context);  
+      void secretHandshake(const std::string &publicKey, const fetch::oef::pb::Capabilities &capabilities,
+                           const std::shared_ptr<Context> &context);  
       void newSession(tcp::socket socket);
       void do_accept();
     public:
-      explicit Server(uint32_t nbThreads = 4, uint32_t backlog = 256) :
-      acceptor_(io_context_, tcp::endpoint(tcp::v4(), static_cast<int>(Ports::Agents))) {
+      // Frames of more than maxFrameSize bytes are not read: the connection is closed.
+      explicit Server(uint32_t nbThreads = 4, uint32_t backlog = 256, uint32_t maxFrameSize = default_max_frame_size) :
+      acceptor_(io_context_, tcp::endpoint(tcp::v4(), static_cast<int>(Ports::Agents))), maxFrameSize_{maxFrameSize} {
         acceptor_.listen(backlog); // pending connections
         threads_.resize(nbThreads);
       }
@@ -18,7 +18,13 @@
 //------------------------------------------------------------------------------
 
 #include "schema.hpp"
+#include "subscriptiondirectory.hpp"
 
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <tuple>
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
@@ -44,59 +50,467 @@ namespace fetch {
       bool erase(const std::string &agent) {
         return agents_.erase(agent) == 1;
       }
+      bool contains(const std::string &agent) const {
+        return agents_.find(agent) != agents_.end();
+      }
       size_t size() const {
         return agents_.size();
       }
       void copy(std::unordered_set<std::string> &s) const {
         std::copy(agents_.begin(), agents_.end(), std::inserter(s, s.end()));
       }
+      template <typename F>
+      void for_each(F f) const {
+        for(const auto &agent : agents_) {
+          f(agent);
+        }
+      }
     };
 
     class ServiceDirectory {
     private:
+      // agents are compared by value, the strings are owned by data_.
+      struct AgentHash {
+        size_t operator()(const std::string *agent) const { return std::hash<std::string>{}(*agent); }
+      };
+      struct AgentEqual {
+        bool operator()(const std::string *lhs, const std::string *rhs) const { return *lhs == *rhs; }
+      };
+      // Instances are shared by the directory and its change log.
+      using InstancePtr = std::shared_ptr<const Instance>;
+      struct InstanceHash {
+        size_t operator()(const InstancePtr &instance) const { return instance->hash(); }
+      };
+      struct InstanceEqual {
+        bool operator()(const InstancePtr &lhs, const InstancePtr &rhs) const { return lhs == rhs || *lhs == *rhs; }
+      };
+      using Data = std::unordered_map<InstancePtr,Agents,InstanceHash,InstanceEqual>;
+      // non owning key to look instance up.
+      static InstancePtr key(const Instance &instance) {
+        return InstancePtr{InstancePtr{}, &instance};
+      }
+      // A registration or unregistration, generation is the directory generation after it.
+      struct Change {
+        uint64_t generation;
+        InstancePtr instance;
+        std::string agent;
+        bool registered;
+      };
+      struct Registration {
+        InstancePtr instance;
+        std::string agent;
+      };
       mutable std::mutex lock_;
-      std::unordered_map<Instance,Agents> data_;
+      Data data_;
+      std::unordered_map<std::string,std::unordered_map<const Instance *,uint64_t>> instances_; // agent -> keys of data_, handles
+      std::unordered_map<uint64_t,Registration> registrations_; // handle ->
+      uint64_t next_handle_ = 1;
+      SubscriptionDirectory subscriptions_;
+      uint64_t generation_ = 0;
+      uint64_t first_ = 0; // oldest generation the changes can be computed from
+      size_t max_changes_;
+      std::deque<Change> changes_;
+
+      // Must be called before the instance is erased from data_. The subscriptions are matched
+      // by the caller against the registered instances added to batch, if any.
+      void changed(const InstancePtr &instance, const std::string &agent, bool registered,
+                   std::vector<const Instance *> *batch = nullptr) {
+        ++generation_;
+        if(max_changes_ > 0) {
+          if(changes_.size() == max_changes_) {
+            first_ = changes_.front().generation;
+            changes_.pop_front();
+          }
+          changes_.emplace_back(Change{generation_, instance, agent, registered});
+        } else {
+          first_ = generation_;
+        }
+        if(subscriptions_.empty()) {
+          return;
+        }
+        if(registered && batch) {
+          batch->emplace_back(instance.get());
+        } else if(registered) {
+          subscriptions_.registered(*instance, agent);
+        } else {
+          subscriptions_.unregistered(*instance, agent);
+        }
+      }
+      // removes agent from the agents of iter, not from instances_.
+      bool erase(Data::iterator iter, const std::string &agent) {
+        if(!iter->second.erase(agent)) {
+          return false;
+        }
+        changed(iter->first, agent, false);
+        if(iter->second.size() == 0) {
+          data_.erase(iter);
+        }
+        return true;
+      }
+      // returns the handle of the registration (a new one if handle is 0), 0 if agent already
+      // registered instance.
+      uint64_t insert(Instance &&instance, const std::string &agent, uint64_t handle = 0,
+                      std::vector<const Instance *> *batch = nullptr) {
+        auto iter = data_.find(key(instance));
+        if(iter == data_.end()) {
+          iter = data_.emplace(std::make_shared<const Instance>(std::move(instance)), Agents{}).first;
+        }
+        if(!iter->second.insert(agent)) {
+          return 0;
+        }
+        if(handle == 0) {
+          handle = next_handle_++;
+        }
+        instances_[agent].emplace(iter->first.get(), handle);
+        registrations_[handle] = Registration{iter->first, agent};
+        changed(iter->first, agent, true, batch);
+        return handle;
+      }
+      bool unregister(const Instance &instance, const std::string &agent) {
+        auto iter = data_.find(key(instance));
+        if(iter == data_.end())
+          return false;
+        auto agent_iter = instances_.find(agent);
+        if(agent_iter != instances_.end()) {
+          auto handle_iter = agent_iter->second.find(iter->first.get());
+          if(handle_iter != agent_iter->second.end()) {
+            registrations_.erase(handle_iter->second);
+            agent_iter->second.erase(handle_iter);
+          }
+          if(agent_iter->second.empty()) {
+            instances_.erase(agent_iter);
+          }
+        }
+        return erase(iter, agent);
+      }
     public:
-      explicit ServiceDirectory() = default;
-      bool registerAgent(const Instance &instance, const std::string &agent) {
+      // max_changes: number of changes kept to answer changes().
+      explicit ServiceDirectory(size_t max_changes = 100000) : max_changes_{max_changes} {}
+      // returns the handle of the registration, 0 if instance is not valid or already registered.
+      uint64_t registerAgent(Instance instance, const std::string &agent) {
+        if(!instance.valid()) {
+          return 0;
+        }
         std::lock_guard<std::mutex> lock(lock_);
-        return data_[instance].insert(agent);
+        return insert(std::move(instance), agent);
       }
       bool unregisterAgent(const Instance &instance, const std::string &agent) {
         std::lock_guard<std::mutex> lock(lock_);
-        auto iter = data_.find(instance);
-        if(iter == data_.end())
+        return unregister(instance, agent);
+      }
+      // Same as unregisterAgent with the handle returned by registerAgent: neither the instance
+      // nor its values are compared.
+      bool unregisterAgent(uint64_t handle, const std::string &agent) {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = registrations_.find(handle);
+        if(iter == registrations_.end() || iter->second.agent != agent) {
           return false;
-        bool res = iter->second.erase(agent);
-        if(iter->second.size() == 0) {
-          data_.erase(instance);
+        }
+        auto data_iter = data_.find(iter->second.instance);
+        registrations_.erase(iter);
+        auto agent_iter = instances_.find(agent);
+        agent_iter->second.erase(data_iter->first.get());
+        if(agent_iter->second.empty()) {
+          instances_.erase(agent_iter);
+        }
+        return erase(data_iter, agent);
+      }
+      // Same as registerAgent for each instance: they are checked (and hashed when built) before
+      // taking the lock once for all of them. res[i] is the handle of instances[i], 0 if it is
+      // not valid or already registered.
+      std::vector<uint64_t> registerMany(std::vector<Instance> instances, const std::string &agent) {
+        std::vector<uint64_t> res;
+        res.reserve(instances.size());
+        for(auto &instance : instances) {
+          res.emplace_back(instance.valid());
+        }
+        std::vector<const Instance *> registered;
+        std::lock_guard<std::mutex> lock(lock_);
+        data_.reserve(data_.size() + instances.size());
+        for(size_t i = 0; i < instances.size(); ++i) {
+          if(res[i]) {
+            res[i] = insert(std::move(instances[i]), agent, 0, &registered);
+          }
+        }
+        if(!registered.empty()) {
+          subscriptions_.registered(registered, agent);
+        }
+        return res;
+      }
+      // Replaces or adds the given values of the instance registered with handle by agent.
+      // The new instance is built outside the lock, the handle is kept.
+      bool update(uint64_t handle, const std::string &agent,
+                  const google::protobuf::RepeatedPtrField<fetch::oef::pb::Query_KeyValue> &values) {
+        InstancePtr current;
+        {
+          std::lock_guard<std::mutex> lock(lock_);
+          auto iter = registrations_.find(handle);
+          if(iter == registrations_.end() || iter->second.agent != agent) {
+            return false;
+          }
+          current = iter->second.instance;
+        }
+        Instance updated = current->updated(values);
+        if(!updated.valid()) {
+          return false;
+        }
+        std::lock_guard<std::mutex> lock(lock_);
+        auto iter = registrations_.find(handle);
+        if(iter == registrations_.end() || iter->second.instance != current) { // changed meanwhile
+          return false;
+        }
+        if(updated == *current) {
+          return true;
+        }
+        auto other = data_.find(key(updated));
+        if(other != data_.end() && other->second.contains(agent)) {
+          return false; // agent already registered the updated instance
+        }
+        instances_[agent].erase(current.get());
+        erase(data_.find(current), agent);
+        insert(std::move(updated), agent, handle);
+        return true;
+      }
+      std::vector<bool> unregisterMany(const std::vector<Instance> &instances, const std::string &agent) {
+        std::vector<bool> res;
+        res.reserve(instances.size());
+        std::lock_guard<std::mutex> lock(lock_);
+        for(auto &instance : instances) {
+          res.emplace_back(unregister(instance, agent));
         }
         return res;
       }
       void unregisterAll(const std::string &agent) {
         std::lock_guard<std::mutex> lock(lock_);
-        for(auto iter = data_.begin(); iter != data_.end();) {
-          iter->second.erase(agent);
-          if(iter->second.size() == 0) {
-            iter = data_.erase(iter);
-          } else {
-            ++iter;
+        auto agent_iter = instances_.find(agent);
+        if(agent_iter == instances_.end()) {
+          return;
+        }
+        for(const auto &p : agent_iter->second) {
+          registrations_.erase(p.second);
+          auto iter = data_.find(key(*p.first));
+          if(iter != data_.end()) {
+            erase(iter, agent);
           }
         }
+        instances_.erase(agent_iter);
+      }
+      uint64_t generation() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        return generation_;
       }
       size_t size() const {
         std::lock_guard<std::mutex> lock(lock_);
         return data_.size();
       }
       std::vector<std::string> query(const QueryModel &query) const {
+        uint64_t generation;
+        return this->query(query, generation);
+      }
+      // generation is set to the generation of the result.
+      std::vector<std::string> query(const QueryModel &query, uint64_t &generation) const {
+        return limitedQuery(query, 0, {}, generation);
+      }
+      // At most max agents (0 means no limit) matching query which are not in skip: the scan
+      // stops once there are max of them.
+      std::vector<std::string> limitedQuery(const QueryModel &query, size_t max, const std::unordered_set<std::string> &skip,
+                                            uint64_t &generation) const {
+        std::lock_guard<std::mutex> lock(lock_);
+        generation = generation_;
+        std::unordered_set<const std::string *,AgentHash,AgentEqual> seen;
+        std::vector<std::string> res;
+        for(auto &d : data_) {
+          if(max > 0 && res.size() >= max) {
+            break;
+          }
+          if(!query.check(*d.first)) {
+            continue;
+          }
+          d.second.for_each([&](const std::string &agent) {
+              if((max == 0 || res.size() < max) && skip.find(agent) == skip.end() && seen.insert(&agent).second) {
+                res.emplace_back(agent);
+              }
+            });
+        }
+        return res;
+      }
+      // Agents entering and leaving the result of query since the given generation, replayed
+      // from the change log. Returns false if the changes since are not known anymore, then
+      // the full query is needed. generation is set to the current generation.
+      bool changes(const QueryModel &query, uint64_t since, std::vector<std::string> &added,
+                   std::vector<std::string> &removed, uint64_t &generation) const {
+        std::lock_guard<std::mutex> lock(lock_);
+        generation = generation_;
+        if(since < first_ || since > generation_) {
+          return false;
+        }
+        std::unordered_map<std::string,int64_t> delta; // agent -> matching instances added
+        for(auto iter = changes_.begin() + std::ptrdiff_t(since - first_); iter != changes_.end(); ++iter) {
+          if(query.check(*iter->instance)) {
+            delta[iter->agent] += iter->registered ? 1 : -1;
+          }
+        }
+        for(auto &d : delta) {
+          if(d.second == 0) {
+            continue;
+          }
+          int64_t now = 0;
+          auto agent_iter = instances_.find(d.first);
+          if(agent_iter != instances_.end()) {
+            for(const auto &p : agent_iter->second) {
+              now += query.check(*p.first);
+            }
+          }
+          int64_t before = now - d.second;
+          if(before == 0 && now > 0) {
+            added.emplace_back(d.first);
+          } else if(before > 0 && now == 0) {
+            removed.emplace_back(d.first);
+          }
+        }
+        return true;
+      }
+      // Result of a query taken chunk by chunk with next(): the matching instances are
+      // snapshot by stream(), their agents are only read, under the lock, by next().
+      class Stream {
+      private:
+        friend class ServiceDirectory;
+        std::vector<InstancePtr> matches_;
+        size_t next_ = 0;  // first instance of matches_ not read yet
+        std::deque<std::string> pending_; // agents read and not taken yet
+        std::unordered_set<std::string> seen_;
+        size_t limit_;
+        explicit Stream(size_t limit) : limit_{limit} {}
+      };
+      // At most limit agents are returned, 0 means no limit.
+      Stream stream(const QueryModel &query, size_t limit = 0) const {
         std::lock_guard<std::mutex> lock(lock_);
-        std::unordered_set<std::string> res;
+        Stream stream{limit};
         for(auto &d : data_) {
-          if(query.check(d.first)) {
-            d.second.copy(res);
+          if(query.check(*d.first)) {
+            stream.matches_.emplace_back(d.first);
           }
         }
-        return std::vector<std::string>(res.begin(), res.end());
+        return stream;
+      }
+      // Appends the next chunk agents of stream to agents, true if it is the last chunk: the
+      // agents are exhausted before it is full (it may be empty). Instances unregistered since
+      // the snapshot are skipped.
+      bool next(Stream &stream, size_t chunk, std::vector<std::string> &agents) const {
+        {
+          std::lock_guard<std::mutex> lock(lock_);
+          while(stream.pending_.size() < chunk && stream.next_ < stream.matches_.size()
+                && (stream.limit_ == 0 || stream.seen_.size() < stream.limit_)) {
+            auto iter = data_.find(stream.matches_[stream.next_++]);
+            if(iter == data_.end()) {
+              continue;
+            }
+            iter->second.for_each([&stream](const std::string &agent) {
+                if((stream.limit_ == 0 || stream.seen_.size() < stream.limit_) && stream.seen_.insert(agent).second) {
+                  stream.pending_.emplace_back(agent);
+                }
+              });
+          }
+        }
+        size_t nb = std::min(chunk, stream.pending_.size());
+        agents.reserve(agents.size() + nb);
+        std::move(stream.pending_.begin(), stream.pending_.begin() + std::ptrdiff_t(nb), std::back_inserter(agents));
+        stream.pending_.erase(stream.pending_.begin(), stream.pending_.begin() + std::ptrdiff_t(nb));
+        return nb < chunk;
+      }
+      // Streaming version of query: f(agents, last) is called with chunks of chunk agents, then
+      // once with the remaining ones (maybe none) and last set. f is not called with the lock held.
+      // At most limit agents are returned, 0 means no limit.
+      template <typename F>
+      void query(const QueryModel &query, size_t chunk, size_t limit, F f) const {
+        auto s = stream(query, limit);
+        bool last = false;
+        while(!last) {
+          std::vector<std::string> agents;
+          last = next(s, chunk, agents);
+          f(std::move(agents), last);
+        }
+      }
+      // Statistics of the services matching query, computed during the scan: number of services
+      // and distinct agents, min/max/avg of the numeric attribute (if not empty) and number of
+      // services per value of the group_by string attribute (if not empty).
+      void aggregate(const QueryModel &query, const std::string &numeric, const std::string &group_by,
+                     fetch::oef::pb::Server_AggregateResult &result) const {
+        std::lock_guard<std::mutex> lock(lock_);
+        std::unordered_set<const std::string *,AgentHash,AgentEqual> agents;
+        std::unordered_map<std::string,uint64_t> groups;
+        uint64_t services = 0, values = 0;
+        double min = 0.0, max = 0.0, sum = 0.0;
+        for(auto &d : data_) {
+          if(!query.check(*d.first)) {
+            continue;
+          }
+          uint64_t nb = d.second.size();
+          services += nb;
+          d.second.for_each([&agents](const std::string &agent) { agents.insert(&agent); });
+          if(!numeric.empty()) {
+            const auto *v = d.first->find(numeric);
+            if(v && (v->is<int>() || v->is<double>())) {
+              double x = v->is<int>() ? double(v->get<int>()) : v->get<double>();
+              if(values == 0 || x < min) {
+                min = x;
+              }
+              if(values == 0 || x > max) {
+                max = x;
+              }
+              sum += x * double(nb);
+              values += nb;
+            }
+          }
+          if(!group_by.empty()) {
+            const auto *v = d.first->find(group_by);
+            if(v && v->is<std::string>()) {
+              groups[v->get<std::string>()] += nb;
+            }
+          }
+        }
+        result.set_services(services);
+        result.set_agents(agents.size());
+        if(!numeric.empty()) {
+          result.set_values(values);
+          if(values > 0) {
+            result.set_min(min);
+            result.set_max(max);
+            result.set_avg(sum / double(values));
+          }
+        }
+        for(auto &g : groups) {
+          auto *group = result.add_groups();
+          group->set_value(g.first);
+          group->set_count(g.second);
+        }
+      }
+      // Standing query: notify is called with the agents currently matching the query,
+      // then with the agents entering or leaving the matching set on every change.
+      uint64_t subscribe(const QueryModel &query, Subscription::Notify notify) {
+        std::lock_guard<std::mutex> lock(lock_);
+        uint64_t id = subscriptions_.add(query, std::move(notify));
+        auto *subscription = subscriptions_.get(id);
+        std::vector<std::string> added;
+        for(auto &d : data_) {
+          if(query.check(*d.first)) {
+            d.second.for_each([subscription,&added](const std::string &agent) {
+                if(subscription->added(agent)) {
+                  added.emplace_back(agent);
+                }
+              });
+          }
+        }
+        subscription->notify(added, {}, true); // initial state, even if empty
+        return id;
+      }
+      bool unsubscribe(uint64_t id) {
+        std::lock_guard<std::mutex> lock(lock_);
+        return subscriptions_.remove(id);
+      }
+      size_t nbSubscriptions() const {
+        std::lock_guard<std::mutex> lock(lock_);
+        return subscriptions_.size();
       }
     };
   };
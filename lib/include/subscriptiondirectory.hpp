@@ -0,0 +1,130 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "queryindex.hpp"
+#include "schema.hpp"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace fetch {
+  namespace oef {
+    // Standing query: keeps track of the agents currently matching the query so that
+    // only changes of the matching set are notified.
+    class Subscription {
+    public:
+      using Notify = std::function<void(const std::vector<std::string> &added, const std::vector<std::string> &removed)>;
+    private:
+      Notify notify_;
+      std::unordered_map<std::string,uint32_t> matches_; // agent -> number of matching instances
+    public:
+      explicit Subscription(Notify notify) : notify_{std::move(notify)} {}
+      size_t size() const { return matches_.size(); }
+      // returns true if agent just entered the matching set.
+      bool added(const std::string &agent) {
+        return ++matches_[agent] == 1;
+      }
+      // returns true if agent just left the matching set.
+      bool removed(const std::string &agent) {
+        auto iter = matches_.find(agent);
+        if(iter == matches_.end()) {
+          return false;
+        }
+        if(--iter->second == 0) {
+          matches_.erase(iter);
+          return true;
+        }
+        return false;
+      }
+      void notify(const std::vector<std::string> &added, const std::vector<std::string> &removed, bool always = false) const {
+        if(notify_ && (always || !added.empty() || !removed.empty())) {
+          notify_(added, removed);
+        }
+      }
+    };
+
+    // Not thread safe: it is guarded by the lock of the owning ServiceDirectory.
+    // Notifications are delivered while this lock is held, they must not call back
+    // into the ServiceDirectory.
+    class SubscriptionDirectory {
+    private:
+      uint64_t next_id_ = 1;
+      std::unordered_map<uint64_t,Subscription> subscriptions_;
+      QueryIndex index_; // subscription id -> query
+    public:
+      explicit SubscriptionDirectory() = default;
+      size_t size() const {
+        return subscriptions_.size();
+      }
+      bool empty() const {
+        return subscriptions_.empty();
+      }
+      uint64_t add(const QueryModel &query, Subscription::Notify notify) {
+        uint64_t id = next_id_++;
+        index_.add(id, query);
+        subscriptions_.emplace(id, Subscription{std::move(notify)});
+        return id;
+      }
+      Subscription *get(uint64_t id) {
+        auto iter = subscriptions_.find(id);
+        if(iter == subscriptions_.end()) {
+          return nullptr;
+        }
+        return &iter->second;
+      }
+      bool remove(uint64_t id) {
+        if(subscriptions_.erase(id) == 0) {
+          return false;
+        }
+        index_.remove(id);
+        return true;
+      }
+      void registered(const Instance &instance, const std::string &agent) {
+        for(auto id : index_.match(instance)) {
+          auto &s = subscriptions_.at(id);
+          if(s.added(agent)) {
+            s.notify({agent}, {});
+          }
+        }
+      }
+      // Same as registered for each instance, matched in one batch.
+      void registered(const std::vector<const Instance *> &instances, const std::string &agent) {
+        for(auto &ids : index_.match(instances)) {
+          for(auto id : ids) {
+            auto &s = subscriptions_.at(id);
+            if(s.added(agent)) {
+              s.notify({agent}, {});
+            }
+          }
+        }
+      }
+      void unregistered(const Instance &instance, const std::string &agent) {
+        for(auto id : index_.match(instance)) {
+          auto &s = subscriptions_.at(id);
+          if(s.removed(agent)) {
+            s.notify({}, {agent});
+          }
+        }
+      }
+    };
+  }
+}
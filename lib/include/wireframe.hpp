@@ -0,0 +1,108 @@
+#pragma once
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "framing.hpp"
+#include "agent.pb.h"
+#include <experimental/optional>
+#include <string>
+
+namespace stde = std::experimental;
+
+namespace fetch {
+  namespace oef {
+    // Wire level view of an Envelope frame: msg_id and the payload field are read without
+    // parsing the payload, so that an envelope is only parsed as far as its processing needs.
+    class EnvelopeFrame {
+    private:
+      int32_t msg_id_ = 0;
+      fetch::oef::pb::Envelope::PayloadCase payload_case_ = fetch::oef::pb::Envelope::PAYLOAD_NOT_SET;
+      size_t payload_offset_ = 0;
+      size_t payload_size_ = 0;
+    public:
+      // False if frame is not an envelope with msg_id and a payload, or if its fields cannot be
+      // used without parsing it (unknown fields, payload field repeated, which protobuf merges):
+      // it then has to be parsed.
+      bool scan(const Buffer &frame);
+      int32_t msgId() const { return msg_id_; }
+      fetch::oef::pb::Envelope::PayloadCase payloadCase() const { return payload_case_; }
+      // Bytes of the payload message in the scanned frame.
+      size_t payloadOffset() const { return payload_offset_; }
+      size_t payloadSize() const { return payload_size_; }
+    };
+
+    // Relay of an Envelope.send_message without decoding its payload: only dialogue_id and
+    // destination are read from the Agent.Message, the content or fipa bytes are located and
+    // written as they are after a Server.AgentMessage header.
+    class RelayFrame {
+    public:
+      enum class Payload : uint32_t { None = 0, Content = 3, Fipa = 4 }; // Agent.Message field numbers
+    private:
+      int32_t msg_id_ = 0;
+      int32_t dialogue_id_ = 0;
+      std::string destination_;
+      Payload payload_ = Payload::None;
+      size_t payload_offset_ = 0;
+      size_t payload_size_ = 0;
+    public:
+      // False if the send_message envelope scanned in frame does not have all its required fields,
+      // or if it cannot be relayed without being parsed (unknown or repeated message fields).
+      bool scan(const Buffer &frame, const EnvelopeFrame &envelope);
+      // Same for a frame not scanned yet, false if it is not a send_message envelope.
+      bool scan(const Buffer &frame);
+      // Same for the size bytes of head, the envelope up to the bytes of its content or fipa, which
+      // end it: payloadOffset() is size.
+      bool scanHead(const uint8_t *head, size_t size);
+      int32_t msgId() const { return msg_id_; }
+      int32_t dialogueId() const { return dialogue_id_; }
+      const std::string &destination() const { return destination_; }
+      Payload payload() const { return payload_; }
+      // Bytes of the content or fipa message in the scanned frame.
+      size_t payloadOffset() const { return payload_offset_; }
+      size_t payloadSize() const { return payload_size_; }
+      // Frame header and Server.AgentMessage.Content encoding up to the payload bytes, which are
+      // the end of the frame. Only the stream, priority and More flag of frame are used: with More
+      // (Framing::V2), the payload bytes are the next frames of its stream. With deflated, the
+      // frame is compressed (Framing::V2): the payload bytes are the deflated segment of that size.
+      SharedBuffer header(const std::string &origin, stde::optional<uint64_t> origin_handle,
+                          Framing framing = Framing::V1, FrameHeader frame = FrameHeader{},
+                          stde::optional<size_t> deflated = stde::nullopt) const;
+    };
+
+    // Frames (Framing::V2) of a send_message envelope whose content is sent in chunks, so that it
+    // is relayed chunk by chunk: the envelope up to its content bytes, then the content in frames of
+    // the same stream, the last one without FrameHeader::More. A relayed message can instead end
+    // with an empty FrameHeader::Abort frame, when its sender or its relay fails.
+    class ChunkedMessage {
+    private:
+      FrameHeader header_;
+      size_t remaining_;
+      SharedBuffer head_;
+    public:
+      // Only the stream and priority of header are used.
+      ChunkedMessage(int32_t msg_id, int32_t dialogue_id, const std::string &destination, size_t content_size,
+                     FrameHeader header);
+      const SharedBuffer &head() const { return head_; }
+      // Frame of the next size bytes of the content. Throws std::length_error past its end.
+      SharedBuffer chunk(const uint8_t *data, size_t size);
+      // Frame dropping the rest of the content.
+      SharedBuffer abort();
+      size_t remaining() const { return remaining_; }
+    };
+  }
+}
@@ -0,0 +1,153 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "bufferpool.hpp"
+
+namespace fetch {
+  namespace oef {
+    // Free buffers of a thread, given back to the shared lists when the thread exits.
+    struct BufferPool::ThreadCache {
+      FreeLists free;
+      ThreadCache() {
+        for(auto &f : free) {
+          f.reserve(thread_cached + 1);
+        }
+      }
+      ~ThreadCache() {
+        auto &pool = BufferPool::instance();
+        for(uint32_t c = 0; c < nb_classes; ++c) {
+          pool.drain(free[c], c, 0);
+        }
+      }
+    };
+
+    namespace {
+      // set once the cache of the thread is destroyed: the buffers released afterwards go to the
+      // shared lists.
+      thread_local bool cacheDestroyed = false;
+    }
+
+    BufferPool::ThreadCache *BufferPool::cache() {
+      if(cacheDestroyed) {
+        return nullptr;
+      }
+      struct Guarded : ThreadCache {
+        ~Guarded() { cacheDestroyed = true; }
+      };
+      static thread_local Guarded c;
+      return &c;
+    }
+
+    BufferPool &BufferPool::instance() {
+      static BufferPool *pool = new BufferPool;
+      return *pool;
+    }
+
+    void BufferPool::retain(Block *block) {
+      retained_buffers_.fetch_add(1, std::memory_order_relaxed);
+      retained_bytes_.fetch_add(block->buffer.capacity(), std::memory_order_relaxed);
+    }
+
+    void BufferPool::destroy(Block *block) {
+      retained_buffers_.fetch_sub(1, std::memory_order_relaxed);
+      retained_bytes_.fetch_sub(block->buffer.capacity(), std::memory_order_relaxed);
+      delete block;
+    }
+
+    void BufferPool::drain(std::vector<Block*> &cache, uint32_t c, size_t keep) {
+      std::lock_guard<std::mutex> lock(lock_);
+      while(cache.size() > keep) {
+        Block *block = cache.back();
+        cache.pop_back();
+        if(shared_[c].size() < max_shared) {
+          shared_[c].emplace_back(block);
+        } else {
+          destroy(block);
+        }
+      }
+    }
+
+    SharedBuffer BufferPool::acquire(size_t size) {
+      uint32_t c = sizeClass(size);
+      if(c == nb_classes) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        auto *block = new Block;
+        block->size_class = c;
+        block->buffer.resize(size);
+        return SharedBuffer{block};
+      }
+      Block *block = nullptr;
+      auto *local = cache();
+      if(local && local->free[c].empty()) { // refill from the shared list
+        std::lock_guard<std::mutex> lock(lock_);
+        auto &shared = shared_[c];
+        while(!shared.empty() && local->free[c].size() < thread_cached / 2) {
+          local->free[c].emplace_back(shared.back());
+          shared.pop_back();
+        }
+      }
+      if(local && !local->free[c].empty()) {
+        block = local->free[c].back();
+        local->free[c].pop_back();
+      } else if(!local) {
+        std::lock_guard<std::mutex> lock(lock_);
+        if(!shared_[c].empty()) {
+          block = shared_[c].back();
+          shared_[c].pop_back();
+        }
+      }
+      if(block) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        retained_buffers_.fetch_sub(1, std::memory_order_relaxed);
+        retained_bytes_.fetch_sub(block->buffer.capacity(), std::memory_order_relaxed);
+        block->refs.store(1, std::memory_order_relaxed);
+      } else {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        block = new Block;
+        block->size_class = c;
+        block->buffer.reserve(min_size << c);
+      }
+      block->buffer.resize(size);
+      return SharedBuffer{block};
+    }
+
+    void BufferPool::recycle(Block *block) {
+      uint32_t c = block->size_class;
+      if(c == nb_classes) {
+        delete block;
+        return;
+      }
+      retain(block);
+      auto *local = cache();
+      if(!local) {
+        std::vector<Block*> single{block};
+        drain(single, c, 0);
+        return;
+      }
+      local->free[c].emplace_back(block);
+      if(local->free[c].size() > thread_cached) {
+        drain(local->free[c], c, thread_cached / 2);
+      }
+    }
+
+    BufferPool::Stats BufferPool::stats() const {
+      return Stats{hits_.load(std::memory_order_relaxed), misses_.load(std::memory_order_relaxed),
+                   retained_buffers_.load(std::memory_order_relaxed), retained_bytes_.load(std::memory_order_relaxed)};
+    }
+  }
+}
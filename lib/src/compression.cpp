@@ -0,0 +1,195 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "compression.hpp"
+#include "wireframe.hpp"
+#include <google/protobuf/io/coded_stream.h>
+#include <zlib.h>
+#include <cstring>
+
+namespace fetch {
+  namespace oef {
+    using google::protobuf::io::CodedInputStream;
+    using google::protobuf::io::CodedOutputStream;
+
+    namespace {
+      constexpr size_t max_segment_header = 2 * 10;
+
+      // zlib streams of the thread, reset for each segment so that their state is not allocated
+      // each time.
+      struct Deflater {
+        z_stream stream{};
+        Deflater() { deflateInit(&stream, Z_BEST_SPEED); }
+        ~Deflater() { deflateEnd(&stream); }
+      };
+      struct Inflater {
+        z_stream stream{};
+        Inflater() { inflateInit(&stream); }
+        ~Inflater() { inflateEnd(&stream); }
+      };
+
+      // Size of the zlib stream of the size bytes of in written at out, 0 if it needs more than
+      // capacity bytes.
+      size_t deflateTo(const uint8_t *in, size_t size, uint8_t *out, size_t capacity) {
+        static thread_local Deflater deflater;
+        auto &s = deflater.stream;
+        deflateReset(&s);
+        s.next_in = const_cast<Bytef*>(in);
+        s.avail_in = uInt(size);
+        s.next_out = out;
+        s.avail_out = uInt(capacity);
+        if(deflate(&s, Z_FINISH) != Z_STREAM_END) {
+          return 0;
+        }
+        return capacity - s.avail_out;
+      }
+      // False unless the zlib stream of size bytes at in is exactly inflated bytes.
+      bool inflateTo(const uint8_t *in, size_t size, uint8_t *out, size_t inflated) {
+        static thread_local Inflater inflater;
+        auto &s = inflater.stream;
+        inflateReset(&s);
+        s.next_in = const_cast<Bytef*>(in);
+        s.avail_in = uInt(size);
+        s.next_out = out;
+        s.avail_out = uInt(inflated);
+        return inflate(&s, Z_FINISH) == Z_STREAM_END && s.avail_out == 0 && s.avail_in == 0;
+      }
+    }
+
+    size_t CompressedFrame::segmentHeaderSize(size_t size, bool deflated, size_t inflated) {
+      size_t res = CodedOutputStream::VarintSize64(uint64_t(size) << 1);
+      if(deflated) {
+        res += CodedOutputStream::VarintSize64(inflated);
+      }
+      return res;
+    }
+
+    uint8_t *CompressedFrame::writeSegmentHeader(size_t size, bool deflated, size_t inflated, uint8_t *out) {
+      out = CodedOutputStream::WriteVarint64ToArray((uint64_t(size) << 1) | (deflated ? 1 : 0), out);
+      if(deflated) {
+        out = CodedOutputStream::WriteVarint64ToArray(inflated, out);
+      }
+      return out;
+    }
+
+    bool CompressedFrame::scan(const Buffer &frame, size_t max_size) {
+      segments_.clear();
+      inflated_ = 0;
+      CodedInputStream in{frame.data(), int(frame.size())};
+      while(size_t(in.CurrentPosition()) < frame.size()) {
+        uint64_t v;
+        if(!in.ReadVarint64(&v)) {
+          return false;
+        }
+        Segment segment{0, size_t(v >> 1), size_t(v >> 1), (v & 1) != 0};
+        if(segment.deflated && !in.ReadVarint64(&v)) {
+          return false;
+        }
+        if(segment.deflated) {
+          segment.inflated = size_t(v);
+        }
+        segment.offset = size_t(in.CurrentPosition());
+        if(segment.size > frame.size() - segment.offset || !in.Skip(int(segment.size))) {
+          return false;
+        }
+        inflated_ += segment.inflated;
+        if(segment.inflated > max_size || inflated_ > max_size) {
+          return false;
+        }
+        segments_.emplace_back(segment);
+      }
+      return true;
+    }
+
+    SharedBuffer CompressedFrame::inflate(const Buffer &frame) const {
+      auto buffer = BufferPool::instance().acquire(inflated_);
+      uint8_t *out = buffer->data();
+      for(auto &s : segments_) {
+        if(!s.deflated) {
+          std::memcpy(out, frame.data() + s.offset, s.size);
+        } else if(!inflateTo(frame.data() + s.offset, s.size, out, s.inflated)) {
+          return SharedBuffer{};
+        }
+        out += s.inflated;
+      }
+      return buffer;
+    }
+
+    bool CompressedFrame::scanRelay(const Buffer &frame, RelayFrame &relay) const {
+      if(segments_.size() != 2 || segments_[0].deflated || !segments_[1].deflated) {
+        return false;
+      }
+      return relay.scanHead(frame.data() + segments_[0].offset, segments_[0].size)
+        && relay.payloadSize() == segments_[1].inflated;
+    }
+
+    SharedBuffer compressFrame(SharedBuffer frame, size_t threshold) {
+      FrameHeader header;
+      size_t header_size;
+      if(FrameHeader::parse(frame->data(), frame->size(), header, header_size) != FrameHeader::Parsed::Complete
+         || header.length < threshold || (header.flags & FrameHeader::Compressed)) {
+        return frame;
+      }
+      // deflated after room for the headers, which are then written in front of it.
+      size_t room = FrameHeader::max_size + max_segment_header;
+      auto out = BufferPool::instance().acquire(room + header.length);
+      size_t size = deflateTo(frame->data() + header_size, header.length, out->data() + room, header.length);
+      if(size == 0) { // not smaller
+        return frame;
+      }
+      FrameHeader compressed = header;
+      compressed.flags |= FrameHeader::Compressed;
+      size_t segment_header = CompressedFrame::segmentHeaderSize(size, true, header.length);
+      compressed.length = uint32_t(segment_header + size);
+      size_t prefix = compressed.size(Framing::V2) + segment_header;
+      uint8_t *start = out->data() + room - prefix;
+      CompressedFrame::writeSegmentHeader(size, true, header.length, compressed.write(Framing::V2, start));
+      std::memmove(out->data(), start, prefix + size);
+      out->resize(prefix + size);
+      return out;
+    }
+
+    SharedBuffer compressedEnvelope(const fetch::oef::pb::Envelope &envelope, FrameHeader header) {
+      auto message = BufferPool::instance().acquire(envelope.ByteSizeLong());
+      (void)envelope.SerializeWithCachedSizesToArray(message->data());
+      RelayFrame relay;
+      if(!relay.scan(*message) || relay.payload() == RelayFrame::Payload::None
+         || relay.payloadOffset() + relay.payloadSize() != message->size()) {
+        return compressFrame(frame(envelope, Framing::V2, header), 0);
+      }
+      size_t head = relay.payloadOffset();
+      size_t payload = relay.payloadSize();
+      size_t room = FrameHeader::max_size + 2 * max_segment_header + head;
+      size_t capacity = compressBound(uLong(payload));
+      auto out = BufferPool::instance().acquire(room + capacity);
+      size_t size = deflateTo(message->data() + head, payload, out->data() + room, capacity);
+      header.flags |= FrameHeader::Compressed;
+      size_t raw_header = CompressedFrame::segmentHeaderSize(head, false, head);
+      size_t deflated_header = CompressedFrame::segmentHeaderSize(size, true, payload);
+      header.length = uint32_t(raw_header + head + deflated_header + size);
+      size_t prefix = header.size(Framing::V2) + raw_header + head + deflated_header;
+      uint8_t *start = out->data() + room - prefix;
+      uint8_t *p = CompressedFrame::writeSegmentHeader(head, false, head, header.write(Framing::V2, start));
+      std::memcpy(p, message->data(), head);
+      CompressedFrame::writeSegmentHeader(size, true, payload, p + head);
+      std::memmove(out->data(), start, prefix + size);
+      out->resize(prefix + size);
+      return out;
+    }
+  }
+}
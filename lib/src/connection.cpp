@@ -0,0 +1,72 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "connection.hpp"
+#include <algorithm>
+#include <iterator>
+
+namespace fetch {
+  namespace oef {
+    void Connection::push(Write &&write) {
+      std::lock_guard<std::mutex> lock(lock_);
+      queue_.emplace_back(std::move(write));
+      if(!writing_) {
+        writeQueued();
+      }
+    }
+
+    void Connection::writeQueued() {
+      written_.clear();
+      if(queue_.size() <= max_gathered) {
+        written_.swap(queue_);
+      } else {
+        auto last = queue_.begin() + max_gathered;
+        std::move(queue_.begin(), last, std::back_inserter(written_));
+        queue_.erase(queue_.begin(), last);
+      }
+      buffers_.clear();
+      for(auto &w : written_) {
+        buffers_.emplace_back(asio::buffer(*w.frame));
+        if(w.payload.size() > 0) {
+          buffers_.emplace_back(w.payload);
+        }
+      }
+      writing_ = true;
+      auto self(shared_from_this());
+      Gathered gathered{buffers_.data(), buffers_.data() + buffers_.size()};
+      asio::async_write(socket_, gathered, withMemory(&write_memory_, [this,self](std::error_code ec, std::size_t length) {
+          if(ec) {
+            std::cerr << "Connection write error " << ec.value() << ", wrote " << length << std::endl;
+          }
+          // written_ is only changed by the next write, started below.
+          for(auto &w : written_) {
+            if(w.handler) {
+              w.handler(ec, w.owner);
+            }
+          }
+          std::lock_guard<std::mutex> lock(lock_);
+          writing_ = false;
+          if(!queue_.empty()) {
+            writeQueued();
+          } else {
+            written_.clear(); // releases the buffers
+          }
+        }));
+    }
+  }
+}
@@ -0,0 +1,98 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "framing.hpp"
+#include <google/protobuf/io/coded_stream.h>
+
+namespace fetch {
+  namespace oef {
+    using google::protobuf::io::CodedOutputStream;
+
+    namespace {
+      constexpr unsigned priority_shift = 6;
+
+      // Varint of at most 32 bits at pos, which is moved after it when it is Complete.
+      FrameHeader::Parsed readVarint32(const uint8_t *data, size_t size, size_t &pos, uint32_t &value) {
+        value = 0;
+        for(size_t i = 0; i < 5; ++i) {
+          if(pos + i >= size) {
+            return FrameHeader::Parsed::Partial;
+          }
+          uint8_t b = data[pos + i];
+          if(i == 4 && b > 0x0f) {
+            return FrameHeader::Parsed::Invalid;
+          }
+          value |= uint32_t(b & 0x7f) << (7 * i);
+          if((b & 0x80) == 0) {
+            pos += i + 1;
+            return FrameHeader::Parsed::Complete;
+          }
+        }
+        return FrameHeader::Parsed::Invalid;
+      }
+    }
+
+    size_t FrameHeader::size(Framing framing) const {
+      if(framing == Framing::V1) {
+        return sizeof(uint32_t);
+      }
+      size_t res = 1 + CodedOutputStream::VarintSize32(length);
+      if(flags & Stream) {
+        res += CodedOutputStream::VarintSize32(stream);
+      }
+      return res;
+    }
+
+    uint8_t *FrameHeader::write(Framing framing, uint8_t *out) const {
+      if(framing == Framing::V1) {
+        std::memcpy(out, &length, sizeof(length));
+        return out + sizeof(length);
+      }
+      *out++ = uint8_t(flags | (uint8_t(priority) << priority_shift));
+      out = CodedOutputStream::WriteVarint32ToArray(length, out);
+      if(flags & Stream) {
+        out = CodedOutputStream::WriteVarint32ToArray(stream, out);
+      }
+      return out;
+    }
+
+    FrameHeader::Parsed FrameHeader::parse(const uint8_t *data, size_t size, FrameHeader &header, size_t &header_size) {
+      if(size == 0) {
+        header_size = 2;
+        return Parsed::Partial;
+      }
+      header.flags = uint8_t(data[0] & ((1u << priority_shift) - 1));
+      header.priority = Priority(data[0] >> priority_shift);
+      if(header.flags & ~known_flags) {
+        return Parsed::Invalid;
+      }
+      size_t stream_size = (header.flags & Stream) ? 1 : 0;
+      size_t pos = 1;
+      auto parsed = readVarint32(data, size, pos, header.length);
+      if(parsed == Parsed::Complete && stream_size > 0) {
+        parsed = readVarint32(data, size, pos, header.stream);
+        stream_size = 0;
+      } else {
+        header.stream = 0;
+      }
+      // a partial varint is followed by at least one byte of it.
+      header_size = parsed == Parsed::Partial ? size + 1 + stream_size : pos;
+      return parsed;
+    }
+  }
+}
@@ -0,0 +1,364 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "queryindex.hpp"
+
+namespace fetch {
+  namespace oef {
+    namespace {
+      using ConstraintPb = fetch::oef::pb::Query_ConstraintExpr_Constraint;
+      using ConstraintExprPb = fetch::oef::pb::Query_ConstraintExpr;
+
+      // Collects the constraints of a disjunction of constraints, returns false for any
+      // other expression.
+      bool disjunction(const ConstraintExprPb &expr, std::vector<const ConstraintPb *> &constraints) {
+        switch(expr.expression_case()) {
+        case ConstraintExprPb::kConstraint:
+          constraints.emplace_back(&expr.constraint());
+          return true;
+        case ConstraintExprPb::kOr:
+          for(auto &e : expr.or_().expr()) {
+            if(!disjunction(e, constraints)) {
+              return false;
+            }
+          }
+          return true;
+        default:
+          return false;
+        }
+      }
+
+      // Calls unit(constraints) for every unit ANDed at the top level of the query,
+      // residual(expr) for the other expressions.
+      template <typename Unit, typename Residual>
+      void split(const ConstraintExprPb &expr, Unit &unit, Residual &residual) {
+        switch(expr.expression_case()) {
+        case ConstraintExprPb::kConstraint:
+          unit(std::vector<const ConstraintPb *>{&expr.constraint()});
+          break;
+        case ConstraintExprPb::kAnd:
+          for(auto &e : expr.and_().expr()) {
+            split(e, unit, residual);
+          }
+          break;
+        case ConstraintExprPb::kOr: {
+          std::vector<const ConstraintPb *> constraints;
+          if(disjunction(expr, constraints)) {
+            unit(constraints);
+          } else {
+            residual(expr);
+          }
+          break;
+        }
+        default:
+          residual(expr);
+        }
+      }
+
+      void update(std::vector<uint32_t> &postings, uint32_t unit, bool add) {
+        if(add) {
+          postings.emplace_back(unit);
+        } else {
+          auto iter = std::find(postings.begin(), postings.end(), unit);
+          if(iter != postings.end()) {
+            postings.erase(iter);
+          }
+        }
+      }
+
+      template <typename K>
+      void update(std::unordered_map<K,std::vector<uint32_t>> &postings, const K &key, uint32_t unit, bool add) {
+        if(add) {
+          postings[key].emplace_back(unit);
+        } else {
+          auto iter = postings.find(key);
+          if(iter != postings.end()) {
+            update(iter->second, unit, false);
+            if(iter->second.empty()) {
+              postings.erase(iter);
+            }
+          }
+        }
+      }
+
+      template <typename Hit>
+      void hits(const std::vector<uint32_t> &postings, Hit &hit) {
+        for(auto unit : postings) {
+          hit(unit);
+        }
+      }
+
+      template <typename K, typename Hit>
+      void hits(const std::unordered_map<K,std::vector<uint32_t>> &postings, const K &key, Hit &hit) {
+        auto iter = postings.find(key);
+        if(iter != postings.end()) {
+          hits(iter->second, hit);
+        }
+      }
+    }
+
+    void QueryIndex::post(const ConstraintPb &c, uint32_t unit, bool add) {
+      auto attribute = attributes_.find(c.attribute_name());
+      if(attribute == attributes_.end()) {
+        if(!add) {
+          return;
+        }
+        attribute = attributes_.emplace(c.attribute_name(), AttributeIndex{}).first;
+      }
+      auto &index = attribute->second;
+      bool posted = false;
+      switch(c.constraint_case()) {
+      case ConstraintPb::kRelation:
+        if(c.relation().op() == fetch::oef::pb::Query_Relation_Operator_EQ) {
+          const auto &val = c.relation().val();
+          posted = true;
+          switch(val.value_case()) {
+          case fetch::oef::pb::Query_Value::kS:
+            update(index.strings, val.s(), unit, add);
+            break;
+          case fetch::oef::pb::Query_Value::kI:
+            update(index.ints, int64_t(val.i()), unit, add);
+            break;
+          case fetch::oef::pb::Query_Value::kB:
+            update(index.bools[val.b()], unit, add);
+            break;
+          default:
+            posted = false;
+          }
+        }
+        break;
+      case ConstraintPb::kSet:
+        if(c.set_().op() == fetch::oef::pb::Query_Set_Operator_IN) {
+          const auto &vals = c.set_().vals();
+          posted = true;
+          switch(vals.values_case()) {
+          case fetch::oef::pb::Query_Set_Values::kS:
+            for(auto &v : vals.s().vals()) {
+              update(index.strings, v, unit, add);
+            }
+            break;
+          case fetch::oef::pb::Query_Set_Values::kI:
+            for(auto v : vals.i().vals()) {
+              update(index.ints, int64_t(v), unit, add);
+            }
+            break;
+          case fetch::oef::pb::Query_Set_Values::kB:
+            for(auto v : vals.b().vals()) {
+              update(index.bools[v], unit, add);
+            }
+            break;
+          default:
+            posted = false;
+          }
+        }
+        break;
+      case ConstraintPb::kRange:
+        if(c.range_().has_i()) {
+          index.int_ranges.update(c.range_().i().first(), c.range_().i().second(), unit, add);
+          posted = true;
+        } else if(c.range_().has_d()) {
+          index.double_ranges.update(c.range_().d().first(), c.range_().d().second(), unit, add);
+          posted = true;
+        }
+        break;
+      default:
+        break;
+      }
+      if(!posted) {
+        if(add) {
+          index.others.emplace_back(unit, &c);
+        } else {
+          auto iter = std::find_if(index.others.begin(), index.others.end(),
+                                   [&c](const std::pair<uint32_t,const ConstraintPb *> &p) { return p.second == &c; });
+          if(iter != index.others.end()) {
+            index.others.erase(iter);
+          }
+        }
+      }
+      if(!add && index.empty()) {
+        attributes_.erase(attribute);
+      }
+    }
+
+    void QueryIndex::post(uint32_t slot, Entry &entry, bool add) {
+      size_t n = 0;
+      auto unit = [this,slot,add,&entry,&n](const std::vector<const ConstraintPb *> &constraints) {
+        uint32_t u;
+        if(add) {
+          if(free_units_.empty()) {
+            u = uint32_t(units_.size());
+            units_.emplace_back(slot);
+          } else {
+            u = free_units_.back();
+            free_units_.pop_back();
+            units_[u] = slot;
+          }
+          entry.units.emplace_back(u);
+        } else {
+          u = entry.units[n++];
+        }
+        for(auto *c : constraints) {
+          post(*c, u, add);
+        }
+      };
+      auto residual = [add,&entry](const ConstraintExprPb &expr) {
+        if(add) {
+          entry.residual.emplace_back(&expr);
+        }
+      };
+      for(auto &c : entry.query.handle().constraints()) {
+        split(c, unit, residual);
+      }
+      if(!add) {
+        free_units_.insert(free_units_.end(), entry.units.begin(), entry.units.end());
+      }
+    }
+
+    bool QueryIndex::add(Id id, const QueryModel &query) {
+      if(ids_.find(id) != ids_.end()) {
+        return false;
+      }
+      uint32_t slot;
+      if(free_.empty()) {
+        slot = uint32_t(slots_.size());
+        slots_.emplace_back();
+      } else {
+        slot = free_.back();
+        free_.pop_back();
+      }
+      slots_[slot] = std::make_unique<Entry>(id, query);
+      post(slot, *slots_[slot], true);
+      if(slots_[slot]->units.empty()) {
+        uncounted_.emplace_back(slot);
+      }
+      ids_.emplace(id, slot);
+      return true;
+    }
+
+    bool QueryIndex::remove(Id id) {
+      auto iter = ids_.find(id);
+      if(iter == ids_.end()) {
+        return false;
+      }
+      uint32_t slot = iter->second;
+      post(slot, *slots_[slot], false);
+      if(slots_[slot]->units.empty()) {
+        uncounted_.erase(std::find(uncounted_.begin(), uncounted_.end(), slot));
+      }
+      slots_[slot].reset();
+      free_.emplace_back(slot);
+      ids_.erase(iter);
+      return true;
+    }
+
+    void QueryIndex::match(const Instance &instance, Counters &counters, std::vector<Id> &res) const {
+      auto hit = [this,&counters](uint32_t unit) {
+        if(counters.hit[unit]) {
+          return;
+        }
+        counters.hit[unit] = 1;
+        counters.hit_units.emplace_back(unit);
+        uint32_t slot = units_[unit];
+        if(counters.counts[slot]++ == 0) {
+          counters.touched.emplace_back(slot);
+        }
+      };
+      instance.for_each_value([this,&hit](const std::string &name, const VariantType &value) {
+          auto iter = attributes_.find(name);
+          if(iter == attributes_.end()) {
+            return;
+          }
+          const auto &index = iter->second;
+          value.match([&index,&hit](int i) {
+                        hits(index.ints, int64_t(i), hit);
+                        index.int_ranges.hits(int64_t(i), hit);
+                      },
+                      [&index,&hit](double d) { index.double_ranges.hits(d, hit); },
+                      [&index,&hit](const std::string &s) { hits(index.strings, s, hit); },
+                      [&index,&hit](bool b) { hits(index.bools[b], hit); },
+                      [](const Location &) {});
+          for(auto &p : index.others) {
+            if(Constraint::check(*p.second, value)) {
+              hit(p.first);
+            }
+          }
+        });
+      auto check = [this,&instance,&res](uint32_t slot) {
+        const auto &entry = *slots_[slot];
+        if(!entry.query.checkModel(instance)) {
+          return;
+        }
+        for(auto *expr : entry.residual) {
+          if(!ConstraintExpr::check(*expr, instance)) {
+            return;
+          }
+        }
+        res.emplace_back(entry.id);
+      };
+      for(auto slot : counters.touched) {
+        if(counters.counts[slot] == slots_[slot]->units.size()) {
+          check(slot);
+        }
+        counters.counts[slot] = 0;
+      }
+      counters.touched.clear();
+      for(auto unit : counters.hit_units) {
+        counters.hit[unit] = 0;
+      }
+      counters.hit_units.clear();
+      for(auto slot : uncounted_) {
+        check(slot);
+      }
+    }
+
+    QueryIndex::Counters &QueryIndex::counters() const {
+      // the new entries are cleared, the others were cleared by the previous match.
+      if(counters_.counts.size() < slots_.size()) {
+        counters_.counts.resize(slots_.size());
+      }
+      if(counters_.hit.size() < units_.size()) {
+        counters_.hit.resize(units_.size());
+      }
+      return counters_;
+    }
+
+    std::vector<QueryIndex::Id> QueryIndex::match(const Instance &instance) const {
+      std::vector<Id> res;
+      match(instance, counters(), res);
+      return res;
+    }
+
+    std::vector<std::vector<QueryIndex::Id>> QueryIndex::match(const std::vector<Instance> &instances) const {
+      auto &counters = this->counters();
+      std::vector<std::vector<Id>> res(instances.size());
+      for(size_t i = 0; i < instances.size(); ++i) {
+        match(instances[i], counters, res[i]);
+      }
+      return res;
+    }
+
+    std::vector<std::vector<QueryIndex::Id>> QueryIndex::match(const std::vector<const Instance *> &instances) const {
+      auto &counters = this->counters();
+      std::vector<std::vector<Id>> res(instances.size());
+      for(size_t i = 0; i < instances.size(); ++i) {
+        match(*instances[i], counters, res[i]);
+      }
+      return res;
+    }
+  }
+}
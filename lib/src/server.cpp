@@ -18,10 +18,15 @@
 
 #define DEBUG_ON 1
 #include "server.hpp"
+#include "agenthandles.hpp"
+#include "connection.hpp"
+#include "wireframe.hpp"
+#include "searchcursors.hpp"
 #include <iostream>
 #include <google/protobuf/text_format.h>
 #include <sstream>
 #include <iomanip>
+#include <limits>
 
 namespace fetch {
   namespace oef {
@@ -40,13 +45,83 @@ namespace fetch {
       stde::optional<Instance> description_;
       AgentDirectory &agentDirectory_;
       ServiceDirectory &serviceDirectory_;
-      tcp::socket socket_;
+      SchemaDirectory &schemaDirectory_;
+      std::shared_ptr<Connection> connection_;
+      HandlerMemory read_memory_; // of the read in progress
+      std::unordered_map<uint32_t,uint64_t> subscriptions_; // subscription_id -> service directory subscription
+      SearchCursors cursors_;
+      std::unique_ptr<AgentHandles> handles_; // set if Capabilities.agent_handles was negotiated
+      fetch::oef::pb::Server_Answers *batch_ = nullptr; // answers of the batch being processed
+      FrameHeader request_; // of the frame being processed, its answers have its stream and priority
+      const uint32_t maxFrameSize_;
+      // Chunked message relayed chunk by chunk, by stream of the frames read.
+      struct ChunkedRelay {
+        std::shared_ptr<AgentSession> sender; // kept alive by the chunks written
+        std::shared_ptr<AgentSession> destination; // null if the chunks are discarded
+        uint32_t stream;   // of the frames written to destination
+        size_t remaining;  // payload bytes not read yet
+        int32_t msg_id;
+        int32_t dialogue_id;
+        std::string destination_key;
+        std::atomic<bool> failed{false}; // a dialogue error was sent
+        std::atomic<bool> closed{false}; // the last frame of stream, or its abort, is queued
+      };
+      std::unordered_map<uint32_t,std::shared_ptr<ChunkedRelay>> chunked_;
+      // The session stops reading while chunk_window chunks relayed from its connection are not
+      // written, so that a chunked message takes at most that many frames of memory.
+      static constexpr size_t chunk_window = 4;
+      std::mutex flow_lock_;
+      size_t chunks_writing_ = 0; // relayed chunks not written yet
+      bool paused_ = false;
+      // Search answered in chunks: the next one is taken and queued once fewer than chunk_window
+      // of its chunks are not written, so that it takes at most that many frames of memory.
+      struct StreamedSearch {
+        uint32_t msg_id;
+        size_t chunk;
+        FrameHeader header; // of the request
+        std::function<bool(size_t, std::vector<std::string> &)> next; // appends a chunk, true if the last one
+        std::mutex lock;
+        size_t writing = 0; // chunks not written yet
+        bool done = false;  // the last chunk is queued, or a write failed
+      };
+      // On a multiplexed connection, the session which connected it reads the frames of all its agents:
+      // those of stream 0 are its own, those of other streams are of the agents connected on them.
+      const uint32_t stream_ = 0; // of the frames of the agent
+      const std::shared_ptr<AgentSession> reader_; // of the connection, null if it is this session
+      std::unordered_map<uint32_t,std::shared_ptr<AgentSession>> streams_; // connected agents, by stream
+      struct Handshake {
+        std::string publicKey;
+        fetch::oef::pb::Capabilities capabilities;
+      };
+      std::unordered_map<uint32_t,Handshake> handshakes_; // agents sent the phrase, by stream
+      static constexpr size_t max_handshakes = 64; // pending on a connection, the next IDs are refused
 
       static fetch::oef::Logger logger;
       
     public:
-      explicit AgentSession(std::string publicKey, AgentDirectory &agentDirectory, ServiceDirectory &serviceDirectory, tcp::socket socket)
-        : publicKey_{std::move(publicKey)}, agentDirectory_{agentDirectory}, serviceDirectory_{serviceDirectory}, socket_(std::move(socket)) {}
+      explicit AgentSession(std::string publicKey, AgentDirectory &agentDirectory, ServiceDirectory &serviceDirectory,
+                            SchemaDirectory &schemaDirectory, tcp::socket socket, const fetch::oef::pb::Capabilities &capabilities,
+                            uint32_t maxFrameSize)
+        : publicKey_{std::move(publicKey)}, agentDirectory_{agentDirectory}, serviceDirectory_{serviceDirectory},
+          schemaDirectory_{schemaDirectory},
+          connection_{std::make_shared<Connection>(std::move(socket), negotiateFraming(capabilities.framing()),
+                                                   compressionThreshold(capabilities), capabilities.multiplex())},
+          maxFrameSize_{maxFrameSize} {
+        if(capabilities.agent_handles()) {
+          handles_ = std::make_unique<AgentHandles>();
+        }
+      }
+      // Agent connected on stream of the multiplexed connection read by reader.
+      AgentSession(std::string publicKey, AgentDirectory &agentDirectory, ServiceDirectory &serviceDirectory,
+                   SchemaDirectory &schemaDirectory, std::shared_ptr<AgentSession> reader, uint32_t stream,
+                   const fetch::oef::pb::Capabilities &capabilities)
+        : publicKey_{std::move(publicKey)}, agentDirectory_{agentDirectory}, serviceDirectory_{serviceDirectory},
+          schemaDirectory_{schemaDirectory}, connection_{reader->connection_}, maxFrameSize_{reader->maxFrameSize_},
+          stream_{stream}, reader_{std::move(reader)} {
+        if(capabilities.agent_handles()) {
+          handles_ = std::make_unique<AgentHandles>();
+        }
+      }
       virtual ~AgentSession() {
         logger.trace("~AgentSession");
         //socket_.shutdown(asio::socket_base::shutdown_both);
@@ -56,11 +131,39 @@ namespace fetch {
       void start() {
         read();
       }
-      void write(std::shared_ptr<Buffer> buffer) {
-        asyncWriteBuffer(socket_, std::move(buffer), 5);
+      void write(SharedBuffer frame) {
+        connection_->write(std::move(frame));
+      }
+      Framing framing() const { return connection_->framing(); }
+      uint32_t compression() const { return connection_->compression(); }
+      bool multiplexed() const { return connection_->multiplexed(); }
+      // header of a frame written to the agent.
+      void tag(FrameHeader &header) const {
+        if(connection_->multiplexed()) {
+          header.setStream(stream_);
+        }
+      }
+      // Held from the encoding of the handles of a frame written to the agent to its queuing.
+      std::unique_lock<std::recursive_mutex> lockHandles() const {
+        return handles_ ? handles_->lock() : std::unique_lock<std::recursive_mutex>{};
       }
-      void send(const fetch::oef::pb::Server_AgentMessage &msg) {
-        asyncWriteBuffer(socket_, serialize(msg), 10 /* sec ? */);
+      void send(fetch::oef::pb::Server_AgentMessage &msg, FrameHeader header = FrameHeader{},
+                Connection::Handler handler = nullptr) {
+        auto lock = lockHandles();
+        if(handles_) {
+          if(msg.has_agents()) {
+            handles_->encode(*msg.mutable_agents());
+          }
+          if(msg.has_batch()) {
+            for(auto &answer : *msg.mutable_batch()->mutable_answers()) {
+              if(answer.has_agents()) {
+                handles_->encode(*answer.mutable_agents());
+              }
+            }
+          }
+        }
+        tag(header);
+        connection_->send(msg, header, std::move(handler));
       }
       std::string id() const { return publicKey_; }
       bool match(const QueryModel &query) const {
@@ -70,8 +173,43 @@ namespace fetch {
         return query.check(*description_);
       }
     private:
+      static uint32_t compressionThreshold(const fetch::oef::pb::Capabilities &capabilities) {
+        if(!capabilities.compression()) {
+          return 0;
+        }
+        return capabilities.has_compression_threshold() ? std::max(capabilities.compression_threshold(), 1u)
+                                                        : CompressedFrame::default_threshold;
+      }
+      // Instances and queries can reference their data model by schema id: an unknown id leaves
+      // them without data model, so that they are not valid or do not match.
+      Instance instance(const fetch::oef::pb::Query_Instance &instance) const {
+        if(!instance.has_model() && instance.has_schema_id()) {
+          auto schema = schemaDirectory_.find(instance.schema_id());
+          if(schema) {
+            return Instance{schema->schema(), instance};
+          }
+        }
+        return Instance{instance};
+      }
+      QueryModel query(const fetch::oef::pb::Query_Model &query) const {
+        if(!query.has_model() && query.has_schema_id()) {
+          auto schema = schemaDirectory_.find(query.schema_id());
+          if(schema) {
+            return QueryModel{query, schema->schema()};
+          }
+        }
+        return QueryModel{query};
+      }
+      // Answer to the envelope being processed: part of the batch answer when processing a batch.
+      void reply(fetch::oef::pb::Server_AgentMessage &msg) {
+        if(batch_) {
+          batch_->add_answers()->Swap(&msg);
+        } else {
+          send(msg, request_);
+        }
+      }
       void processRegisterDescription(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
-        description_ = Instance(desc.description());
+        description_ = instance(desc.description());
         DEBUG(logger, "AgentSession::processRegisterDescription setting description to agent {} : {}", publicKey_, to_string(desc));
         if(!description_) {
           fetch::oef::pb::Server_AgentMessage answer;
@@ -79,107 +217,644 @@ namespace fetch {
           auto *error = answer.mutable_oef_error();
           error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_DESCRIPTION);
           logger.trace("AgentSession::processRegisterDescription sending error {} to {}", error->operation(), publicKey_);
-          send(answer);
+          reply(answer);
         }
       }
+      void processRegisterSchema(uint32_t msg_id, const fetch::oef::pb::Query_DataModel &model) {
+        DEBUG(logger, "AgentSession::processRegisterSchema from agent {} : {}", publicKey_, to_string(model));
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msg_id);
+        DataModel schema{model};
+        if(schema.valid()) {
+          auto *registered = answer.mutable_schema();
+          registered->set_schema_id(schema.id());
+          registered->set_version(schemaDirectory_.registerSchema(schema));
+          logger.trace("AgentSession::processRegisterSchema sending schema id {} version {} to {}",
+                       registered->schema_id(), registered->version(), publicKey_);
+        } else {
+          auto *error = answer.mutable_oef_error();
+          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SCHEMA);
+          logger.trace("AgentSession::processRegisterSchema sending error {} to {}", error->operation(), publicKey_);
+        }
+        reply(answer);
+      }
       void processUnregisterDescription(uint32_t msg_id) {
         description_ = stde::nullopt;
         DEBUG(logger, "AgentSession::processUnregisterDescription setting description to agent {}", publicKey_);
       }
       void processRegisterService(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
         DEBUG(logger, "AgentSession::processRegisterService registering agent {} : {}", publicKey_, to_string(desc));
-        bool success = serviceDirectory_.registerAgent(Instance(desc.description()), publicKey_);
-        if(!success) {
-          fetch::oef::pb::Server_AgentMessage answer;
-          answer.set_answer_id(msg_id);
+        uint64_t handle = serviceDirectory_.registerAgent(instance(desc.description()), publicKey_);
+        answerRegistration(msg_id, desc, handle);
+      }
+      // error if the registration failed, its handle if requested.
+      void answerRegistration(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc, uint64_t handle) {
+        if(handle > 0 && !desc.return_handle()) {
+          return;
+        }
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msg_id);
+        if(handle > 0) {
+          answer.mutable_registered()->set_handle(handle);
+        } else {
           auto *error = answer.mutable_oef_error();
           error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::REGISTER_SERVICE);
           logger.trace("AgentSession::processRegisterService sending error {} to {}", error->operation(), publicKey_);
-          send(answer);
+        }
+        reply(answer);
+      }
+      void processUnregisterHandle(uint32_t msg_id, const fetch::oef::pb::ServiceHandle &handle) {
+        DEBUG(logger, "AgentSession::processUnregisterHandle unregistering agent {} : {}", publicKey_, handle.handle());
+        if(!serviceDirectory_.unregisterAgent(handle.handle(), publicKey_)) {
+          fetch::oef::pb::Server_AgentMessage answer;
+          answer.set_answer_id(msg_id);
+          auto *error = answer.mutable_oef_error();
+          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE);
+          logger.trace("AgentSession::processUnregisterHandle sending error {} to {}", error->operation(), publicKey_);
+          reply(answer);
+        }
+      }
+      void processUpdateService(uint32_t msg_id, const fetch::oef::pb::ServiceUpdate &update) {
+        DEBUG(logger, "AgentSession::processUpdateService updating agent {} : {}", publicKey_, to_string(update));
+        if(!serviceDirectory_.update(update.handle(), publicKey_, update.values())) {
+          fetch::oef::pb::Server_AgentMessage answer;
+          answer.set_answer_id(msg_id);
+          auto *error = answer.mutable_oef_error();
+          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::UPDATE_SERVICE);
+          logger.trace("AgentSession::processUpdateService sending error {} to {}", error->operation(), publicKey_);
+          reply(answer);
+        }
+      }
+      // consecutive registrations of a batch, under one directory lock.
+      void processRegisterServices(google::protobuf::RepeatedPtrField<fetch::oef::pb::Envelope>::iterator first,
+                                   google::protobuf::RepeatedPtrField<fetch::oef::pb::Envelope>::iterator last, bool registration) {
+        std::vector<Instance> instances;
+        instances.reserve(size_t(last - first));
+        for(auto iter = first; iter != last; ++iter) {
+          instances.emplace_back(instance(registration ? iter->register_service().description() : iter->unregister_service().description()));
+        }
+        DEBUG(logger, "AgentSession::processRegisterServices {} {} services of agent {}", registration ? "registering" : "unregistering",
+              instances.size(), publicKey_);
+        if(registration) {
+          auto handles = serviceDirectory_.registerMany(std::move(instances), publicKey_);
+          for(size_t i = 0; i < handles.size(); ++i) {
+            auto iter = first + std::ptrdiff_t(i);
+            answerRegistration(iter->msg_id(), iter->register_service(), handles[i]);
+          }
+          return;
+        }
+        auto success = serviceDirectory_.unregisterMany(instances, publicKey_);
+        for(size_t i = 0; i < success.size(); ++i) {
+          if(!success[i]) {
+            fetch::oef::pb::Server_AgentMessage answer;
+            answer.set_answer_id((first + std::ptrdiff_t(i))->msg_id());
+            answer.mutable_oef_error()->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE);
+            reply(answer);
+          }
         }
       }
       void processUnregisterService(uint32_t msg_id, const fetch::oef::pb::AgentDescription &desc) {
         DEBUG(logger, "AgentSession::processUnregisterService unregistering agent {} : {}", publicKey_, to_string(desc));
-        bool success = serviceDirectory_.unregisterAgent(Instance(desc.description()), publicKey_);
+        bool success = serviceDirectory_.unregisterAgent(instance(desc.description()), publicKey_);
         if(!success) {
           fetch::oef::pb::Server_AgentMessage answer;
           answer.set_answer_id(msg_id);
           auto *error = answer.mutable_oef_error();
           error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::UNREGISTER_SERVICE);
           logger.trace("AgentSession::processUnregisterService sending error {} to {}", error->operation(), publicKey_);
-          send(answer);
+          reply(answer);
         }
       }
-      void processSearchAgents(uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
-        QueryModel model{search.query()};
-        DEBUG(logger, "AgentSession::processSearchAgents from agent {} : {}", publicKey_, to_string(search));
-        auto agents_vec = agentDirectory_.search(model);
+      // agents_vec is search(limit + 1, {}), or all the agents if limit is 0.
+      void sendSearchResult(uint32_t msg_id, std::vector<std::string> agents_vec, SearchCursors::Search search, uint32_t limit,
+                            stde::optional<uint64_t> generation = stde::nullopt) {
         fetch::oef::pb::Server_AgentMessage answer;
         answer.set_answer_id(msg_id);
-        auto agents = answer.mutable_agents();
+        auto *agents = answer.mutable_agents();
+        cursors_.page(std::move(agents_vec), std::move(search), limit, *agents);
+        if(generation) {
+          agents->set_generation(*generation);
+        }
+        reply(answer);
+      }
+      fetch::oef::pb::Server_AgentMessage searchChunk(uint32_t msg_id, std::vector<std::string> &&agents_vec, bool last) {
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msg_id);
+        auto *agents = answer.mutable_agents();
+        agents->mutable_agents()->Reserve(int(agents_vec.size()));
         for(auto &a : agents_vec) {
-          agents->add_agents(a);
+          agents->add_agents(std::move(a));
         }
-        logger.trace("AgentSession::processSearchAgents sending {} agents to {}", agents_vec.size(), publicKey_);
-        send(answer);
+        agents->set_more(!last);
+        logger.trace("AgentSession::searchChunk sending {} agents (last {}) to {}", agents_vec.size(), last, publicKey_);
+        return answer;
+      }
+      // Starts sending the chunks of search. Within a batch, they are all part of its answer.
+      void streamSearch(uint32_t msg_id, size_t chunk, std::function<bool(size_t, std::vector<std::string> &)> next) {
+        if(batch_) {
+          bool last = false;
+          while(!last) {
+            std::vector<std::string> agents_vec;
+            last = next(chunk, agents_vec);
+            auto answer = searchChunk(msg_id, std::move(agents_vec), last);
+            reply(answer);
+          }
+          return;
+        }
+        auto search = std::make_shared<StreamedSearch>();
+        search->msg_id = msg_id;
+        search->chunk = chunk;
+        search->header = request_;
+        search->next = std::move(next);
+        sendSearchChunks(search);
+      }
+      // Queues the chunks of search while the window allows it, each written chunk queues the next.
+      // The chunks are taken and queued under the lock of search, which keeps them in order.
+      void sendSearchChunks(const std::shared_ptr<StreamedSearch> &search) {
+        std::lock_guard<std::mutex> lock(search->lock);
+        while(!search->done && search->writing < chunk_window) {
+          std::vector<std::string> agents_vec;
+          search->done = search->next(search->chunk, agents_vec);
+          ++search->writing;
+          auto answer = searchChunk(search->msg_id, std::move(agents_vec), search->done);
+          std::weak_ptr<AgentSession> weak = shared_from_this();
+          send(answer, search->header, [weak,search](std::error_code ec, const SharedBuffer &) {
+              {
+                std::lock_guard<std::mutex> lock(search->lock);
+                --search->writing;
+                if(ec) {
+                  search->done = true;
+                }
+              }
+              auto session = weak.lock();
+              if(session) {
+                session->sendSearchChunks(search);
+              }
+            });
+        }
+      }
+      void processSearchAgents(uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
+        QueryModel model = query(search.query());
+        DEBUG(logger, "AgentSession::processSearchAgents from agent {} : {}", publicKey_, to_string(search));
+        if(search.chunk_size() > 0) {
+          auto agents_vec = std::make_shared<std::vector<std::string>>(agentDirectory_.search(model, search.limit()));
+          size_t offset = 0;
+          streamSearch(msg_id, search.chunk_size(), [agents_vec,offset](size_t chunk, std::vector<std::string> &agents) mutable {
+              size_t nb = std::min(chunk, agents_vec->size() - offset);
+              std::move(agents_vec->begin() + std::ptrdiff_t(offset), agents_vec->begin() + std::ptrdiff_t(offset + nb),
+                        std::back_inserter(agents));
+              offset += nb;
+              return nb < chunk;
+            });
+          return;
+        }
+        auto &directory = agentDirectory_;
+        SearchCursors::Search next = [&directory,model](size_t max, const std::unordered_set<std::string> &skip) {
+          return directory.search(model, max, skip);
+        };
+        auto agents_vec = agentDirectory_.search(model, search.limit() > 0 ? size_t(search.limit()) + 1 : 0);
+        logger.trace("AgentSession::processSearchAgents sending {} agents (limit {}) to {}", agents_vec.size(), search.limit(), publicKey_);
+        sendSearchResult(msg_id, std::move(agents_vec), std::move(next), search.limit());
       }
       void processQuery(uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
-        QueryModel model{search.query()};
+        QueryModel model = query(search.query());
         DEBUG(logger, "AgentSession::processQuery from agent {} : {}", publicKey_, to_string(search));
-        auto agents_vec = serviceDirectory_.query(model);
+        if(search.has_generation() && (search.limit() > 0 || search.chunk_size() > 0)) {
+          fetch::oef::pb::Server_AgentMessage answer;
+          answer.set_answer_id(msg_id);
+          auto *error = answer.mutable_oef_error();
+          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::SEARCH_SERVICES);
+          logger.trace("AgentSession::processQuery sending error {} to {}: generation with limit or chunk size", error->operation(), publicKey_);
+          reply(answer);
+          return;
+        }
+        if(search.chunk_size() > 0) {
+          auto stream = std::make_shared<ServiceDirectory::Stream>(serviceDirectory_.stream(model, search.limit()));
+          auto &directory = serviceDirectory_;
+          streamSearch(msg_id, search.chunk_size(), [&directory,stream](size_t chunk, std::vector<std::string> &agents) {
+              return directory.next(*stream, chunk, agents);
+            });
+          return;
+        }
+        uint64_t generation = 0;
+        if(search.has_generation()) {
+          fetch::oef::pb::Server_AgentMessage answer;
+          answer.set_answer_id(msg_id);
+          auto *agents = answer.mutable_agents();
+          std::vector<std::string> added, removed;
+          if(serviceDirectory_.changes(model, search.generation(), added, removed, generation)) {
+            for(auto &a : added) {
+              agents->add_agents(std::move(a));
+            }
+            for(auto &a : removed) {
+              agents->add_removed(std::move(a));
+            }
+            agents->set_delta(true);
+            agents->set_generation(generation);
+            logger.trace("AgentSession::processQuery sending {} added {} removed since {} to {}",
+                         added.size(), removed.size(), search.generation(), publicKey_);
+            reply(answer);
+            return;
+          }
+        }
+        auto &directory = serviceDirectory_;
+        SearchCursors::Search next = [&directory,model](size_t max, const std::unordered_set<std::string> &skip) {
+          uint64_t generation = 0;
+          return directory.limitedQuery(model, max, skip, generation);
+        };
+        auto agents_vec = serviceDirectory_.limitedQuery(model, search.limit() > 0 ? size_t(search.limit()) + 1 : 0, {}, generation);
+        logger.trace("AgentSession::processQuery sending {} agents (limit {}) to {}", agents_vec.size(), search.limit(), publicKey_);
+        sendSearchResult(msg_id, std::move(agents_vec), std::move(next), search.limit(), generation);
+      }
+      void processAggregate(uint32_t msg_id, const fetch::oef::pb::AgentAggregate &aggregate) {
+        QueryModel model = query(aggregate.query());
+        DEBUG(logger, "AgentSession::processAggregate from agent {} : {}", publicKey_, to_string(aggregate));
         fetch::oef::pb::Server_AgentMessage answer;
         answer.set_answer_id(msg_id);
-        auto agents = answer.mutable_agents();
-        for(auto &a : agents_vec) {
-          agents->add_agents(a);
+        auto *result = answer.mutable_aggregate();
+        serviceDirectory_.aggregate(model, aggregate.numeric(), aggregate.group_by(), *result);
+        logger.trace("AgentSession::processAggregate sending {} services to {}", result->services(), publicKey_);
+        reply(answer);
+      }
+      void processSearchNext(uint32_t msg_id, const fetch::oef::pb::SearchNext &next) {
+        DEBUG(logger, "AgentSession::processSearchNext from agent {} : {}", publicKey_, to_string(next));
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msg_id);
+        if(!cursors_.next(next.cursor(), next.limit(), *answer.mutable_agents())) {
+          auto *error = answer.mutable_oef_error();
+          error->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::SEARCH_NEXT);
+          logger.trace("AgentSession::processSearchNext sending error {} to {}", error->operation(), publicKey_);
         }
-        logger.trace("AgentSession::processQuery sending {} agents to {}", agents_vec.size(), publicKey_);
-        send(answer);
+        reply(answer);
       }
-      void sendDialogError(uint32_t msg_id, uint32_t dialogue_id, const std::string &origin) {
+      void processSubscribe(uint32_t msg_id, const fetch::oef::pb::AgentSearch &search) {
+        QueryModel model = query(search.query());
+        DEBUG(logger, "AgentSession::processSubscribe from agent {} : {}", publicKey_, to_string(search));
+        if(subscriptions_.find(msg_id) != subscriptions_.end()) {
+          logger.info("AgentSession::processSubscribe subscription {} already exists for {}", msg_id, publicKey_);
+          fetch::oef::pb::Server_AgentMessage answer;
+          answer.set_answer_id(msg_id);
+          answer.mutable_oef_error()->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::SUBSCRIBE_SERVICES);
+          reply(answer);
+          return;
+        }
+        std::weak_ptr<AgentSession> weak = shared_from_this();
+        subscriptions_[msg_id] = serviceDirectory_.subscribe(model,
+                                                             [weak,msg_id](const std::vector<std::string> &added, const std::vector<std::string> &removed) {
+                                                               auto session = weak.lock();
+                                                               if(!session) {
+                                                                 return;
+                                                               }
+                                                               fetch::oef::pb::Server_AgentMessage answer;
+                                                               answer.set_answer_id(msg_id);
+                                                               auto *update = answer.mutable_search_update();
+                                                               for(auto &a : added) {
+                                                                 update->add_added(a);
+                                                               }
+                                                               for(auto &a : removed) {
+                                                                 update->add_removed(a);
+                                                               }
+                                                               logger.trace("AgentSession::processSubscribe sending {} added {} removed to {}",
+                                                                            added.size(), removed.size(), session->publicKey_);
+                                                               session->send(answer);
+                                                             });
+      }
+      void processUnsubscribe(uint32_t msg_id, const fetch::oef::pb::AgentSubscription &subscription) {
+        DEBUG(logger, "AgentSession::processUnsubscribe from agent {} : {}", publicKey_, to_string(subscription));
+        auto iter = subscriptions_.find(subscription.subscription_id());
+        if(iter == subscriptions_.end()) {
+          logger.info("AgentSession::processUnsubscribe unknown subscription {} from {}", subscription.subscription_id(), publicKey_);
+          fetch::oef::pb::Server_AgentMessage answer;
+          answer.set_answer_id(msg_id);
+          answer.mutable_oef_error()->set_operation(fetch::oef::pb::Server_AgentMessage_OEFError::UNSUBSCRIBE_SERVICES);
+          reply(answer);
+          return;
+        }
+        serviceDirectory_.unsubscribe(iter->second);
+        subscriptions_.erase(iter);
+      }
+      void unsubscribeAll() {
+        for(auto &s : subscriptions_) {
+          serviceDirectory_.unsubscribe(s.second);
+        }
+        subscriptions_.clear();
+      }
+      fetch::oef::pb::Server_AgentMessage dialogueError(uint32_t msg_id, uint32_t dialogue_id, const std::string &origin) {
         fetch::oef::pb::Server_AgentMessage answer;
         answer.set_answer_id(msg_id);
         auto *error = answer.mutable_dialogue_error();
         error->set_dialogue_id(dialogue_id);
         error->set_origin(origin);
         logger.trace("AgentSession::processMessage sending dialogue error {} to {}", dialogue_id, publicKey_);
-        send(answer);
+        return answer;
       }
-      void processMessage(uint32_t msg_id, fetch::oef::pb::Agent_Message *msg) {
-        auto session = agentDirectory_.session(msg->destination());
-        DEBUG(logger, "AgentSession::processMessage from agent {} : {}", publicKey_, to_string(*msg));
-        logger.trace("AgentSession::processMessage to {} from {}", msg->destination(), publicKey_);
-        uint32_t did = msg->dialogue_id();
+      // msg is owned by the arena of the frame: the message sent is allocated on the same arena,
+      // the payload is moved into it.
+      void processMessage(uint32_t msg_id, fetch::oef::pb::Agent_Message &msg) {
+        auto session = agentDirectory_.session(msg.destination());
+        DEBUG(logger, "AgentSession::processMessage from agent {} : {}", publicKey_, to_string(msg));
+        logger.trace("AgentSession::processMessage to {} from {}", msg.destination(), publicKey_);
+        uint32_t did = msg.dialogue_id();
         if(session) {
-          fetch::oef::pb::Server_AgentMessage message;
-          message.set_answer_id(msg_id);
-          auto content = message.mutable_content();
+          auto *message = google::protobuf::Arena::CreateMessage<fetch::oef::pb::Server_AgentMessage>(msg.GetArena());
+          std::unique_ptr<fetch::oef::pb::Server_AgentMessage> owned{msg.GetArena() ? nullptr : message};
+          message->set_answer_id(msg_id);
+          auto content = message->mutable_content();
           content->set_dialogue_id(did);
           content->set_origin(publicKey_);
-          if(msg->has_content()) {
-            content->set_allocated_content(msg->release_content());
+          auto lock = session->lockHandles();
+          if(session->handles_) {
+            session->handles_->encode(*content);
+          }
+          if(msg.has_content()) {
+            content->set_content(std::move(*msg.mutable_content()));
           }
-          if(msg->has_fipa()) {
-            content->set_allocated_fipa(msg->release_fipa());
+          if(msg.has_fipa()) {
+            content->mutable_fipa()->Swap(msg.mutable_fipa());
           }
-          DEBUG(logger, "AgentSession::processMessage to agent {} : {}", msg->destination(), to_string(message));
-          auto buffer = serialize(message);
-          asyncWriteBuffer(session->socket_, buffer, 5, [this,did,msg_id,msg](std::error_code ec, std::size_t length) {
+          DEBUG(logger, "AgentSession::processMessage to agent {} : {}", msg.destination(), to_string(*message));
+          FrameHeader relayed;
+          relayed.priority = request_.priority;
+          session->tag(relayed);
+          auto self(shared_from_this());
+          session->connection_->send(*message, relayed, [this,self,did,msg_id,destination=msg.destination()](std::error_code ec, const SharedBuffer &) {
               if(ec) {
-                sendDialogError(msg_id, did, msg->destination());
+                // not an answer to the envelope being processed anymore.
+                auto answer = dialogueError(msg_id, did, destination);
+                send(answer);
               }
             });
         } else {
-          sendDialogError(msg_id, did, msg->destination());
+          auto answer = dialogueError(msg_id, did, msg.destination());
+          reply(answer);
+        }
+      }
+      // Header of frame relayed to session, whose payload is deflated in a segment of that size if
+      // deflated is set, or is in the next frames of chunked_stream if it is not 0. Called with the
+      // handles of session locked until the frame is queued.
+      SharedBuffer relayHeader(AgentSession &session, const RelayFrame &frame, stde::optional<size_t> deflated,
+                               uint32_t chunked_stream = 0) {
+        FrameHeader relayed;
+        relayed.priority = request_.priority;
+        if(chunked_stream != 0) {
+          relayed.setStream(chunked_stream);
+          relayed.flags |= FrameHeader::More;
+        } else {
+          session.tag(relayed);
+        }
+        if(session.handles_) {
+          bool created;
+          uint64_t handle = session.handles_->encode(publicKey_, created);
+          return frame.header(created ? publicKey_ : std::string{}, handle, session.framing(), relayed, deflated);
+        }
+        return frame.header(publicKey_, stde::nullopt, session.framing(), relayed, deflated);
+      }
+      // Relay of a send_message envelope scanned in buffer: the payload is written from buffer.
+      void relayMessage(const RelayFrame &frame, const SharedBuffer &buffer) {
+        auto session = agentDirectory_.session(frame.destination());
+        logger.trace("AgentSession::relayMessage to {} from {}", frame.destination(), publicKey_);
+        uint32_t msg_id = uint32_t(frame.msgId());
+        uint32_t did = uint32_t(frame.dialogueId());
+        if(session) {
+          auto lock = session->lockHandles();
+          auto header = relayHeader(*session, frame, stde::nullopt);
+          auto payload = asio::buffer(buffer->data() + frame.payloadOffset(), frame.payloadSize());
+          // the handler only captures this (kept alive by the write) so that it is not allocated,
+          // the relayed frame is scanned again on error.
+          session->connection_->write(std::move(header), buffer, payload, [this](std::error_code ec, const SharedBuffer &owner) {
+              if(ec) {
+                RelayFrame relayed;
+                (void)relayed.scan(*owner);
+                auto answer = dialogueError(uint32_t(relayed.msgId()), uint32_t(relayed.dialogueId()), relayed.destination());
+                send(answer);
+              }
+            }, shared_from_this());
+        } else {
+          auto answer = dialogueError(msg_id, did, frame.destination());
+          reply(answer);
+        }
+      }
+      // Relay of a compressed send_message envelope to session, which accepts compressed frames:
+      // the deflated payload segment scanned in buffer is written as it is.
+      void relayDeflated(AgentSession &session, const RelayFrame &frame, const CompressedFrame &compressed,
+                         const SharedBuffer &buffer) {
+        logger.trace("AgentSession::relayDeflated to {} from {}", frame.destination(), publicKey_);
+        const auto &segment = compressed.segments().back();
+        auto lock = session.lockHandles();
+        auto header = relayHeader(session, frame, segment.size);
+        auto payload = asio::buffer(buffer->data() + segment.offset, segment.size);
+        session.connection_->write(std::move(header), buffer, payload, [this](std::error_code ec, const SharedBuffer &owner) {
+            if(ec) {
+              CompressedFrame relayedCompressed;
+              RelayFrame relayed;
+              (void)(relayedCompressed.scan(*owner) && relayedCompressed.scanRelay(*owner, relayed));
+              auto answer = dialogueError(uint32_t(relayed.msgId()), uint32_t(relayed.dialogueId()), relayed.destination());
+              send(answer);
+            }
+          }, shared_from_this());
+      }
+      // A compressed envelope is inflated, unless it is a message relayed to an agent that accepts
+      // it compressed.
+      void processCompressed(const SharedBuffer &buffer) {
+        CompressedFrame compressed;
+        if(!compressed.scan(*buffer, maxFrameSize_)) {
+          logger.error("AgentSession::processCompressed invalid frame from {}", publicKey_);
+          return;
+        }
+        RelayFrame frame;
+        if(compressed.scanRelay(*buffer, frame)) {
+          auto session = agentDirectory_.session(frame.destination());
+          if(session && session->compression() > 0) {
+            relayDeflated(*session, frame, compressed, buffer);
+            return;
+          }
+        }
+        auto inflated = compressed.inflate(*buffer);
+        if(!inflated) {
+          logger.error("AgentSession::processCompressed cannot inflate frame from {}", publicKey_);
+          return;
+        }
+        process(inflated);
+      }
+      // Ends the stream of a relay dropped before its last frame with a FrameHeader::Abort frame,
+      // so that the destination does not wait for the rest of the message.
+      void abortChunks(ChunkedRelay &relay) {
+        if(!relay.destination || relay.closed.exchange(true)) {
+          return;
+        }
+        logger.info("AgentSession::abortChunks stream {} to {} from {}", relay.stream, relay.destination_key, publicKey_);
+        FrameHeader abort;
+        abort.setStream(relay.stream);
+        abort.flags |= FrameHeader::Abort;
+        abort.priority = Priority::Control;
+        auto frame = BufferPool::instance().acquire(abort.size(Framing::V2));
+        abort.write(Framing::V2, frame->data());
+        relay.destination->connection_->write(std::move(frame));
+      }
+      void chunkWritten(ChunkedRelay &relay, std::error_code ec) {
+        if(ec && !relay.failed.exchange(true)) {
+          auto answer = dialogueError(uint32_t(relay.msg_id), uint32_t(relay.dialogue_id), relay.destination_key);
+          send(answer);
+          abortChunks(relay);
+        }
+        auto &r = reader();
+        bool resume = false;
+        {
+          std::lock_guard<std::mutex> lock(r.flow_lock_);
+          --r.chunks_writing_;
+          if(r.paused_ && r.chunks_writing_ < chunk_window) {
+            r.paused_ = false;
+            resume = true;
+          }
+        }
+        if(resume) {
+          r.read();
+        }
+      }
+      // False if the session has to stop reading until the chunks being written are.
+      bool writeChunk(ChunkedRelay &relay, SharedBuffer frame, SharedBuffer owner, asio::const_buffer payload,
+                      std::shared_ptr<ChunkedRelay> keep) {
+        auto &reading = reader();
+        bool go = true;
+        {
+          std::lock_guard<std::mutex> lock(reading.flow_lock_);
+          if(++reading.chunks_writing_ >= chunk_window) {
+            reading.paused_ = true;
+            go = false;
+          }
+        }
+        // the handler only captures pointers (kept alive by keep, which keeps this alive).
+        auto *r = &relay;
+        relay.destination->connection_->write(std::move(frame), std::move(owner), payload, [this,r](std::error_code ec, const SharedBuffer &) {
+            chunkWritten(*r, ec);
+          }, std::move(keep));
+        return go;
+      }
+      // Frame of a chunked message (FrameHeader::More), or of the stream of one: the first one is a
+      // send_message envelope up to its payload bytes, relayed to a destination using framing v2
+      // (with its payload in frames of a stream of the destination), the next ones its payload
+      // bytes, unless the sender aborts it. False if the session has to stop reading until the
+      // chunks it relays are written.
+      bool processChunk(const FrameHeader &header, const SharedBuffer &buffer) {
+        auto iter = chunked_.find(header.stream);
+        if(iter == chunked_.end()) {
+          auto relay = std::make_shared<ChunkedRelay>();
+          relay->sender = shared_from_this();
+          relay->remaining = std::numeric_limits<size_t>::max();
+          chunked_.emplace(header.stream, relay);
+          RelayFrame frame;
+          if((header.flags & FrameHeader::Compressed) || !frame.scanHead(buffer->data(), buffer->size())) {
+            logger.error("AgentSession::processChunk chunked frame {} from {} is not the head of a message", header.stream, publicKey_);
+            relay->failed = true;
+            return true;
+          }
+          relay->remaining = frame.payloadSize();
+          relay->msg_id = frame.msgId();
+          relay->dialogue_id = frame.dialogueId();
+          relay->destination_key = frame.destination();
+          auto session = agentDirectory_.session(frame.destination());
+          if(!session || session->framing() == Framing::V1 || session->multiplexed()) {
+            relay->failed = true;
+            auto answer = dialogueError(uint32_t(relay->msg_id), uint32_t(relay->dialogue_id), relay->destination_key);
+            reply(answer);
+            return true;
+          }
+          logger.trace("AgentSession::processChunk relaying {} bytes to {} from {}", relay->remaining, frame.destination(), publicKey_);
+          relay->destination = session;
+          relay->stream = session->connection_->openStream();
+          auto lock = session->lockHandles();
+          return writeChunk(*relay, relayHeader(*session, frame, stde::nullopt, relay->stream), nullptr, asio::const_buffer{}, relay);
+        }
+        auto relay = iter->second;
+        bool last = (header.flags & (FrameHeader::More | FrameHeader::Abort)) != FrameHeader::More;
+        if(last) {
+          chunked_.erase(iter);
+        }
+        if(header.flags & FrameHeader::Abort) {
+          abortChunks(*relay);
+          return true;
+        }
+        if(relay->failed || !relay->destination) {
+          return true;
         }
+        if(buffer->size() > relay->remaining || (last && buffer->size() != relay->remaining) || (header.flags & FrameHeader::Compressed)) {
+          logger.error("AgentSession::processChunk chunk of {} bytes for {} remaining from {}", buffer->size(), relay->remaining, publicKey_);
+          relay->failed = true;
+          abortChunks(*relay);
+          connection_->socket().close();
+          return true;
+        }
+        relay->remaining -= buffer->size();
+        FrameHeader chunk;
+        chunk.setStream(relay->stream);
+        chunk.priority = request_.priority;
+        if(!last) {
+          chunk.flags |= FrameHeader::More;
+        } else if(relay->closed.exchange(true)) { // aborted by a failed write
+          return true;
+        }
+        chunk.length = uint32_t(buffer->size());
+        auto prefix = BufferPool::instance().acquire(chunk.size(Framing::V2));
+        chunk.write(Framing::V2, prefix->data());
+        return writeChunk(*relay, std::move(prefix), buffer, asio::buffer(*buffer), relay);
+      }
+      void processBatch(uint32_t msg_id, fetch::oef::pb::Batch &batch) {
+        DEBUG(logger, "AgentSession::processBatch {} envelopes from agent {}", batch.envelopes_size(), publicKey_);
+        fetch::oef::pb::Server_AgentMessage answer;
+        answer.set_answer_id(msg_id);
+        batch_ = answer.mutable_batch();
+        auto &envelopes = *batch.mutable_envelopes();
+        for(auto iter = envelopes.begin(); iter != envelopes.end();) {
+          auto payload_case = iter->payload_case();
+          if(payload_case == fetch::oef::pb::Envelope::kRegisterService || payload_case == fetch::oef::pb::Envelope::kUnregisterService) {
+            auto last = std::find_if(iter, envelopes.end(), [payload_case](const fetch::oef::pb::Envelope &e) {
+                return e.payload_case() != payload_case; });
+            processRegisterServices(iter, last, payload_case == fetch::oef::pb::Envelope::kRegisterService);
+            iter = last;
+          } else {
+            if(payload_case == fetch::oef::pb::Envelope::kBatch) {
+              logger.error("AgentSession::processBatch nested batch {} from {}", iter->msg_id(), publicKey_);
+            } else {
+              dispatch(*iter);
+            }
+            ++iter;
+          }
+        }
+        batch_ = nullptr;
+        logger.trace("AgentSession::processBatch sending {} answers to {}", answer.batch().answers_size(), publicKey_);
+        send(answer, request_);
+      }
+      // The envelope is only parsed if its processing needs it: relayed messages are not, and
+      // neither are the payloads without content.
+      void process(const SharedBuffer &buffer) {
+        EnvelopeFrame scanned;
+        if(scanned.scan(*buffer)) {
+          switch(scanned.payloadCase()) {
+          case fetch::oef::pb::Envelope::kSendMessage: {
+            RelayFrame frame;
+            if(frame.scan(*buffer, scanned)) {
+              relayMessage(frame, buffer);
+              return;
+            }
+            break;
+          }
+          case fetch::oef::pb::Envelope::kUnregisterDescription:
+            processUnregisterDescription(uint32_t(scanned.msgId()));
+            return;
+          default:
+            break;
+          }
+        }
+        FrameArena arena; // released once the frame, including a batch, is processed
+        auto *envelope = deserialize<fetch::oef::pb::Envelope>(*buffer, arena.get());
+        dispatch(*envelope);
       }
-      void process(const std::shared_ptr<Buffer> &buffer) {
-        auto envelope = deserialize<fetch::oef::pb::Envelope>(*buffer);
+      void dispatch(fetch::oef::pb::Envelope &envelope) {
         auto payload_case = envelope.payload_case();
         uint32_t msg_id = envelope.msg_id();
         switch(payload_case) {
         case fetch::oef::pb::Envelope::kSendMessage:
-          processMessage(msg_id, envelope.release_send_message());
+          processMessage(msg_id, *envelope.mutable_send_message());
           break;
         case fetch::oef::pb::Envelope::kRegisterService:
           processRegisterService(msg_id, envelope.register_service());
@@ -199,79 +874,238 @@ namespace fetch {
         case fetch::oef::pb::Envelope::kSearchServices:
           processQuery(msg_id, envelope.search_services());
           break;
+        case fetch::oef::pb::Envelope::kSubscribeServices:
+          processSubscribe(msg_id, envelope.subscribe_services());
+          break;
+        case fetch::oef::pb::Envelope::kUnsubscribeServices:
+          processUnsubscribe(msg_id, envelope.unsubscribe_services());
+          break;
+        case fetch::oef::pb::Envelope::kSearchNext:
+          processSearchNext(msg_id, envelope.search_next());
+          break;
+        case fetch::oef::pb::Envelope::kAggregateServices:
+          processAggregate(msg_id, envelope.aggregate_services());
+          break;
+        case fetch::oef::pb::Envelope::kUpdateService:
+          processUpdateService(msg_id, envelope.update_service());
+          break;
+        case fetch::oef::pb::Envelope::kUnregisterHandle:
+          processUnregisterHandle(msg_id, envelope.unregister_handle());
+          break;
+        case fetch::oef::pb::Envelope::kRegisterSchema:
+          processRegisterSchema(msg_id, envelope.register_schema());
+          break;
+        case fetch::oef::pb::Envelope::kBatch:
+          processBatch(msg_id, *envelope.mutable_batch());
+          break;
         case fetch::oef::pb::Envelope::PAYLOAD_NOT_SET:
           logger.error("AgentSession::process cannot process payload {} from {}", payload_case, publicKey_);
         }
       }
       void read() {
         auto self(shared_from_this());
-        asyncReadBuffer(socket_, 5, [this, self](std::error_code ec, std::shared_ptr<Buffer> buffer) {
-                                if(ec) {
-                                  agentDirectory_.remove(publicKey_);
-                                  serviceDirectory_.unregisterAll(publicKey_);
-                                  logger.info("AgentSession::read error on id {} ec {}", publicKey_, ec);
-                                } else {
-                                  process(buffer);
-                                  read();
-                                }});
+        asyncReadFrame(connection_->socket(), connection_->framing(), maxFrameSize_, [self](std::error_code ec, const FrameHeader &header, SharedBuffer buffer) {
+                         self->onRead(ec, header, buffer);
+                       }, &read_memory_);
+      }
+      AgentSession &reader() { return reader_ ? *reader_ : *this; }
+      void disconnect() {
+        unsubscribeAll();
+        for(auto &c : chunked_) {
+          abortChunks(*c.second);
+        }
+        chunked_.clear();
+        agentDirectory_.remove(publicKey_);
+        serviceDirectory_.unregisterAll(publicKey_);
+      }
+      void onRead(std::error_code ec, const FrameHeader &header, const SharedBuffer &buffer) {
+        if(ec) {
+          disconnect();
+          logger.info("AgentSession::read error on id {} ec {}", publicKey_, ec);
+          for(auto &s : streams_) {
+            s.second->disconnect();
+            logger.info("AgentSession::read error on id {} ec {}", s.second->publicKey_, ec);
+          }
+          streams_.clear();
+          handshakes_.clear();
+        } else {
+          bool go = connection_->multiplexed() && header.stream != 0 ? demultiplex(header, buffer) : processFrame(header, buffer);
+          if(go) {
+            read();
+          } // else read once chunks are written
+        }
+      }
+      // False if the session has to stop reading until the chunks it relays are written.
+      bool processFrame(const FrameHeader &header, const SharedBuffer &buffer) {
+        request_ = header;
+        if((header.flags & FrameHeader::More) || (!chunked_.empty() && chunked_.count(header.stream) > 0)) {
+          return processChunk(header, buffer);
+        }
+        if(header.flags & FrameHeader::Abort) { // of a message already dropped
+          return true;
+        }
+        if(header.flags & FrameHeader::Compressed) {
+          processCompressed(buffer);
+        } else {
+          process(buffer);
+        }
+        return true;
+      }
+      // Frame of a stream of the multiplexed connection other than 0: of the agent connected on it,
+      // or of its handshake (Agent.Server.ID, then Agent.Server.Answer) whose answers are sent on it.
+      // An empty frame disconnects the agent of its stream, which can then be used by another one.
+      bool demultiplex(const FrameHeader &header, const SharedBuffer &buffer) {
+        bool plain = (header.flags & (FrameHeader::Compressed | FrameHeader::More)) == 0;
+        auto iter = streams_.find(header.stream);
+        if(iter != streams_.end()) {
+          auto &session = *iter->second;
+          if(plain && buffer->empty() && session.chunked_.count(header.stream) == 0) {
+            session.disconnect();
+            logger.info("AgentSession::demultiplex {} disconnected from stream {} of {}", session.publicKey_, header.stream, publicKey_);
+            streams_.erase(iter);
+            return true;
+          }
+          return session.processFrame(header, buffer);
+        }
+        FrameHeader answer;
+        answer.setStream(header.stream);
+        answer.priority = header.priority;
+        auto handshake = handshakes_.find(header.stream);
+        if(handshake == handshakes_.end()) {
+          fetch::oef::pb::Agent_Server_ID id;
+          fetch::oef::pb::Server_Phrase phrase;
+          if(!plain || !id.ParseFromArray(buffer->data(), int(buffer->size()))) {
+            logger.error("AgentSession::demultiplex error parsing ID on stream {} of {}", header.stream, publicKey_);
+            (void)phrase.mutable_failure();
+          } else if(agentDirectory_.exist(id.public_key())) {
+            logger.info("AgentSession::demultiplex ID {} already connected", id.public_key());
+            (void)phrase.mutable_failure();
+          } else if(handshakes_.size() >= max_handshakes) {
+            logger.info("AgentSession::demultiplex too many handshakes in progress on {}", publicKey_);
+            (void)phrase.mutable_failure();
+          } else {
+            logger.trace("AgentSession::demultiplex connection from {} on stream {} of {}", id.public_key(), header.stream, publicKey_);
+            phrase.set_phrase("RandomlyGeneratedString");
+            handshakes_.emplace(header.stream, Handshake{id.public_key(), id.capabilities()});
+          }
+          connection_->send(phrase, answer);
+          return true;
+        }
+        Handshake agent = std::move(handshake->second);
+        handshakes_.erase(handshake);
+        fetch::oef::pb::Agent_Server_Answer ans;
+        fetch::oef::pb::Server_Connected status;
+        if(!plain || !ans.ParseFromArray(buffer->data(), int(buffer->size()))) {
+          logger.error("AgentSession::demultiplex error on Answer publicKey {}", agent.publicKey);
+          status.set_status(false);
+          connection_->send(status, answer);
+          return true;
+        }
+        // should check the secret with the public key i.e. ID.
+        auto session = std::make_shared<AgentSession>(agent.publicKey, agentDirectory_, serviceDirectory_, schemaDirectory_,
+                                                      shared_from_this(), header.stream, agent.capabilities);
+        // Connected is written before the frames relayed to the agent.
+        auto connected = [this,&agent,&answer]() {
+          fetch::oef::pb::Server_Connected status;
+          status.set_status(true);
+          if(agent.capabilities.agent_handles()) {
+            status.mutable_capabilities()->set_agent_handles(true);
+          }
+          connection_->send(status, answer);
+        };
+        if(agentDirectory_.add(agent.publicKey, session, connected)) {
+          streams_.emplace(header.stream, std::move(session));
+        } else {
+          logger.info("AgentSession::demultiplex PublicKey already connected (interleaved) publicKey {}", agent.publicKey);
+          status.set_status(false);
+          connection_->send(status, answer);
+        }
+        return true;
       }
       
     };
     fetch::oef::Logger AgentSession::logger = fetch::oef::Logger("oef-node::agent-session");
 
     const std::vector<std::string> AgentDirectory::search(const QueryModel &query) const {
+      return search(query, 0);
+    }
+
+    std::vector<std::string> AgentDirectory::search(const QueryModel &query, size_t max,
+                                                    const std::unordered_set<std::string> &skip) const {
       std::lock_guard<std::mutex> lock(lock_);
       std::vector<std::string> res;
       for(const auto &s : sessions_) {
-        if(s.second->match(query)) {
+        if(max > 0 && res.size() >= max) {
+          break;
+        }
+        if(skip.find(s.first) == skip.end() && s.second->match(query)) {
           res.emplace_back(s.first);
         }
       }
       return res;
     }
 
-    void Server::secretHandshake(const std::string &publicKey, const std::shared_ptr<Context> &context) {
+    void Server::secretHandshake(const std::string &publicKey, const fetch::oef::pb::Capabilities &capabilities,
+                                 const std::shared_ptr<Context> &context) {
       fetch::oef::pb::Server_Phrase phrase;
       phrase.set_phrase("RandomlyGeneratedString");
-      auto phrase_buffer = serialize(phrase);
+      auto phrase_buffer = frame(phrase);
       logger.trace("Server::secretHandshake sending phrase size {}", phrase_buffer->size());
       asyncWriteBuffer(context->socket_, phrase_buffer, 10 /* sec ? */);
       logger.trace("Server::secretHandshake waiting answer");
       asyncReadBuffer(context->socket_, 5,
-                      [this,publicKey,context](std::error_code ec, std::shared_ptr<Buffer> buffer) {
+                      [this,publicKey,capabilities,context](std::error_code ec, SharedBuffer buffer) {
                         if(ec) {
                           logger.error("Server::secretHandshake read failure {}", ec.value());
                         } else {
                           try {
                             auto ans = deserialize<fetch::oef::pb::Agent_Server_Answer>(*buffer);
                             logger.trace("Server::secretHandshake secret [{}]", ans.answer());
-                            auto session = std::make_shared<AgentSession>(publicKey, agentDirectory_, serviceDirectory_, std::move(context->socket_));
-                            if(agentDirectory_.add(publicKey, session)) {
-                              session->start();
+                            auto session = std::make_shared<AgentSession>(publicKey, agentDirectory_, serviceDirectory_, schemaDirectory_,
+                                                                          std::move(context->socket_), capabilities, maxFrameSize_);
+                            // Connected is written before the frames relayed to the session, which
+                            // are in the negotiated framing.
+                            auto connected = [&session,&capabilities]() {
                               fetch::oef::pb::Server_Connected status;
                               status.set_status(true);
-                              session->write(serialize(status));
+                              if(capabilities.agent_handles()) {
+                                status.mutable_capabilities()->set_agent_handles(true);
+                              }
+                              if(session->framing() != Framing::V1) {
+                                status.mutable_capabilities()->set_framing(uint32_t(session->framing()));
+                              }
+                              if(session->compression() > 0) {
+                                status.mutable_capabilities()->set_compression(true);
+                                status.mutable_capabilities()->set_compression_threshold(session->compression());
+                              }
+                              if(session->multiplexed()) {
+                                status.mutable_capabilities()->set_multiplex(true);
+                              }
+                              session->write(frame(status));
+                            };
+                            if(agentDirectory_.add(publicKey, session, connected)) {
+                              session->start();
                             } else {
                               fetch::oef::pb::Server_Connected status;
                               status.set_status(false);
                               logger.info("Server::secretHandshake PublicKey already connected (interleaved) publicKey {}", publicKey);
-                              asyncWriteBuffer(context->socket_, serialize(status), 10 /* sec ? */);
+                              asyncWriteBuffer(context->socket_, frame(status), 10 /* sec ? */);
                             }
                             // should check the secret with the public key i.e. ID.
                           } catch(std::exception &) {
                             logger.error("Server::secretHandshake error on Answer publicKey {}", publicKey);
                             fetch::oef::pb::Server_Connected status;
                             status.set_status(false);
-                            asyncWriteBuffer(context->socket_, serialize(status), 10 /* sec ? */);
+                            asyncWriteBuffer(context->socket_, frame(status), 10 /* sec ? */);
                           }
                           // everything is fine -> send connection OK.
                         }
-                      });
+                      }, nullptr, max_handshake_frame_size);
     }
     void Server::newSession(tcp::socket socket) {
       auto context = std::make_shared<Context>(std::move(socket));
       asyncReadBuffer(context->socket_, 5,
-                      [this,context](std::error_code ec, std::shared_ptr<Buffer> buffer) {
+                      [this,context](std::error_code ec, SharedBuffer buffer) {
                         if(ec) {
                           logger.error("Server::newSession read failure {}", ec.value());
                         } else {
@@ -281,21 +1115,21 @@ namespace fetch {
                             logger.trace("Debug {}", to_string(id));
                             logger.trace("Server::newSession connection from {}", id.public_key());
                             if(!agentDirectory_.exist(id.public_key())) { // not yet connected
-                              secretHandshake(id.public_key(), context);
+                              secretHandshake(id.public_key(), id.capabilities(), context);
                             } else {
                               logger.info("Server::newSession ID {} already connected", id.public_key());
                               fetch::oef::pb::Server_Phrase failure;
                               (void)failure.mutable_failure();
-                              asyncWriteBuffer(context->socket_, serialize(failure), 10 /* sec ? */);
+                              asyncWriteBuffer(context->socket_, frame(failure), 10 /* sec ? */);
                             }
                           } catch(std::exception &) {
                             logger.error("Server::newSession error parsing ID");
                             fetch::oef::pb::Server_Phrase failure;
                             (void)failure.mutable_failure();
-                            asyncWriteBuffer(context->socket_, serialize(failure), 10 /* sec ? */);
+                            asyncWriteBuffer(context->socket_, frame(failure), 10 /* sec ? */);
                           }
                         }
-                      });
+                      }, nullptr, max_handshake_frame_size);
     }
     void Server::do_accept() {
       logger.trace("Server::do_accept");
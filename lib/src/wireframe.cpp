@@ -0,0 +1,314 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "wireframe.hpp"
+#include "compression.hpp"
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace fetch {
+  namespace oef {
+    using google::protobuf::io::CodedInputStream;
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+
+    namespace {
+      constexpr uint32_t tag(uint32_t field, WireFormatLite::WireType type) {
+        return (field << 3) | uint32_t(type);
+      }
+      constexpr uint32_t varintTag(uint32_t field) { return tag(field, WireFormatLite::WIRETYPE_VARINT); }
+      constexpr uint32_t bytesTag(uint32_t field) { return tag(field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED); }
+
+      // Reads a length delimited field's length and checks it fits in what is left to read.
+      bool readLength(CodedInputStream &in, uint32_t &length) {
+        if(!in.ReadVarint32(&length)) {
+          return false;
+        }
+        int left = in.BytesUntilLimit();
+        return left < 0 || length <= uint32_t(left);
+      }
+      // Field numbers of the Envelope payload oneof, all of them are messages.
+      bool isPayloadField(uint32_t field) {
+        static const std::vector<bool> fields = [] {
+          std::vector<bool> res;
+          const auto *payload = fetch::oef::pb::Envelope::descriptor()->FindOneofByName("payload");
+          for(int i = 0; i < payload->field_count(); ++i) {
+            size_t number = size_t(payload->field(i)->number());
+            res.resize(std::max(res.size(), number + 1));
+            res[number] = true;
+          }
+          return res;
+        }();
+        return field < fields.size() && fields[field];
+      }
+      bool readInt32(CodedInputStream &in, int32_t &value) {
+        uint64_t v;
+        if(!in.ReadVarint64(&v)) {
+          return false;
+        }
+        value = int32_t(v);
+        return true;
+      }
+    }
+
+    bool EnvelopeFrame::scan(const Buffer &frame) {
+      CodedInputStream in{frame.data(), int(frame.size())};
+      in.PushLimit(int(frame.size()));
+      bool has_msg_id = false;
+      uint32_t payload_tag = 0;
+      while(uint32_t t = in.ReadTag()) {
+        uint32_t field = WireFormatLite::GetTagFieldNumber(t);
+        if(t == varintTag(1)) { // msg_id
+          if(!readInt32(in, msg_id_)) {
+            return false;
+          }
+          has_msg_id = true;
+        } else if(t == bytesTag(field) && isPayloadField(field) && t != payload_tag) {
+          uint32_t size;
+          if(!readLength(in, size)) {
+            return false;
+          }
+          payload_tag = t;
+          payload_offset_ = size_t(in.CurrentPosition());
+          payload_size_ = size;
+          if(!in.Skip(int(size))) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+      }
+      payload_case_ = fetch::oef::pb::Envelope::PayloadCase(WireFormatLite::GetTagFieldNumber(payload_tag));
+      return in.BytesUntilLimit() == 0 && has_msg_id && payload_tag != 0;
+    }
+
+    bool RelayFrame::scan(const Buffer &frame, const EnvelopeFrame &envelope) {
+      if(envelope.payloadCase() != fetch::oef::pb::Envelope::kSendMessage) {
+        return false;
+      }
+      msg_id_ = envelope.msgId();
+      CodedInputStream in{frame.data(), int(frame.size())};
+      in.PushLimit(int(envelope.payloadOffset() + envelope.payloadSize()));
+      in.Skip(int(envelope.payloadOffset()));
+      bool has_dialogue_id = false, has_destination = false;
+      payload_ = Payload::None;
+      payload_offset_ = payload_size_ = 0;
+      while(uint32_t m = in.ReadTag()) {
+        if(m == varintTag(1)) { // dialogue_id
+          if(!readInt32(in, dialogue_id_)) {
+            return false;
+          }
+          has_dialogue_id = true;
+        } else if(m == bytesTag(2)) { // destination
+          uint32_t size;
+          if(!readLength(in, size) || !in.ReadString(&destination_, int(size))) {
+            return false;
+          }
+          has_destination = true;
+        } else if(m == bytesTag(3) || (m == bytesTag(4) && payload_ != Payload::Fipa)) { // content or fipa
+          uint32_t size;
+          if(!readLength(in, size)) {
+            return false;
+          }
+          payload_ = Payload(WireFormatLite::GetTagFieldNumber(m));
+          payload_offset_ = size_t(in.CurrentPosition());
+          payload_size_ = size;
+          if(!in.Skip(int(size))) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+      }
+      return in.BytesUntilLimit() == 0 && has_dialogue_id && has_destination;
+    }
+
+    bool RelayFrame::scan(const Buffer &frame) {
+      EnvelopeFrame envelope;
+      return envelope.scan(frame) && scan(frame, envelope);
+    }
+
+    bool RelayFrame::scanHead(const uint8_t *head, size_t size) {
+      CodedInputStream in{head, int(size)};
+      size_t message_end = 0;
+      bool has_msg_id = false, has_dialogue_id = false, has_destination = false;
+      for(;;) { // envelope fields, send_message being the last one
+        uint32_t t = in.ReadTag();
+        if(t == varintTag(1)) { // msg_id
+          if(!readInt32(in, msg_id_)) {
+            return false;
+          }
+          has_msg_id = true;
+        } else if(t == bytesTag(fetch::oef::pb::Envelope::kSendMessageFieldNumber)) {
+          uint32_t length;
+          if(!in.ReadVarint32(&length)) {
+            return false;
+          }
+          message_end = size_t(in.CurrentPosition()) + length;
+          break;
+        } else {
+          return false;
+        }
+      }
+      payload_ = Payload::None;
+      for(;;) { // Agent.Message fields, the payload being the last one
+        uint32_t m = in.ReadTag();
+        if(m == varintTag(1)) { // dialogue_id
+          if(!readInt32(in, dialogue_id_)) {
+            return false;
+          }
+          has_dialogue_id = true;
+        } else if(m == bytesTag(2)) { // destination
+          uint32_t length;
+          if(!readLength(in, length) || !in.ReadString(&destination_, int(length))) {
+            return false;
+          }
+          has_destination = true;
+        } else if(m == bytesTag(3) || m == bytesTag(4)) { // content or fipa
+          uint32_t length;
+          if(!in.ReadVarint32(&length) || size_t(in.CurrentPosition()) != size || size + length != message_end) {
+            return false;
+          }
+          payload_ = Payload(WireFormatLite::GetTagFieldNumber(m));
+          payload_offset_ = size;
+          payload_size_ = length;
+          break;
+        } else {
+          return false;
+        }
+      }
+      return has_msg_id && has_dialogue_id && has_destination;
+    }
+
+    SharedBuffer RelayFrame::header(const std::string &origin, stde::optional<uint64_t> origin_handle,
+                                    Framing framing, FrameHeader frame, stde::optional<size_t> deflated) const {
+      // Server.AgentMessage.Content, without the payload bytes.
+      size_t content_size = 1 + CodedOutputStream::VarintSize32SignExtended(dialogue_id_)
+        + 1 + CodedOutputStream::VarintSize32(uint32_t(origin.size())) + origin.size();
+      if(origin_handle) {
+        content_size += 1 + CodedOutputStream::VarintSize64(*origin_handle);
+      }
+      if(payload_ != Payload::None) {
+        content_size += 1 + CodedOutputStream::VarintSize32(uint32_t(payload_size_)) + payload_size_;
+      }
+      // Server.AgentMessage
+      size_t message_size = 1 + CodedOutputStream::VarintSize32SignExtended(msg_id_)
+        + 1 + CodedOutputStream::VarintSize32(uint32_t(content_size)) + content_size;
+      size_t head_size = message_size - (payload_ != Payload::None ? payload_size_ : 0);
+      size_t deflated_header = 0;
+      bool chunked = (frame.flags & FrameHeader::More) != 0;
+      if(chunked) { // the payload bytes are the next frames of the stream
+        assert(framing == Framing::V2 && !deflated);
+        frame.length = uint32_t(head_size);
+      } else if(deflated) { // raw segment of the head, deflated segment of the payload
+        assert(framing == Framing::V2 && payload_ != Payload::None);
+        deflated_header = CompressedFrame::segmentHeaderSize(*deflated, true, payload_size_);
+        frame.flags |= FrameHeader::Compressed;
+        frame.length = uint32_t(CompressedFrame::segmentHeaderSize(head_size, false, head_size) + head_size
+                                + deflated_header + *deflated);
+      } else {
+        frame.length = uint32_t(message_size);
+      }
+      size_t header_size = frame.size(framing) + frame.length
+        - (chunked ? 0 : deflated ? *deflated : payload_ != Payload::None ? payload_size_ : 0);
+
+      auto buffer = BufferPool::instance().acquire(header_size);
+      uint8_t *p = frame.write(framing, buffer->data());
+      if(deflated) {
+        p = CompressedFrame::writeSegmentHeader(head_size, false, head_size, p);
+      }
+      p = CodedOutputStream::WriteTagToArray(varintTag(1), p); // answer_id
+      p = CodedOutputStream::WriteVarint32SignExtendedToArray(msg_id_, p);
+      p = CodedOutputStream::WriteTagToArray(bytesTag(2), p); // content
+      p = CodedOutputStream::WriteVarint32ToArray(uint32_t(content_size), p);
+      p = CodedOutputStream::WriteTagToArray(varintTag(1), p); // content.dialogue_id
+      p = CodedOutputStream::WriteVarint32SignExtendedToArray(dialogue_id_, p);
+      p = CodedOutputStream::WriteTagToArray(bytesTag(2), p); // content.origin
+      p = CodedOutputStream::WriteVarint32ToArray(uint32_t(origin.size()), p);
+      p = CodedOutputStream::WriteRawToArray(origin.data(), int(origin.size()), p);
+      if(origin_handle) {
+        p = CodedOutputStream::WriteTagToArray(varintTag(5), p); // content.origin_handle
+        p = CodedOutputStream::WriteVarint64ToArray(*origin_handle, p);
+      }
+      if(payload_ != Payload::None) { // content.content or content.fipa, the bytes follow the header
+        p = CodedOutputStream::WriteTagToArray(bytesTag(uint32_t(payload_)), p);
+        p = CodedOutputStream::WriteVarint32ToArray(uint32_t(payload_size_), p);
+      }
+      if(deflated) {
+        p = CompressedFrame::writeSegmentHeader(*deflated, true, payload_size_, p);
+      }
+      assert(p == buffer->data() + buffer->size());
+      return buffer;
+    }
+
+    ChunkedMessage::ChunkedMessage(int32_t msg_id, int32_t dialogue_id, const std::string &destination,
+                                   size_t content_size, FrameHeader header)
+      : header_{header}, remaining_{content_size} {
+      size_t message_size = 1 + CodedOutputStream::VarintSize32SignExtended(dialogue_id)
+        + 1 + CodedOutputStream::VarintSize32(uint32_t(destination.size())) + destination.size()
+        + 1 + CodedOutputStream::VarintSize64(content_size) + content_size;
+      size_t head_size = 1 + CodedOutputStream::VarintSize32SignExtended(msg_id)
+        + 1 + CodedOutputStream::VarintSize64(message_size) + message_size - content_size;
+      header_.flags |= FrameHeader::More;
+      header_.length = uint32_t(head_size);
+      head_ = BufferPool::instance().acquire(header_.size(Framing::V2) + head_size);
+      uint8_t *p = header_.write(Framing::V2, head_->data());
+      p = CodedOutputStream::WriteTagToArray(varintTag(1), p); // msg_id
+      p = CodedOutputStream::WriteVarint32SignExtendedToArray(msg_id, p);
+      p = CodedOutputStream::WriteTagToArray(bytesTag(fetch::oef::pb::Envelope::kSendMessageFieldNumber), p);
+      p = CodedOutputStream::WriteVarint64ToArray(message_size, p);
+      p = CodedOutputStream::WriteTagToArray(varintTag(1), p); // dialogue_id
+      p = CodedOutputStream::WriteVarint32SignExtendedToArray(dialogue_id, p);
+      p = CodedOutputStream::WriteTagToArray(bytesTag(2), p); // destination
+      p = CodedOutputStream::WriteVarint32ToArray(uint32_t(destination.size()), p);
+      p = CodedOutputStream::WriteRawToArray(destination.data(), int(destination.size()), p);
+      p = CodedOutputStream::WriteTagToArray(bytesTag(3), p); // content, the bytes are the next frames
+      p = CodedOutputStream::WriteVarint64ToArray(content_size, p);
+      assert(p == head_->data() + head_->size());
+    }
+
+    SharedBuffer ChunkedMessage::chunk(const uint8_t *data, size_t size) {
+      if(size > remaining_) {
+        throw std::length_error("ChunkedMessage::chunk over the content size");
+      }
+      remaining_ -= size;
+      FrameHeader header = header_;
+      if(remaining_ == 0) {
+        header.flags &= uint8_t(~FrameHeader::More);
+      }
+      header.length = uint32_t(size);
+      auto frame = BufferPool::instance().acquire(header.size(Framing::V2) + size);
+      std::memcpy(header.write(Framing::V2, frame->data()), data, size);
+      return frame;
+    }
+
+    SharedBuffer ChunkedMessage::abort() {
+      remaining_ = 0;
+      FrameHeader header = header_;
+      header.flags = uint8_t((header.flags & ~FrameHeader::More) | FrameHeader::Abort);
+      header.length = 0;
+      auto frame = BufferPool::instance().acquire(header.size(Framing::V2));
+      header.write(Framing::V2, frame->data());
+      return frame;
+    }
+  }
+}
@@ -19,7 +19,21 @@
 #include "catch.hpp"
 #include "schema.hpp"
 #include "agent.pb.h"
+#include "agenthandles.hpp"
+#include "clientmsg.hpp"
+#include "compression.hpp"
+#include "framing.hpp"
+#include "wireframe.hpp"
+#include "searchcursors.hpp"
+#include "server.hpp"
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/text_format.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <unordered_set>
 
 namespace Test {
 
@@ -78,4 +92,1034 @@ namespace Test {
     std::cout << toJsonString<Envelope>(e4) << "\n";
     */
   }
+
+  TEST_CASE("search cursors", "[search]") {
+    fetch::oef::SearchCursors cursors{2};
+    std::vector<std::string> agents{"Agent1", "Agent2", "Agent3", "Agent4", "Agent5"};
+    fetch::oef::pb::Server_SearchResult all;
+    cursors.page(agents, 0, all);
+    REQUIRE(all.agents_size() == 5);
+    REQUIRE(!all.has_cursor());
+    fetch::oef::pb::Server_SearchResult first;
+    cursors.page(agents, 2, first);
+    REQUIRE(first.agents_size() == 2);
+    REQUIRE(first.agents(1) == "Agent2");
+    REQUIRE(first.has_cursor());
+    fetch::oef::pb::Server_SearchResult second;
+    REQUIRE(cursors.next(first.cursor(), 2, second));
+    REQUIRE(second.agents(0) == "Agent3");
+    REQUIRE(second.cursor() == first.cursor());
+    fetch::oef::pb::Server_SearchResult last;
+    REQUIRE(cursors.next(first.cursor(), 10, last));
+    REQUIRE(last.agents_size() == 1);
+    REQUIRE(!last.has_cursor());
+    REQUIRE(cursors.size() == 0);
+    fetch::oef::pb::Server_SearchResult unknown;
+    REQUIRE(!cursors.next(first.cursor(), 1, unknown));
+    // the oldest cursor is dropped.
+    fetch::oef::pb::Server_SearchResult r1, r2, r3;
+    cursors.page(agents, 1, r1);
+    cursors.page(agents, 1, r2);
+    cursors.page(agents, 1, r3);
+    REQUIRE(cursors.size() == 2);
+    REQUIRE(!cursors.next(r1.cursor(), 1, unknown));
+    REQUIRE(cursors.next(r3.cursor(), 1, unknown));
+  }
+  TEST_CASE("lazy search cursors", "[search]") {
+    fetch::oef::SearchCursors cursors;
+    std::vector<std::string> agents{"Agent1", "Agent2", "Agent3", "Agent4", "Agent5"};
+    std::vector<size_t> maxes;
+    auto search = [&agents,&maxes](size_t max, const std::unordered_set<std::string> &skip) {
+      maxes.push_back(max);
+      std::vector<std::string> res;
+      for(auto &a : agents) {
+        if((max == 0 || res.size() < max) && skip.find(a) == skip.end()) {
+          res.push_back(a);
+        }
+      }
+      return res;
+    };
+    // one more agent than the limit is searched, to know if there are more.
+    fetch::oef::pb::Server_SearchResult first;
+    cursors.page(search, 2, first);
+    REQUIRE(maxes == std::vector<size_t>{3});
+    REQUIRE(first.agents_size() == 2);
+    REQUIRE(first.has_cursor());
+    // the next page is searched again, without the agents sent.
+    agents.erase(agents.begin() + 2);
+    agents.push_back("Agent6");
+    fetch::oef::pb::Server_SearchResult second;
+    REQUIRE(cursors.next(first.cursor(), 3, second));
+    REQUIRE(maxes.back() == 4);
+    REQUIRE(second.agents_size() == 3);
+    REQUIRE(second.agents(0) == "Agent4");
+    REQUIRE(second.agents(2) == "Agent6");
+    REQUIRE(!second.has_cursor());
+    REQUIRE(cursors.size() == 0);
+    // exactly limit agents: no cursor.
+    agents.resize(2);
+    fetch::oef::pb::Server_SearchResult exact;
+    cursors.page(search, 2, exact);
+    REQUIRE(exact.agents_size() == 2);
+    REQUIRE(!exact.has_cursor());
+    fetch::oef::pb::Server_SearchResult all;
+    cursors.page(search, 0, all);
+    REQUIRE(maxes.back() == 0);
+    REQUIRE(all.agents_size() == 2);
+  }
+  TEST_CASE("agent handles", "[handles]") {
+    fetch::oef::AgentHandles handles;
+    fetch::oef::AgentDictionary dictionary;
+    std::vector<std::string> keys;
+    for(int i = 0; i < 100; ++i) {
+      keys.emplace_back(std::string(44, 'A') + std::to_string(i));
+    }
+    fetch::oef::pb::Server_SearchResult first;
+    for(auto &k : keys) {
+      first.add_agents(k);
+    }
+    size_t full_size = first.ByteSizeLong();
+    handles.encode(first);
+    REQUIRE(first.agents_size() == 0);
+    REQUIRE(first.dictionary_size() == 100);
+    fetch::oef::pb::Server_SearchResult second;
+    for(auto &k : keys) {
+      second.add_agents(k);
+    }
+    handles.encode(second);
+    REQUIRE(second.dictionary_size() == 0);
+    REQUIRE(second.ByteSizeLong() * 10 < full_size);
+    REQUIRE(dictionary.decode(first));
+    REQUIRE(dictionary.decode(second));
+    REQUIRE(second.agents_size() == 100);
+    REQUIRE(second.agents(42) == keys[42]);
+    // origin of relayed messages.
+    fetch::oef::pb::Server_AgentMessage_Content content;
+    content.set_dialogue_id(1);
+    content.set_origin(keys[1]);
+    handles.encode(content);
+    REQUIRE(content.origin().empty());
+    REQUIRE(dictionary.decode(content));
+    REQUIRE(content.origin() == keys[1]);
+    content.set_origin("NewAgent");
+    handles.encode(content);
+    REQUIRE(content.origin() == "NewAgent");
+    REQUIRE(dictionary.decode(content));
+    content.set_origin("NewAgent");
+    handles.encode(content);
+    fetch::oef::pb::Server_AgentMessage_Content copy{content};
+    REQUIRE(dictionary.decode(content));
+    REQUIRE(content.origin() == "NewAgent");
+    fetch::oef::AgentDictionary other;
+    REQUIRE(!other.decode(copy));
+  }
+  TEST_CASE("agent handles queued in order", "[handles]") {
+    // sessions relaying concurrently to an agent: the frames are queued with the handles locked,
+    // so that the agent always gets a key before its handle alone.
+    fetch::oef::AgentHandles handles;
+    std::vector<fetch::oef::pb::Server_AgentMessage_Content> queue;
+    std::vector<std::thread> senders;
+    for(int t = 0; t < 4; ++t) {
+      senders.emplace_back([&handles,&queue]() {
+          for(int i = 0; i < 1000; ++i) {
+            fetch::oef::pb::Server_AgentMessage_Content content;
+            content.set_dialogue_id(i);
+            content.set_origin("Agent" + std::to_string(i % 50));
+            auto lock = handles.lock();
+            handles.encode(content);
+            queue.emplace_back(std::move(content));
+          }
+        });
+    }
+    for(auto &t : senders) {
+      t.join();
+    }
+    REQUIRE(queue.size() == 4000);
+    REQUIRE(handles.size() == 50);
+    fetch::oef::AgentDictionary dictionary;
+    for(auto &content : queue) {
+      REQUIRE(dictionary.decode(content));
+      REQUIRE(content.origin() == "Agent" + std::to_string(content.dialogue_id() % 50));
+    }
+  }
+  TEST_CASE("pooled frames", "[serialization]") {
+    fetch::oef::Message msg{42, 7, "Agent2", std::string(300, 'x')};
+    auto f = frame(msg.handle());
+    uint32_t len;
+    std::memcpy(&len, f->data(), sizeof(len));
+    REQUIRE(len == f->size() - sizeof(len));
+    REQUIRE(Buffer(f->begin() + sizeof(len), f->end()) == *serialize(msg.handle()));
+  }
+  TEST_CASE("buffer pool", "[serialization]") {
+    auto &pool = fetch::oef::BufferPool::instance();
+    // the pool is shared with the other tests: the counts are compared with the ones once the
+    // buffer is acquired, whether it was allocated or reused.
+    auto initial = pool.stats();
+    auto buffer = pool.acquire(300);
+    auto before = pool.stats();
+    REQUIRE(before.hits + before.misses == initial.hits + initial.misses + 1);
+    REQUIRE(before.retained_buffers == initial.retained_buffers - (before.hits - initial.hits));
+    REQUIRE(buffer->size() == 300);
+    const uint8_t *data = buffer->data();
+    auto copy = buffer;
+    REQUIRE(buffer.use_count() == 2);
+    buffer.reset();
+    REQUIRE(copy.use_count() == 1);
+    REQUIRE(pool.stats().retained_buffers == before.retained_buffers);
+    copy.reset();
+    auto released = pool.stats();
+    REQUIRE(released.retained_buffers == before.retained_buffers + 1);
+    REQUIRE(released.retained_bytes >= before.retained_bytes + 300);
+    // same size class, from the thread cache.
+    auto other = pool.acquire(400);
+    REQUIRE(other->data() == data);
+    REQUIRE(other->size() == 400);
+    auto after = pool.stats();
+    REQUIRE(after.hits == released.hits + 1);
+    REQUIRE(after.retained_buffers == before.retained_buffers);
+    // not pooled.
+    auto big = pool.acquire(8 * 1024 * 1024);
+    big.reset();
+    REQUIRE(pool.stats().retained_buffers == before.retained_buffers);
+    // the buffers over the thread cache are shared with the other threads.
+    std::vector<fetch::oef::SharedBuffer> buffers;
+    for(int i = 0; i < 100; ++i) {
+      buffers.emplace_back(pool.acquire(100000));
+    }
+    size_t acquired = pool.stats().retained_buffers;
+    buffers.clear();
+    REQUIRE(pool.stats().retained_buffers == acquired + 100);
+    size_t hits = pool.stats().hits;
+    std::thread t{[&pool]() {
+        for(int i = 0; i < 50; ++i) {
+          (void)pool.acquire(100000);
+        }
+      }};
+    t.join();
+    REQUIRE(pool.stats().hits == hits + 50);
+    REQUIRE(pool.stats().hitRate() > 0.0);
+  }
+  TEST_CASE("envelope frames", "[relay]") {
+    fetch::oef::DataModel car{"car", {fetch::oef::Attribute{"price", fetch::oef::Type::Int, true}}};
+    fetch::oef::QueryModel query{{fetch::oef::Constraint{"price", fetch::oef::Relation{fetch::oef::Relation::Op::Lt, 10}}}, car};
+    fetch::oef::SearchServices search{12, query};
+    auto buffer = serialize(search.handle());
+    fetch::oef::EnvelopeFrame frame;
+    REQUIRE(frame.scan(*buffer));
+    REQUIRE(frame.msgId() == 12);
+    REQUIRE(frame.payloadCase() == fetch::oef::pb::Envelope::kSearchServices);
+    fetch::oef::pb::AgentSearch payload;
+    REQUIRE(payload.ParseFromArray(buffer->data() + frame.payloadOffset(), int(frame.payloadSize())));
+    REQUIRE(payload.SerializeAsString() == search.handle().search_services().SerializeAsString());
+    buffer = serialize(fetch::oef::UnregisterDescription{13}.handle());
+    REQUIRE(frame.scan(*buffer));
+    REQUIRE(frame.msgId() == 13);
+    REQUIRE(frame.payloadCase() == fetch::oef::pb::Envelope::kUnregisterDescription);
+    REQUIRE(frame.payloadSize() == 0);
+    // the last payload field is the one set.
+    Buffer both = *serialize(search.handle());
+    both.insert(both.end(), buffer->begin(), buffer->end());
+    REQUIRE(frame.scan(both));
+    REQUIRE(frame.payloadCase() == fetch::oef::pb::Envelope::kUnregisterDescription);
+    REQUIRE(frame.msgId() == 13);
+    // parsed: merged payload, no payload, no msg_id.
+    Buffer twice = *serialize(search.handle());
+    auto second = *serialize(search.handle());
+    twice.insert(twice.end(), second.begin(), second.end());
+    REQUIRE(!frame.scan(twice));
+    fetch::oef::pb::Envelope envelope;
+    envelope.set_msg_id(1);
+    REQUIRE(!frame.scan(*serialize(envelope)));
+    envelope = search.handle();
+    envelope.clear_msg_id();
+    REQUIRE(!frame.scan(*serialize(envelope)));
+  }
+  // Frame written by the node for a relayed envelope: header followed by the payload bytes.
+  fetch::oef::pb::Server_AgentMessage relayed(const fetch::oef::RelayFrame &frame, const Buffer &buffer,
+                                              const std::string &origin, stde::optional<uint64_t> handle) {
+    auto header = frame.header(origin, handle);
+    Buffer out{header->begin(), header->end()};
+    out.insert(out.end(), buffer.begin() + frame.payloadOffset(), buffer.begin() + frame.payloadOffset() + frame.payloadSize());
+    uint32_t len;
+    std::memcpy(&len, out.data(), sizeof(len));
+    REQUIRE(len == out.size() - sizeof(len));
+    fetch::oef::pb::Server_AgentMessage message;
+    REQUIRE(message.ParseFromArray(out.data() + sizeof(len), int(len)));
+    return message;
+  }
+  TEST_CASE("relay frames", "[relay]") {
+    fetch::oef::Message msg{42, 7, "Agent2", std::string(300, 'x')};
+    auto buffer = serialize(msg.handle());
+    fetch::oef::RelayFrame frame;
+    REQUIRE(frame.scan(*buffer));
+    REQUIRE(frame.msgId() == 42);
+    REQUIRE(frame.dialogueId() == 7);
+    REQUIRE(frame.destination() == "Agent2");
+    REQUIRE(frame.payload() == fetch::oef::RelayFrame::Payload::Content);
+    REQUIRE(frame.payloadSize() == 300);
+    auto message = relayed(frame, *buffer, "Agent1", stde::nullopt);
+    REQUIRE(message.answer_id() == 42);
+    REQUIRE(message.content().dialogue_id() == 7);
+    REQUIRE(message.content().origin() == "Agent1");
+    REQUIRE(!message.content().has_origin_handle());
+    REQUIRE(message.content().content() == std::string(300, 'x'));
+    // fipa payload, negative dialogue id and origin handle.
+    fetch::oef::DataModel car{"car", {fetch::oef::Attribute{"price", fetch::oef::Type::Int, true}}};
+    fetch::oef::QueryModel query{{fetch::oef::Constraint{"price", fetch::oef::Relation{fetch::oef::Relation::Op::Lt, 10}}}, car};
+    fetch::oef::CFP cfp{uint32_t(-3), "Agent2", fetch::oef::CFPType{query}, 5};
+    buffer = serialize(cfp.handle());
+    REQUIRE(frame.scan(*buffer));
+    REQUIRE(frame.payload() == fetch::oef::RelayFrame::Payload::Fipa);
+    message = relayed(frame, *buffer, "", uint64_t(300));
+    REQUIRE(message.content().dialogue_id() == -3);
+    REQUIRE(message.content().origin().empty());
+    REQUIRE(message.content().origin_handle() == 300);
+    REQUIRE(message.content().fipa().SerializeAsString() == cfp.handle().send_message().fipa().SerializeAsString());
+    // no payload.
+    fetch::oef::pb::Envelope envelope{msg.handle()};
+    envelope.mutable_send_message()->clear_content();
+    buffer = serialize(envelope);
+    REQUIRE(frame.scan(*buffer));
+    REQUIRE(frame.payload() == fetch::oef::RelayFrame::Payload::None);
+    message = relayed(frame, *buffer, "Agent1", stde::nullopt);
+    REQUIRE(message.content().payload_case() == fetch::oef::pb::Server_AgentMessage_Content::PAYLOAD_NOT_SET);
+    // parsed by the node.
+    envelope.mutable_send_message()->clear_destination();
+    REQUIRE(!frame.scan(*serialize(envelope)));
+    REQUIRE(!frame.scan(*serialize(fetch::oef::UnregisterDescription{1}.handle())));
+    Buffer repeated = *serialize(msg.handle());
+    auto tail = *serialize(msg.handle());
+    repeated.insert(repeated.end(), tail.begin(), tail.end()); // send_message is merged
+    REQUIRE(!frame.scan(repeated));
+    Buffer truncated{buffer->begin(), buffer->end() - 1};
+    REQUIRE(!frame.scan(truncated));
+  }
+  TEST_CASE("frame headers", "[framing]") {
+    using fetch::oef::FrameHeader;
+    using fetch::oef::Framing;
+    for(uint32_t length : {0u, 127u, 128u, 300000u, 0xffffffffu}) {
+      for(uint32_t stream : {0u, 1u, 200u}) {
+        FrameHeader header;
+        header.length = length;
+        header.setStream(stream);
+        header.priority = fetch::oef::Priority::High;
+        uint8_t data[FrameHeader::max_size];
+        size_t size = size_t(header.write(Framing::V2, data) - data);
+        REQUIRE(size == header.size(Framing::V2));
+        FrameHeader parsed;
+        size_t parsed_size;
+        REQUIRE(FrameHeader::parse(data, size, parsed, parsed_size) == FrameHeader::Parsed::Complete);
+        REQUIRE(parsed_size == size);
+        REQUIRE(parsed.length == length);
+        REQUIRE(parsed.stream == stream);
+        REQUIRE(parsed.priority == fetch::oef::Priority::High);
+        // the minimum size of a partial header is never past its end.
+        for(size_t n = 0; n < size; ++n) {
+          REQUIRE(FrameHeader::parse(data, n, parsed, parsed_size) == FrameHeader::Parsed::Partial);
+          REQUIRE(parsed_size > n);
+          REQUIRE(parsed_size <= size);
+        }
+      }
+    }
+    FrameHeader header;
+    header.length = 5;
+    REQUIRE(header.size(Framing::V1) == sizeof(uint32_t));
+    uint8_t data[FrameHeader::max_size];
+    header.write(Framing::V2, data);
+    FrameHeader parsed;
+    size_t size;
+    data[0] |= 0x20; // reserved flag
+    REQUIRE(FrameHeader::parse(data, 2, parsed, size) == FrameHeader::Parsed::Invalid);
+    const uint8_t too_long[] = {0x40, 0xff, 0xff, 0xff, 0xff, 0x7f};
+    REQUIRE(FrameHeader::parse(too_long, sizeof(too_long), parsed, size) == FrameHeader::Parsed::Invalid);
+    // relayed in the framing of the destination.
+    fetch::oef::Message msg{42, 7, "Agent2", std::string(300, 'x')};
+    auto buffer = serialize(msg.handle());
+    fetch::oef::RelayFrame frame;
+    REQUIRE(frame.scan(*buffer));
+    header.setStream(3);
+    auto relayed = frame.header("Agent1", stde::nullopt, Framing::V2, header);
+    REQUIRE(FrameHeader::parse(relayed->data(), relayed->size(), parsed, size) == FrameHeader::Parsed::Complete);
+    REQUIRE(parsed.stream == 3);
+    REQUIRE(parsed.length == relayed->size() - size + frame.payloadSize());
+  }
+  TEST_CASE("framed reads", "[framing]") {
+    using fetch::oef::FrameHeader;
+    using fetch::oef::Framing;
+    asio::io_context io;
+    tcp::acceptor acceptor{io, tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+    tcp::socket client{io}, server{io};
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    // small frames are read with their header, large ones are not.
+    std::vector<std::pair<std::string,uint32_t>> sent{{"small", 0}, {std::string(100000, 'l'), 5}, {"", 1}, {std::string(200, 's'), 0}};
+    Buffer out;
+    for(auto &s : sent) {
+      fetch::oef::pb::Agent_Server_Answer answer;
+      answer.set_answer(s.first);
+      FrameHeader header;
+      header.setStream(s.second);
+      auto f = frame(answer, Framing::V2, header);
+      out.insert(out.end(), f->begin(), f->end());
+    }
+    out.push_back(0x20); // reserved flag
+    out.push_back(0);
+    asio::write(client, asio::buffer(out));
+    HandlerMemory memory;
+    std::vector<std::pair<std::string,uint32_t>> received;
+    std::error_code error;
+    std::function<void()> read = [&]() {
+      fetch::oef::asyncReadFrame(server, Framing::V2, default_max_frame_size, [&](std::error_code ec, const FrameHeader &header, fetch::oef::SharedBuffer buffer) {
+          if(ec) {
+            error = ec;
+            return;
+          }
+          REQUIRE(header.length == buffer->size());
+          received.emplace_back(deserialize<fetch::oef::pb::Agent_Server_Answer>(*buffer).answer(), header.stream);
+          read();
+        }, &memory);
+    };
+    read();
+    io.run();
+    REQUIRE(received == sent);
+    REQUIRE(error == std::make_error_code(std::errc::protocol_error));
+  }
+  TEST_CASE("frame size limits", "[framing]") {
+    using fetch::oef::FrameHeader;
+    using fetch::oef::Framing;
+    asio::io_context io;
+    tcp::acceptor acceptor{io, tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+    tcp::socket client{io}, server{io};
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    fetch::oef::pb::Agent_Server_Answer answer;
+    answer.set_answer(std::string(1000, 'a'));
+    auto small = frame(answer, Framing::V2, FrameHeader{});
+    answer.set_answer(std::string(5000, 'a'));
+    auto large = frame(answer, Framing::V2, FrameHeader{});
+    asio::write(client, std::vector<asio::const_buffer>{asio::buffer(*small), asio::buffer(*large)});
+    std::vector<size_t> received;
+    std::error_code error;
+    std::function<void()> read = [&]() {
+      fetch::oef::asyncReadFrame(server, Framing::V2, 4096, [&](std::error_code ec, const FrameHeader &header, fetch::oef::SharedBuffer buffer) {
+          if(ec) {
+            error = ec;
+            REQUIRE(!buffer);
+            return;
+          }
+          received.push_back(header.length);
+          read();
+        });
+    };
+    read();
+    io.run();
+    REQUIRE(received == std::vector<size_t>{small->size() - 3});
+    REQUIRE(error == std::make_error_code(std::errc::message_size));
+    // same for V1 frames.
+    io.restart();
+    uint32_t length = 5000;
+    asio::write(client, asio::buffer(&length, sizeof(length)));
+    error = std::error_code{};
+    fetch::oef::asyncReadFrame(server, Framing::V1, 4096, [&](std::error_code ec, const FrameHeader &, fetch::oef::SharedBuffer) {
+        error = ec;
+      });
+    io.run();
+    REQUIRE(error == std::make_error_code(std::errc::message_size));
+    // a compressed frame inflating to more than the limit.
+    auto compressed = fetch::oef::compressFrame(large, 0);
+    FrameHeader header;
+    size_t size;
+    REQUIRE(FrameHeader::parse(compressed->data(), compressed->size(), header, size) == FrameHeader::Parsed::Complete);
+    Buffer bytes(compressed->begin() + std::ptrdiff_t(size), compressed->end());
+    fetch::oef::CompressedFrame scanned;
+    REQUIRE(scanned.scan(bytes));
+    REQUIRE(!scanned.scan(bytes, 4096));
+  }
+  TEST_CASE("chunked messages", "[relay]") {
+    using fetch::oef::FrameHeader;
+    using fetch::oef::Framing;
+    std::string content;
+    for(int i = 0; i < 10000; ++i) {
+      content.push_back(char('a' + i % 26));
+    }
+    FrameHeader stream;
+    stream.setStream(9);
+    stream.priority = fetch::oef::Priority::High;
+    fetch::oef::ChunkedMessage chunked{42, 7, "Agent2", content.size(), stream};
+    // the head is the envelope up to its content bytes.
+    auto &head = chunked.head();
+    FrameHeader header;
+    size_t size;
+    REQUIRE(FrameHeader::parse(head->data(), head->size(), header, size) == FrameHeader::Parsed::Complete);
+    REQUIRE(header.stream == 9);
+    REQUIRE(header.priority == fetch::oef::Priority::High);
+    REQUIRE((header.flags & FrameHeader::More) != 0);
+    REQUIRE(size + header.length == head->size());
+    fetch::oef::RelayFrame relay;
+    REQUIRE(relay.scanHead(head->data() + size, header.length));
+    REQUIRE(relay.msgId() == 42);
+    REQUIRE(relay.dialogueId() == 7);
+    REQUIRE(relay.destination() == "Agent2");
+    REQUIRE(relay.payload() == fetch::oef::RelayFrame::Payload::Content);
+    REQUIRE(relay.payloadSize() == content.size());
+    fetch::oef::RelayFrame truncated;
+    REQUIRE(!truncated.scanHead(head->data() + size, header.length - 1));
+    // with the content, the head and chunks are the envelope.
+    Buffer envelope(head->begin() + std::ptrdiff_t(size), head->end());
+    const auto *data = reinterpret_cast<const uint8_t*>(content.data());
+    for(size_t offset = 0; offset < content.size(); offset += 4096) {
+      size_t n = std::min<size_t>(4096, content.size() - offset);
+      auto chunk = chunked.chunk(data + offset, n);
+      REQUIRE(FrameHeader::parse(chunk->data(), chunk->size(), header, size) == FrameHeader::Parsed::Complete);
+      REQUIRE(header.stream == 9);
+      REQUIRE(header.length == n);
+      REQUIRE(((header.flags & FrameHeader::More) != 0) == (offset + n < content.size()));
+      envelope.insert(envelope.end(), chunk->begin() + std::ptrdiff_t(size), chunk->end());
+    }
+    REQUIRE(chunked.remaining() == 0);
+    REQUIRE_THROWS_AS(chunked.chunk(data, 1), std::length_error);
+    auto parsed = deserialize<fetch::oef::pb::Envelope>(envelope);
+    REQUIRE(parsed.msg_id() == 42);
+    REQUIRE(parsed.send_message().destination() == "Agent2");
+    REQUIRE(parsed.send_message().content() == content);
+    // relayed head: the content bytes are the next frames of the stream of the destination.
+    FrameHeader relayed;
+    relayed.setStream(0x80000001);
+    relayed.flags |= FrameHeader::More;
+    auto relayedHead = relay.header("Agent1", stde::nullopt, Framing::V2, relayed);
+    REQUIRE(FrameHeader::parse(relayedHead->data(), relayedHead->size(), header, size) == FrameHeader::Parsed::Complete);
+    REQUIRE(header.stream == 0x80000001);
+    REQUIRE((header.flags & FrameHeader::More) != 0);
+    REQUIRE(size + header.length == relayedHead->size());
+    Buffer message(relayedHead->begin() + std::ptrdiff_t(size), relayedHead->end());
+    message.insert(message.end(), content.begin(), content.end());
+    auto received = deserialize<fetch::oef::pb::Server_AgentMessage>(message);
+    REQUIRE(received.answer_id() == 42);
+    REQUIRE(received.content().origin() == "Agent1");
+    REQUIRE(received.content().dialogue_id() == 7);
+    REQUIRE(received.content().content() == content);
+  }
+  TEST_CASE("compressed frames", "[compression]") {
+    using fetch::oef::CompressedFrame;
+    using fetch::oef::FrameHeader;
+    using fetch::oef::Framing;
+    // Message of a V2 frame, and its header.
+    auto message = [](const fetch::oef::SharedBuffer &f, FrameHeader &header) {
+      size_t size;
+      REQUIRE(FrameHeader::parse(f->data(), f->size(), header, size) == FrameHeader::Parsed::Complete);
+      REQUIRE(size + header.length == f->size());
+      return Buffer(f->begin() + std::ptrdiff_t(size), f->end());
+    };
+    fetch::oef::pb::Server_AgentMessage answer;
+    answer.set_answer_id(3);
+    for(int i = 0; i < 200; ++i) {
+      answer.mutable_agents()->add_agents("Agent" + std::to_string(i));
+    }
+    FrameHeader header;
+    header.setStream(4);
+    auto plain = frame(answer, Framing::V2, header);
+    auto compressed = fetch::oef::compressFrame(plain, 1024);
+    REQUIRE(compressed->size() < plain->size() / 2);
+    FrameHeader parsed;
+    Buffer bytes = message(compressed, parsed);
+    REQUIRE((parsed.flags & FrameHeader::Compressed) != 0);
+    REQUIRE(parsed.stream == 4);
+    CompressedFrame scanned;
+    REQUIRE(scanned.scan(bytes));
+    REQUIRE(scanned.segments().size() == 1);
+    auto inflated = scanned.inflate(bytes);
+    REQUIRE(inflated);
+    REQUIRE(*inflated == message(plain, parsed));
+    // under the threshold, or not smaller.
+    REQUIRE(fetch::oef::compressFrame(plain, plain->size()).get() == plain.get());
+    fetch::oef::pb::Agent_Message random;
+    std::string noise;
+    for(uint32_t i = 0, x = 1; i < 4000; ++i, x = x * 1103515245 + 12345) {
+      noise.push_back(char(x >> 24));
+    }
+    random.set_content(noise);
+    auto incompressible = frame(random, Framing::V2, FrameHeader{});
+    REQUIRE(fetch::oef::compressFrame(incompressible, 1).get() == incompressible.get());
+    // truncated segment, wrong inflated size.
+    REQUIRE(!scanned.scan(Buffer(bytes.begin(), bytes.end() - 1)));
+    Buffer wrong = bytes;
+    wrong[google::protobuf::io::CodedOutputStream::VarintSize64(uint64_t(scanned.segments()[0].size) << 1)] ^= 1; // inflated size
+    REQUIRE(scanned.scan(wrong));
+    REQUIRE(!scanned.inflate(wrong));
+
+    // relayed with the payload deflated.
+    fetch::oef::Message msg{42, 7, "Agent2", std::string(5000, 'x')};
+    auto envelope = fetch::oef::compressedEnvelope(msg.handle(), FrameHeader{});
+    bytes = message(envelope, parsed);
+    REQUIRE(scanned.scan(bytes));
+    REQUIRE(scanned.segments().size() == 2);
+    REQUIRE(scanned.inflatedSize() == msg.handle().ByteSizeLong());
+    REQUIRE(*scanned.inflate(bytes) == *serialize(msg.handle()));
+    fetch::oef::RelayFrame relay;
+    REQUIRE(scanned.scanRelay(bytes, relay));
+    REQUIRE(relay.msgId() == 42);
+    REQUIRE(relay.dialogueId() == 7);
+    REQUIRE(relay.destination() == "Agent2");
+    REQUIRE(relay.payloadSize() == 5000);
+    const auto &segment = scanned.segments().back();
+    auto head = relay.header("Agent1", stde::nullopt, Framing::V2, FrameHeader{}, segment.size);
+    Buffer relayed{head->begin(), head->end()};
+    relayed.insert(relayed.end(), bytes.begin() + std::ptrdiff_t(segment.offset), bytes.end());
+    auto relayedFrame = fetch::oef::BufferPool::instance().acquire(relayed.size());
+    *relayedFrame = relayed;
+    Buffer relayedBytes = message(relayedFrame, parsed);
+    REQUIRE((parsed.flags & FrameHeader::Compressed) != 0);
+    REQUIRE(scanned.scan(relayedBytes));
+    fetch::oef::pb::Server_AgentMessage received;
+    inflated = scanned.inflate(relayedBytes);
+    REQUIRE(received.ParseFromArray(inflated->data(), int(inflated->size())));
+    REQUIRE(received.answer_id() == 42);
+    REQUIRE(received.content().origin() == "Agent1");
+    REQUIRE(received.content().content() == std::string(5000, 'x'));
+    // other envelopes are compressed as a whole.
+    fetch::oef::pb::Envelope search;
+    search.set_msg_id(1);
+    search.mutable_register_schema()->set_name(std::string(3000, 's'));
+    bytes = message(fetch::oef::compressedEnvelope(search, FrameHeader{}), parsed);
+    REQUIRE(scanned.scan(bytes));
+    REQUIRE(!scanned.scanRelay(bytes, relay));
+    REQUIRE(*scanned.inflate(bytes) == *serialize(search));
+  }
+  // Agent connected to a Server of the local host, with blocking reads and writes.
+  class TestAgent {
+  private:
+    asio::io_context io_;
+  public:
+    tcp::socket socket{io_};
+    fetch::oef::Framing framing = fetch::oef::Framing::V1;
+    fetch::oef::pb::Server_Connected connected;
+
+    TestAgent(const std::string &key, const fetch::oef::pb::Capabilities &capabilities = fetch::oef::pb::Capabilities{}) {
+      socket.connect(tcp::endpoint(asio::ip::address_v4::loopback(), static_cast<unsigned short>(Ports::Agents)));
+      fetch::oef::pb::Agent_Server_ID id;
+      id.set_public_key(key);
+      *id.mutable_capabilities() = capabilities;
+      asio::write(socket, asio::buffer(*frame(id)));
+      fetch::oef::FrameHeader header;
+      REQUIRE(read<fetch::oef::pb::Server_Phrase>(header).has_phrase());
+      fetch::oef::pb::Agent_Server_Answer answer;
+      answer.set_answer("answer");
+      asio::write(socket, asio::buffer(*frame(answer)));
+      connected = read<fetch::oef::pb::Server_Connected>(header);
+      REQUIRE(connected.status());
+      if(connected.capabilities().framing() > 0) {
+        framing = fetch::oef::Framing(connected.capabilities().framing());
+      }
+    }
+    template <typename T>
+    void write(const T &t, uint32_t stream = 0) {
+      fetch::oef::FrameHeader header;
+      header.setStream(stream);
+      asio::write(socket, asio::buffer(*frame(t, framing, header)));
+    }
+    void write(const fetch::oef::SharedBuffer &f) {
+      asio::write(socket, asio::buffer(*f));
+    }
+    Buffer read(fetch::oef::FrameHeader &header) {
+      header = fetch::oef::FrameHeader{};
+      if(framing == fetch::oef::Framing::V1) {
+        asio::read(socket, asio::buffer(&header.length, sizeof(header.length)));
+      } else {
+        uint8_t data[fetch::oef::FrameHeader::max_size];
+        size_t read = 0, size = 0;
+        while(fetch::oef::FrameHeader::parse(data, read, header, size) == fetch::oef::FrameHeader::Parsed::Partial) {
+          asio::read(socket, asio::buffer(data + read, size - read));
+          read = size;
+        }
+      }
+      Buffer message(header.length);
+      asio::read(socket, asio::buffer(message));
+      return message;
+    }
+    template <typename T>
+    T read(fetch::oef::FrameHeader &header) {
+      auto message = read(header);
+      T t;
+      REQUIRE(t.ParseFromArray(message.data(), int(message.size())));
+      return t;
+    }
+  };
+  fetch::oef::pb::Capabilities multiplexed() {
+    fetch::oef::pb::Capabilities capabilities;
+    capabilities.set_framing(2);
+    capabilities.set_multiplex(true);
+    return capabilities;
+  }
+  // Handshake of key on stream of the multiplexed connection of agent, true if it is connected.
+  bool connectStream(TestAgent &agent, const std::string &key, uint32_t stream) {
+    fetch::oef::pb::Agent_Server_ID id;
+    id.set_public_key(key);
+    agent.write(id, stream);
+    fetch::oef::FrameHeader header;
+    auto phrase = agent.read<fetch::oef::pb::Server_Phrase>(header);
+    REQUIRE(header.stream == stream);
+    if(!phrase.has_phrase()) {
+      return false;
+    }
+    fetch::oef::pb::Agent_Server_Answer answer;
+    answer.set_answer("answer");
+    agent.write(answer, stream);
+    auto connected = agent.read<fetch::oef::pb::Server_Connected>(header);
+    REQUIRE(header.stream == stream);
+    return connected.status();
+  }
+  // Sends a message to nobody from stream: its dialogue error is read once the frames sent
+  // before are processed. Returns the ids of the other dialogue errors read.
+  std::vector<uint32_t> sync(TestAgent &agent, uint32_t stream = 0) {
+    agent.write(fetch::oef::Message{99, 1, "nobody", ""}.handle(), stream);
+    fetch::oef::FrameHeader header;
+    std::vector<uint32_t> errors;
+    for(;;) {
+      auto answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+      if(answer.has_dialogue_error()) {
+        if(answer.answer_id() == 99) {
+          return errors;
+        }
+        errors.push_back(answer.answer_id());
+      }
+    }
+  }
+  // Whether a message from agent to key is answered by a dialogue error.
+  bool unknown(TestAgent &agent, const std::string &key) {
+    agent.write(fetch::oef::Message{10, 11, key, ""}.handle());
+    auto errors = sync(agent);
+    return std::find(errors.begin(), errors.end(), 10) != errors.end();
+  }
+  TEST_CASE("multiplexed connections", "[multiplex]") {
+    using fetch::oef::FrameHeader;
+    fetch::oef::Server server;
+    server.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fetch::oef::pb::Capabilities v2;
+    v2.set_framing(2);
+    TestAgent other{"Other", v2};
+    // multiplexing needs framing v2.
+    fetch::oef::pb::Capabilities v1;
+    v1.set_multiplex(true);
+    TestAgent single{"Single", v1};
+    REQUIRE(!single.connected.capabilities().multiplex());
+    TestAgent agent{"Agent", multiplexed()};
+    REQUIRE(agent.connected.capabilities().multiplex());
+
+    // agents connected on streams, not twice.
+    REQUIRE(connectStream(agent, "Agent3", 3));
+    REQUIRE(connectStream(agent, "Agent4", 4));
+    REQUIRE(!connectStream(agent, "Other", 5));
+    REQUIRE(!connectStream(agent, "Agent3", 5));
+
+    // relayed messages and answers are tagged with the stream of their agent.
+    FrameHeader header;
+    other.write(fetch::oef::Message{1, 2, "Agent3", "to 3"}.handle());
+    auto received = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(header.stream == 3);
+    REQUIRE(received.content().origin() == "Other");
+    REQUIRE(received.content().content() == "to 3");
+    agent.write(fetch::oef::Message{2, 3, "Other", "from 4"}.handle(), 4);
+    received = other.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(received.content().origin() == "Agent4");
+    agent.write(fetch::oef::Message{3, 4, "Agent3", "from 4 to 3"}.handle(), 4);
+    received = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(header.stream == 3);
+    REQUIRE(received.content().origin() == "Agent4");
+    agent.write(fetch::oef::Message{4, 5, "nobody", ""}.handle(), 4);
+    received = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(header.stream == 4);
+    REQUIRE(received.has_dialogue_error());
+    REQUIRE(received.answer_id() == 4);
+    agent.write(fetch::oef::Message{5, 6, "Other", "from 0"}.handle());
+    received = other.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(received.content().origin() == "Agent");
+
+    // chunked messages are not relayed to a multiplexed agent.
+    std::string content(1000, 'c');
+    FrameHeader stream;
+    stream.setStream(7);
+    fetch::oef::ChunkedMessage chunked{6, 7, "Agent3", content.size(), stream};
+    other.write(chunked.head());
+    other.write(chunked.chunk(reinterpret_cast<const uint8_t*>(content.data()), content.size()));
+    received = other.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(header.stream == 7);
+    REQUIRE(received.has_dialogue_error());
+    REQUIRE(received.answer_id() == 6);
+
+    // an empty frame disconnects the agent of its stream, which can be reused.
+    FrameHeader empty;
+    empty.setStream(3);
+    auto disconnect = fetch::oef::BufferPool::instance().acquire(empty.size(fetch::oef::Framing::V2));
+    empty.write(fetch::oef::Framing::V2, disconnect->data());
+    agent.write(disconnect);
+    sync(agent);
+    REQUIRE(unknown(other, "Agent3"));
+    REQUIRE(connectStream(agent, "Agent3bis", 3));
+    other.write(fetch::oef::Message{8, 9, "Agent3bis", "again"}.handle());
+    received = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(header.stream == 3);
+    REQUIRE(received.content().content() == "again");
+
+    // the handshakes in progress on a connection are limited.
+    fetch::oef::pb::Agent_Server_ID id;
+    uint32_t refused = 0;
+    for(uint32_t i = 0; i < 100; ++i) {
+      id.set_public_key("Pending" + std::to_string(i));
+      agent.write(id, 100 + i);
+      if(!agent.read<fetch::oef::pb::Server_Phrase>(header).has_phrase()) {
+        ++refused;
+      }
+    }
+    REQUIRE(refused > 0);
+    REQUIRE(refused < 100);
+
+    // all the agents are disconnected with their connection.
+    agent.socket.close();
+    for(auto key : {"Agent", "Agent3bis", "Agent4"}) {
+      bool disconnected = false;
+      for(int i = 0; i < 100 && !disconnected; ++i) {
+        disconnected = unknown(other, key);
+        if(!disconnected) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      }
+      REQUIRE(disconnected);
+    }
+  }
+  TEST_CASE("aborted chunked relays", "[relay]") {
+    using fetch::oef::FrameHeader;
+    fetch::oef::Server server;
+    server.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fetch::oef::pb::Capabilities v2;
+    v2.set_framing(2);
+    TestAgent destination{"Destination", v2};
+    std::string content(1000, 'c');
+    const auto *data = reinterpret_cast<const uint8_t*>(content.data());
+    FrameHeader stream;
+    stream.setStream(5);
+    // the head and chunks relayed so far, then the abort of their stream.
+    auto aborted = [&destination](size_t chunks) {
+      FrameHeader header;
+      auto head = destination.read(header);
+      REQUIRE((header.flags & FrameHeader::More) != 0);
+      uint32_t relayed = header.stream;
+      for(size_t i = 0; i < chunks; ++i) {
+        destination.read(header);
+        REQUIRE(header.stream == relayed);
+        REQUIRE((header.flags & FrameHeader::More) != 0);
+      }
+      REQUIRE(destination.read(header).empty());
+      REQUIRE(header.stream == relayed);
+      REQUIRE((header.flags & FrameHeader::Abort) != 0);
+      REQUIRE((header.flags & FrameHeader::More) == 0);
+    };
+
+    // aborted by the sender.
+    {
+      TestAgent sender{"Sender", v2};
+      fetch::oef::ChunkedMessage chunked{1, 2, "Destination", content.size(), stream};
+      sender.write(chunked.head());
+      sender.write(chunked.chunk(data, 100));
+      auto abort = chunked.abort();
+      FrameHeader header;
+      size_t size;
+      REQUIRE(FrameHeader::parse(abort->data(), abort->size(), header, size) == FrameHeader::Parsed::Complete);
+      REQUIRE(header.length == 0);
+      REQUIRE(size == abort->size());
+      sender.write(abort);
+      aborted(1);
+      // the stream can be used again.
+      sync(sender, 5);
+    }
+    // the sender disconnects.
+    {
+      TestAgent sender{"Sender2", v2};
+      fetch::oef::ChunkedMessage chunked{1, 2, "Destination", content.size(), stream};
+      sender.write(chunked.head());
+      sender.write(chunked.chunk(data, 100));
+      sender.write(chunked.chunk(data, 100));
+      sync(sender);
+      sender.socket.close();
+      aborted(2);
+    }
+    // a chunk over the content size closes the sender.
+    {
+      TestAgent sender{"Sender3", v2};
+      fetch::oef::ChunkedMessage chunked{1, 2, "Destination", content.size(), stream};
+      sender.write(chunked.head());
+      FrameHeader over = stream;
+      over.flags |= FrameHeader::More;
+      over.length = uint32_t(content.size() + 1);
+      auto chunk = fetch::oef::BufferPool::instance().acquire(over.size(fetch::oef::Framing::V2) + over.length);
+      std::memset(over.write(fetch::oef::Framing::V2, chunk->data()), 'c', over.length);
+      sender.write(chunk);
+      aborted(0);
+      std::error_code ec;
+      uint8_t byte;
+      asio::read(sender.socket, asio::buffer(&byte, 1), ec);
+      REQUIRE(ec);
+    }
+  }
+  TEST_CASE("subscription errors", "[subscribe]") {
+    fetch::oef::Server server;
+    server.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    TestAgent agent{"Subscriber"};
+    fetch::oef::DataModel car{"car", {fetch::oef::Attribute{"price", fetch::oef::Type::Int, true}}};
+    fetch::oef::QueryModel query{{fetch::oef::Constraint{"price", fetch::oef::Relation{fetch::oef::Relation::Op::Lt, 10}}}, car};
+    fetch::oef::FrameHeader header;
+    // subscribing twice with the same id: the initial state, then the error.
+    agent.write(fetch::oef::SubscribeServices{5, query}.handle());
+    agent.write(fetch::oef::SubscribeServices{5, query}.handle());
+    auto answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 5);
+    REQUIRE(answer.has_search_update());
+    answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 5);
+    REQUIRE(answer.has_oef_error());
+    REQUIRE(answer.oef_error().operation() == fetch::oef::pb::Server_AgentMessage_OEFError::SUBSCRIBE_SERVICES);
+    // unsubscribing an unknown subscription, or one already removed.
+    agent.write(fetch::oef::UnsubscribeServices{6, 42}.handle());
+    answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 6);
+    REQUIRE(answer.has_oef_error());
+    REQUIRE(answer.oef_error().operation() == fetch::oef::pb::Server_AgentMessage_OEFError::UNSUBSCRIBE_SERVICES);
+    agent.write(fetch::oef::UnsubscribeServices{7, 5}.handle());
+    agent.write(fetch::oef::UnsubscribeServices{8, 5}.handle());
+    answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 8);
+    REQUIRE(answer.oef_error().operation() == fetch::oef::pb::Server_AgentMessage_OEFError::UNSUBSCRIBE_SERVICES);
+  }
+  TEST_CASE("streamed searches", "[search]") {
+    fetch::oef::Server server;
+    server.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fetch::oef::DataModel car{"car", {fetch::oef::Attribute{"price", fetch::oef::Type::Int, true}}};
+    fetch::oef::QueryModel query{{fetch::oef::Constraint{"price", fetch::oef::Relation{fetch::oef::Relation::Op::Lt, 10}}}, car};
+    std::vector<std::unique_ptr<TestAgent>> providers;
+    for(int i = 0; i < 10; ++i) {
+      providers.emplace_back(std::make_unique<TestAgent>("Provider" + std::to_string(i)));
+      fetch::oef::Instance instance{car, {{"price", fetch::oef::VariantType{i}}}};
+      providers.back()->write(fetch::oef::Register{1, instance}.handle());
+      providers.back()->write(fetch::oef::Description{2, instance}.handle());
+      sync(*providers.back());
+    }
+    TestAgent searcher{"Searcher"};
+    // the chunks read until the last one, which has more unset.
+    auto chunks = [&searcher](uint32_t msg_id, std::set<std::string> &agents) {
+      fetch::oef::FrameHeader header;
+      size_t nb = 0;
+      for(;;) {
+        auto answer = searcher.read<fetch::oef::pb::Server_AgentMessage>(header);
+        REQUIRE(answer.answer_id() == msg_id);
+        ++nb;
+        for(auto &a : answer.agents().agents()) {
+          REQUIRE(agents.insert(a).second);
+        }
+        if(!answer.agents().more()) {
+          return nb;
+        }
+      }
+    };
+    // more chunks than written at once, then an empty last one.
+    std::set<std::string> agents;
+    searcher.write(fetch::oef::SearchServices{3, query, 0, 2}.handle());
+    REQUIRE(chunks(3, agents) == 6);
+    REQUIRE(agents.size() == 10);
+    agents.clear();
+    searcher.write(fetch::oef::SearchAgents{4, query, 5, 2}.handle());
+    REQUIRE(chunks(4, agents) == 3);
+    REQUIRE(agents.size() == 5);
+    // both searches streamed at the same time.
+    searcher.write(fetch::oef::SearchServices{5, query, 0, 1}.handle());
+    searcher.write(fetch::oef::SearchAgents{6, query, 0, 1}.handle());
+    std::map<uint32_t,std::set<std::string>> streamed;
+    fetch::oef::FrameHeader header;
+    size_t done = 0;
+    while(done < 2) {
+      auto answer = searcher.read<fetch::oef::pb::Server_AgentMessage>(header);
+      for(auto &a : answer.agents().agents()) {
+        REQUIRE(streamed[answer.answer_id()].insert(a).second);
+      }
+      done += !answer.agents().more();
+    }
+    REQUIRE(streamed[5].size() == 10);
+    REQUIRE(streamed[6].size() == 10);
+  }
+  TEST_CASE("paged searches", "[search]") {
+    fetch::oef::Server server;
+    server.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fetch::oef::DataModel car{"car", {fetch::oef::Attribute{"price", fetch::oef::Type::Int, true}}};
+    fetch::oef::QueryModel query{{fetch::oef::Constraint{"price", fetch::oef::Relation{fetch::oef::Relation::Op::Lt, 10}}}, car};
+    std::vector<std::unique_ptr<TestAgent>> providers;
+    auto provide = [&providers,&car](int i) {
+      providers.emplace_back(std::make_unique<TestAgent>("Provider" + std::to_string(i)));
+      fetch::oef::Instance instance{car, {{"price", fetch::oef::VariantType{i}}}};
+      providers.back()->write(fetch::oef::Register{1, instance}.handle());
+      providers.back()->write(fetch::oef::Description{2, instance}.handle());
+      sync(*providers.back());
+    };
+    for(int i = 0; i < 5; ++i) {
+      provide(i);
+    }
+    TestAgent searcher{"Searcher"};
+    fetch::oef::FrameHeader header;
+    for(bool services : {true, false}) {
+      if(services) {
+        searcher.write(fetch::oef::SearchServices{3, query, 2}.handle());
+      } else {
+        searcher.write(fetch::oef::SearchAgents{3, query, 2}.handle());
+      }
+      auto answer = searcher.read<fetch::oef::pb::Server_AgentMessage>(header);
+      REQUIRE(answer.agents().agents_size() == 2);
+      REQUIRE(answer.agents().has_cursor());
+      std::set<std::string> agents(answer.agents().agents().begin(), answer.agents().agents().end());
+      // the pages are searched when asked for: an agent registered since is part of them.
+      provide(int(providers.size()));
+      uint64_t cursor = answer.agents().cursor();
+      while(answer.agents().has_cursor()) {
+        searcher.write(fetch::oef::SearchNext{4, cursor, 2}.handle());
+        answer = searcher.read<fetch::oef::pb::Server_AgentMessage>(header);
+        REQUIRE(answer.answer_id() == 4);
+        REQUIRE(answer.agents().agents_size() <= 2);
+        for(auto &a : answer.agents().agents()) {
+          REQUIRE(agents.insert(a).second);
+        }
+      }
+      REQUIRE(agents.size() == providers.size());
+    }
+  }
+  TEST_CASE("search changes options", "[search]") {
+    fetch::oef::Server server;
+    server.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fetch::oef::DataModel car{"car", {fetch::oef::Attribute{"price", fetch::oef::Type::Int, true}}};
+    fetch::oef::QueryModel query{{fetch::oef::Constraint{"price", fetch::oef::Relation{fetch::oef::Relation::Op::Lt, 10}}}, car};
+    TestAgent agent{"Searcher"};
+    fetch::oef::FrameHeader header;
+    agent.write(fetch::oef::SearchServices{1, query}.handle());
+    auto answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.agents().has_generation());
+    uint64_t generation = answer.agents().generation();
+    agent.write(fetch::oef::SearchServicesChanges{2, query, generation}.handle());
+    answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 2);
+    REQUIRE(answer.agents().delta());
+    // the changes are neither limited nor streamed.
+    fetch::oef::pb::Envelope limited{fetch::oef::SearchServicesChanges{3, query, generation}.handle()};
+    limited.mutable_search_services()->set_limit(1);
+    agent.write(limited);
+    answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 3);
+    REQUIRE(answer.oef_error().operation() == fetch::oef::pb::Server_AgentMessage_OEFError::SEARCH_SERVICES);
+    fetch::oef::pb::Envelope streamed{fetch::oef::SearchServicesChanges{4, query, generation}.handle()};
+    streamed.mutable_search_services()->set_chunk_size(1);
+    agent.write(streamed);
+    answer = agent.read<fetch::oef::pb::Server_AgentMessage>(header);
+    REQUIRE(answer.answer_id() == 4);
+    REQUIRE(answer.oef_error().operation() == fetch::oef::pb::Server_AgentMessage_OEFError::SEARCH_SERVICES);
+  }
 }
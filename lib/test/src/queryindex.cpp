@@ -0,0 +1,144 @@
+//------------------------------------------------------------------------------
+//
+//   Copyright 2018 Fetch.AI Limited
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+//
+//------------------------------------------------------------------------------
+
+#include "catch.hpp"
+#include "queryindex.hpp"
+#include <algorithm>
+
+using namespace fetch::oef;
+
+namespace Test {
+
+  TEST_CASE("query index", "[queryindex]") {
+    DataModel car{"car", {Attribute{"manufacturer", Type::String, true},
+                          Attribute{"price", Type::Int, true},
+                          Attribute{"consumption", Type::Double, false},
+                          Attribute{"luxury", Type::Bool, true}}};
+    DataModel boat{"boat", {Attribute{"manufacturer", Type::String, true}}};
+    std::vector<QueryModel> queries{
+      QueryModel{{Constraint{"manufacturer", Relation{Relation::Op::Eq, "Tesla"}}}},
+      QueryModel{{Constraint{"manufacturer", Relation{Relation::Op::Eq, "Tesla"}}}, car},
+      QueryModel{{Constraint{"manufacturer", Set{Set::Op::In, std::unordered_set<std::string>{"Tesla", "Renault"}}},
+                  Constraint{"price", Range{std::make_pair(10000, 50000)}}}},
+      QueryModel{{Constraint{"price", Relation{Relation::Op::Lt, 20000}}}},
+      QueryModel{{Constraint{"luxury", Relation{Relation::Op::Eq, true}} && Constraint{"consumption", Range{std::make_pair(0.0, 5.0)}}}},
+      QueryModel{{Constraint{"luxury", Relation{Relation::Op::Eq, false}} || Constraint{"price", Range{std::make_pair(0, 1000)}}}},
+      QueryModel{{!Constraint{"manufacturer", Relation{Relation::Op::Eq, "Tesla"}}}},
+      QueryModel{{Constraint{"manufacturer", Set{Set::Op::NotIn, std::unordered_set<std::string>{"Tesla"}}}}},
+      QueryModel{{Constraint{"colour", Relation{Relation::Op::Eq, "red"}}}}};
+    std::vector<Instance> instances{
+      Instance{car, {{"manufacturer", VariantType{std::string{"Tesla"}}}, {"price", VariantType{45000}},
+                     {"consumption", VariantType{0.0}}, {"luxury", VariantType{true}}}},
+      Instance{car, {{"manufacturer", VariantType{std::string{"Renault"}}}, {"price", VariantType{15000}},
+                     {"luxury", VariantType{false}}}},
+      Instance{car, {{"manufacturer", VariantType{std::string{"Tata"}}}, {"price", VariantType{500}},
+                     {"consumption", VariantType{7.5}}, {"luxury", VariantType{false}}}},
+      Instance{boat, {{"manufacturer", VariantType{std::string{"Tesla"}}}}}};
+
+    QueryIndex index;
+    for(size_t i = 0; i < queries.size(); ++i) {
+      REQUIRE(index.add(i, queries[i]));
+    }
+    REQUIRE(!index.add(0, queries[0]));
+    REQUIRE(index.size() == queries.size());
+    auto check = [&]() {
+      auto batch = index.match(instances);
+      for(size_t j = 0; j < instances.size(); ++j) {
+        std::vector<QueryIndex::Id> expected;
+        for(size_t i = 0; i < queries.size(); ++i) {
+          if(index.get(i) && queries[i].check(instances[j])) {
+            expected.emplace_back(i);
+          }
+        }
+        auto res = index.match(instances[j]);
+        std::sort(res.begin(), res.end());
+        std::sort(batch[j].begin(), batch[j].end());
+        REQUIRE(res == expected);
+        REQUIRE(batch[j] == expected);
+      }
+    };
+    check();
+    REQUIRE(index.remove(2));
+    REQUIRE(index.remove(4));
+    REQUIRE(!index.remove(4));
+    check();
+    REQUIRE(index.add(42, queries[4]));
+    REQUIRE(index.match(instances[0]).size() == 3);
+  }
+  TEST_CASE("query index ranges", "[queryindex]") {
+    // many ranges, some sharing their lower bound, added and removed in any order.
+    DataModel car{"car", {Attribute{"price", Type::Int, true}, Attribute{"consumption", Type::Double, true}}};
+    std::vector<QueryModel> queries;
+    for(int i = 0; i < 500; ++i) {
+      int lo = (i * 7919) % 200;
+      queries.emplace_back(QueryModel{{Constraint{"price", Range{std::make_pair(lo, lo + i % 50)}},
+                                       Constraint{"consumption", Range{std::make_pair(double(lo % 20), double(lo % 20) + 2.5)}}}, car});
+    }
+    std::vector<Instance> instances;
+    for(int i = 0; i < 50; ++i) {
+      instances.emplace_back(Instance{car, {{"price", VariantType{i * 5}}, {"consumption", VariantType{double(i % 25)}}}});
+    }
+    QueryIndex index;
+    auto check = [&]() {
+      for(auto &instance : instances) {
+        std::vector<QueryIndex::Id> expected;
+        for(size_t i = 0; i < queries.size(); ++i) {
+          if(index.get(i) && queries[i].check(instance)) {
+            expected.emplace_back(i);
+          }
+        }
+        auto res = index.match(instance);
+        std::sort(res.begin(), res.end());
+        REQUIRE(res == expected);
+      }
+    };
+    for(size_t i = 0; i < queries.size(); ++i) {
+      size_t id = (i * 263) % queries.size();
+      REQUIRE(index.add(id, queries[id]));
+    }
+    check();
+    for(size_t i = 0; i < queries.size(); i += 3) {
+      REQUIRE(index.remove((i * 101) % queries.size()));
+    }
+    check();
+    for(size_t i = 0; i < queries.size(); ++i) {
+      index.remove(i);
+    }
+    REQUIRE(index.empty());
+    check();
+    REQUIRE(index.add(7, queries[7]));
+    check();
+  }
+  TEST_CASE("query index growing", "[queryindex]") {
+    // matches between additions and removals reuse the counters of the index.
+    DataModel car{"car", {Attribute{"price", Type::Int, true}}};
+    Instance instance{car, {{"price", VariantType{10}}}};
+    QueryIndex index;
+    for(QueryIndex::Id id = 0; id < 100; ++id) {
+      REQUIRE(index.add(id, QueryModel{{Constraint{"price", Relation{Relation::Op::Lt, int(id)}}}, car}));
+      REQUIRE(index.match(instance).size() == (id > 10 ? id - 10 : 0));
+      REQUIRE(index.match(std::vector<const Instance *>{&instance, &instance})[1].size() == (id > 10 ? id - 10 : 0));
+    }
+    for(QueryIndex::Id id = 99; id > 50; --id) {
+      REQUIRE(index.remove(id));
+    }
+    REQUIRE(index.match(instance).size() == 40);
+    REQUIRE(index.add(200, QueryModel{{Constraint{"price", Relation{Relation::Op::Eq, 10}}}, car}));
+    REQUIRE(index.match(instance).size() == 41);
+  }
+}
@@ -19,7 +19,13 @@
 #define CATCH_CONFIG_MAIN // This tells Catch to provide a main() - only do this in one cpp file
 #include "catch.hpp"
 #include "schema.hpp"
+#include <atomic>
+#include <cmath>
+#include <functional>
 #include <iostream>
+#include <set>
+#include <thread>
+#include <unordered_set>
 #include "servicedirectory.hpp"
 #include <google/protobuf/text_format.h>
 #include "common.hpp"
@@ -96,6 +102,616 @@ namespace Test {
     REQUIRE(sd.size() == 0);
     REQUIRE(!sd.unregisterAgent(instance1, "Agent2"));
   }
+  TEST_CASE("servicedirectory subscriptions", "[sd]") {
+    ServiceDirectory sd;
+    Attribute price{"price", Type::Int, true};
+    DataModel dm{"offer", {price}};
+    Instance cheap{dm, {{"price", VariantType{5}}}};
+    Instance cheap2{dm, {{"price", VariantType{8}}}};
+    Instance expensive{dm, {{"price", VariantType{50}}}};
+    REQUIRE(sd.registerAgent(cheap, "Agent1"));
+    std::vector<std::string> added, removed;
+    size_t nb_notifications = 0;
+    auto id = sd.subscribe(QueryModel{{Constraint{"price", Relation{Relation::Op::Lt, 10}}}, dm},
+                           [&](const std::vector<std::string> &a, const std::vector<std::string> &r) {
+                             ++nb_notifications;
+                             added = a;
+                             removed = r;
+                           });
+    REQUIRE(sd.nbSubscriptions() == 1);
+    REQUIRE(nb_notifications == 1);
+    REQUIRE(added == std::vector<std::string>{"Agent1"});
+    REQUIRE(sd.registerAgent(expensive, "Agent2"));
+    REQUIRE(nb_notifications == 1);
+    REQUIRE(sd.registerAgent(cheap, "Agent2"));
+    REQUIRE(nb_notifications == 2);
+    REQUIRE(added == std::vector<std::string>{"Agent2"});
+    // Agent2 still matches through cheap2.
+    REQUIRE(sd.registerAgent(cheap2, "Agent2"));
+    REQUIRE(sd.unregisterAgent(cheap, "Agent2"));
+    REQUIRE(nb_notifications == 2);
+    sd.unregisterAll("Agent2");
+    REQUIRE(nb_notifications == 3);
+    REQUIRE(added.empty());
+    REQUIRE(removed == std::vector<std::string>{"Agent2"});
+    REQUIRE(sd.unsubscribe(id));
+    REQUIRE(!sd.unsubscribe(id));
+    REQUIRE(sd.unregisterAgent(cheap, "Agent1"));
+    REQUIRE(nb_notifications == 3);
+  }
+  TEST_CASE("instance hash", "[schema]") {
+    DataModel dm{"weather", {Attribute{"a", Type::Int, true}, Attribute{"b", Type::Int, true},
+                             Attribute{"t", Type::Double, false}, Attribute{"s", Type::String, false}}};
+    Instance ab{dm, {{"a", VariantType{1}}, {"b", VariantType{2}}}};
+    // same values inserted in another order.
+    fetch::oef::pb::Query_Instance reversed{ab.handle()};
+    std::reverse(reversed.mutable_values()->begin(), reversed.mutable_values()->end());
+    Instance ba{reversed};
+    REQUIRE(ab == ba);
+    REQUIRE(ab.hash() == ba.hash());
+    // swapped values, zero signs.
+    Instance swapped{dm, {{"a", VariantType{2}}, {"b", VariantType{1}}}};
+    REQUIRE(!(ab == swapped));
+    REQUIRE(ab.hash() != swapped.hash());
+    Instance zero{dm, {{"a", VariantType{1}}, {"b", VariantType{2}}, {"t", VariantType{0.0}}}};
+    Instance minus_zero{dm, {{"a", VariantType{1}}, {"b", VariantType{2}}, {"t", VariantType{-0.0}}}};
+    REQUIRE(zero == minus_zero);
+    REQUIRE(zero.hash() == minus_zero.hash());
+    // extra values are not equal, either way.
+    REQUIRE(!(ab == zero));
+    REQUIRE(!(zero == ab));
+    std::unordered_set<size_t> hashes;
+    for(int a = 0; a < 100; ++a) {
+      for(int b = 0; b < 100; ++b) {
+        hashes.insert(Instance{dm, {{"a", VariantType{a}}, {"b", VariantType{b}}}}.hash());
+      }
+    }
+    REQUIRE(hashes.size() == 10000);
+  }
+  TEST_CASE("data models", "[schema]") {
+    std::vector<Attribute> attributes{Attribute{"price", Type::Int, true}};
+    DataModel car{"car", attributes};
+    DataModel car2{"car", attributes};
+    DataModel described{"car", attributes, "with a description"};
+    REQUIRE(car.id() == car2.id());
+    REQUIRE(&car.handle() == &car2.handle());
+    REQUIRE(car.id() != described.id());
+    REQUIRE(!(car == described));
+    // instances received from the network share the interned model.
+    Instance i{car, {{"price", VariantType{10}}}};
+    Instance j{i.handle()};
+    REQUIRE(j.modelId() == car.id());
+    REQUIRE(&j.model() == &car.handle());
+    REQUIRE(i == j);
+    REQUIRE(j.handle().model().name() == "car");
+    // same name and values but another model.
+    Instance k{described, {{"price", VariantType{10}}}};
+    REQUIRE(!(i == k));
+    Constraint cheap{"price", Relation{Relation::Op::Lt, 100}};
+    QueryModel q{{cheap}, car};
+    REQUIRE(q.check(i));
+    REQUIRE(q.check(j));
+    REQUIRE(!q.check(k));
+    REQUIRE(QueryModel{q.handle()}.check(j));
+    REQUIRE(QueryModel{{cheap}}.check(k));
+  }
+  TEST_CASE("instance hash zero signs", "[schema]") {
+    DataModel dm{"station", {Attribute{"location", Type::Location, true}, Attribute{"temperature", Type::Double, true}}};
+    Instance zero{dm, {{"location", VariantType{Location{0.0, 0.0}}}, {"temperature", VariantType{0.0}}}};
+    Instance minus_zero{dm, {{"location", VariantType{Location{-0.0, -0.0}}}, {"temperature", VariantType{-0.0}}}};
+    REQUIRE(zero == minus_zero);
+    REQUIRE(zero.hash() == minus_zero.hash());
+    // received from the network.
+    fetch::oef::pb::Query_Instance received{zero.handle()};
+    for(auto &kv : *received.mutable_values()) {
+      if(kv.value().has_l()) {
+        kv.mutable_value()->mutable_l()->set_lon(-0.0);
+      } else {
+        kv.mutable_value()->set_d(-0.0);
+      }
+    }
+    Instance j{received};
+    REQUIRE(std::signbit(j.find("temperature")->get<double>()));
+    REQUIRE(j == zero);
+    REQUIRE(j.hash() == zero.hash());
+  }
+  TEST_CASE("instance hash collisions", "[schema]") {
+    DataModel car{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"model", Type::String, true},
+                          Attribute{"price", Type::Int, true}, Attribute{"year", Type::Int, true},
+                          Attribute{"luxury", Type::Bool, true}}};
+    std::unordered_set<size_t> hashes;
+    std::unordered_set<size_t> buckets; // lowest 17 bits
+    const int nb_instances = 100000;
+    for(int i = 0; i < nb_instances; ++i) {
+      Instance instance{car, {{"manufacturer", VariantType{"manufacturer" + std::to_string(i % 100)}},
+                              {"model", VariantType{"model" + std::to_string((i / 100) % 100)}},
+                              {"price", VariantType{1000 + (i / 10000) * 500}},
+                              {"year", VariantType{1990 + i % 30}},
+                              {"luxury", VariantType{i % 7 == 0}}}};
+      hashes.insert(instance.hash());
+      buckets.insert(instance.hash() & ((size_t(1) << 17) - 1));
+    }
+    REQUIRE(hashes.size() == size_t(nb_instances));
+    // random hashes leave about 30000 collisions on 17 bits.
+    REQUIRE(nb_instances - buckets.size() < 31000);
+  }
+  TEST_CASE("servicedirectory updated instance hash", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"name", Type::String, true}, Attribute{"price", Type::Int, true},
+                           Attribute{"stock", Type::Int, false}}};
+    Instance offer{dm, {{"name", VariantType{std::string{"apple"}}}, {"price", VariantType{5}}}};
+    auto handle = sd.registerAgent(offer, "Agent1");
+    fetch::oef::pb::ServiceUpdate update;
+    auto *price = update.add_values();
+    price->set_key("price");
+    price->mutable_value()->set_i(50);
+    auto *stock = update.add_values();
+    stock->set_key("stock");
+    stock->mutable_value()->set_i(3);
+    REQUIRE(sd.update(handle, "Agent1", update.values()));
+    // the updated instance hashes as the one built with the same values.
+    Instance expected{dm, {{"name", VariantType{std::string{"apple"}}}, {"price", VariantType{50}}, {"stock", VariantType{3}}}};
+    REQUIRE(sd.unregisterAgent(expected, "Agent1"));
+    REQUIRE(!sd.unregisterAgent(handle, "Agent1"));
+    REQUIRE(!sd.update(handle, "Agent1", update.values()));
+    handle = sd.registerAgent(expected, "Agent1");
+    REQUIRE(sd.unregisterAgent(handle, "Agent1"));
+    REQUIRE(!sd.unregisterAgent(handle, "Agent1"));
+    REQUIRE(sd.size() == 0);
+  }
+  TEST_CASE("data models interned by thread", "[schema]") {
+    DataModel bus{"bus", {Attribute{"seats", Type::Int, true}}};
+    Instance i{bus, {{"seats", VariantType{40}}}};
+    fetch::oef::pb::Query_Instance received{i.handle()};
+    // the model of the thread cache is the registered one, from any thread.
+    REQUIRE(Instance{received}.modelId() == bus.id());
+    REQUIRE(Instance{received}.modelId() == bus.id());
+    uint32_t other_thread = 0;
+    std::thread t{[&received, &other_thread]() { other_thread = Instance{received}.modelId(); }};
+    t.join();
+    REQUIRE(other_thread == bus.id());
+    // the cache does not keep a model alive.
+    fetch::oef::pb::Query_DataModel tram{bus.handle()};
+    tram.set_name("tram");
+    std::weak_ptr<const DataModels::Entry> released = DataModels::intern(tram);
+    REQUIRE(released.expired());
+    DataModel kept{tram};
+    REQUIRE(kept.id() != bus.id());
+    REQUIRE(DataModel{tram}.id() == kept.id());
+  }
+  TEST_CASE("instance values", "[schema]") {
+    DataModel dm{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"price", Type::Int, true},
+                         Attribute{"colour", Type::String, false}, Attribute{"luxury", Type::Bool, false}}};
+    Instance full{dm, {{"manufacturer", VariantType{std::string{"Tesla"}}}, {"price", VariantType{100}},
+                       {"colour", VariantType{std::string{"red"}}}, {"luxury", VariantType{true}}}};
+    // every slot set: found by index.
+    REQUIRE(full.valid());
+    REQUIRE(full.find(0u)->get<std::string>() == "Tesla");
+    REQUIRE(full.find(3u)->get<bool>());
+    REQUIRE(!full.find(4u));
+    // slot 2 not set: the following ones are found by a binary search.
+    Instance sparse{dm, {{"manufacturer", VariantType{std::string{"Tesla"}}}, {"price", VariantType{100}},
+                         {"luxury", VariantType{false}}}};
+    REQUIRE(sparse.valid());
+    REQUIRE(!sparse.find(2u));
+    REQUIRE(!sparse.find(3u)->get<bool>());
+    REQUIRE(sparse.find("price")->get<int>() == 100);
+    REQUIRE(!sparse.find("colour"));
+    REQUIRE(!sparse.find("engine"));
+    // received from the network: unknown attributes, values not set and duplicate keys are
+    // dropped, and the instance is not valid.
+    auto received = [&full](const std::function<void(fetch::oef::pb::Query_Instance &)> &f) {
+      fetch::oef::pb::Query_Instance instance{full.handle()};
+      f(instance);
+      return Instance{instance};
+    };
+    REQUIRE(received([](fetch::oef::pb::Query_Instance &) {}).valid());
+    Instance unknown = received([](fetch::oef::pb::Query_Instance &i) {
+        auto *kv = i.add_values();
+        kv->set_key("engine");
+        kv->mutable_value()->set_s("electric");
+      });
+    REQUIRE(!unknown.valid());
+    REQUIRE(!unknown.find("engine"));
+    Instance unset = received([](fetch::oef::pb::Query_Instance &i) { i.mutable_values(2)->clear_value(); });
+    REQUIRE(!unset.valid());
+    REQUIRE(!unset.find("colour"));
+    Instance duplicate = received([](fetch::oef::pb::Query_Instance &i) {
+        auto *kv = i.add_values();
+        kv->set_key("price");
+        kv->mutable_value()->set_i(200);
+      });
+    REQUIRE(!duplicate.valid());
+    REQUIRE(duplicate.find("price")->get<int>() == 200); // the last value is kept
+    Instance wrong_type = received([](fetch::oef::pb::Query_Instance &i) { i.mutable_values(1)->mutable_value()->set_s("100"); });
+    REQUIRE(!wrong_type.valid());
+    Instance missing = received([](fetch::oef::pb::Query_Instance &i) { i.mutable_values()->RemoveLast(); i.mutable_values()->RemoveLast(); i.mutable_values()->RemoveLast(); });
+    REQUIRE(!missing.valid());
+    // the protobuf form is built once, and again by a copy.
+    const auto &handle = full.handle();
+    REQUIRE(&full.handle() == &handle);
+    REQUIRE(handle.values_size() == 4);
+    Instance copy{full};
+    REQUIRE(&copy.handle() != &handle);
+    REQUIRE(copy.handle().SerializeAsString() == handle.SerializeAsString());
+    Instance moved{std::move(copy)};
+    REQUIRE(moved == full);
+    REQUIRE(moved.handle().values_size() == 4);
+  }
+  TEST_CASE("schema directory", "[schema]") {
+    std::vector<Attribute> attributes{Attribute{"price", Type::Int, true}, Attribute{"luxury", Type::Bool, false}};
+    DataModel car{"car", attributes, "cars for sale"};
+    DataModel car2{"car", attributes, "cars to rent"};
+    SchemaDirectory schemas;
+    REQUIRE(schemas.registerSchema(car) == 1);
+    REQUIRE(schemas.registerSchema(DataModel{car.handle()}) == 1);
+    REQUIRE(schemas.registerSchema(car2) == 2);
+    REQUIRE(schemas.size() == 2);
+    REQUIRE(schemas.get("car")->schema() == car2);
+    REQUIRE(schemas.get("car", 1)->schema() == car);
+    REQUIRE(schemas.find(car.id())->version() == 1);
+    REQUIRE(!schemas.find(car.id() + car2.id()));
+    // versions out of order, looked up by the first version at least the requested one.
+    DataModel bike{"bike", attributes};
+    REQUIRE(schemas.add("bike", bike, 5) == 5);
+    REQUIRE(schemas.add("bike", car, 2) == 2);
+    REQUIRE(schemas.add("bike", car2) == 6);
+    REQUIRE(schemas.get("bike", 1)->version() == 2);
+    REQUIRE(schemas.get("bike", 3)->schema() == bike);
+    REQUIRE(schemas.get("bike", 9)->version() == 6);
+    REQUIRE(schemas.get("bike")->version() == 6);
+    REQUIRE(!schemas.get("boat"));
+    auto before = schemas.get("car", 1);
+    REQUIRE(schemas.add("car", bike) == 3);
+    REQUIRE(before->schema() == car);
+    // the values only, resolved with the schema.
+    Instance i{car, {{"price", VariantType{100}}}};
+    auto values = i.handle(car.id());
+    REQUIRE(!values.has_model());
+    REQUIRE(values.ByteSizeLong() < i.handle().ByteSizeLong());
+    Instance j{schemas.find(values.schema_id())->schema(), values};
+    REQUIRE(i == j);
+    REQUIRE(j.valid());
+    REQUIRE(!Instance{values}.valid());
+    Constraint cheap{"price", Relation{Relation::Op::Lt, 1000}};
+    QueryModel q{{cheap}, car, car.id()};
+    REQUIRE(!q.handle().has_model());
+    REQUIRE(q.check(i));
+    REQUIRE(QueryModel{q.handle(), car}.check(j));
+    REQUIRE(!QueryModel{q.handle()}.check(j));
+    fetch::oef::pb::Query_DataModel duplicate{car.handle()};
+    duplicate.add_attributes()->CopyFrom(car.handle().attributes(0));
+    REQUIRE(car.valid());
+    REQUIRE(!DataModel{duplicate}.valid());
+  }
+
+  TEST_CASE("schema directory versions", "[schema]") {
+    std::vector<Attribute> attributes{Attribute{"price", Type::Int, true}};
+    DataModel car{"car", attributes, "cars for sale"};
+    DataModel car2{"car", attributes, "cars to rent"};
+    SchemaDirectory schemas;
+    REQUIRE(schemas.add("car", car, 3) == 3);
+    // an existing version is rejected, the directory is unchanged.
+    REQUIRE(schemas.add("car", car2, 3) == 0);
+    REQUIRE(schemas.get("car", 3)->schema() == car);
+    REQUIRE(!schemas.find(car2.id()));
+    REQUIRE(schemas.size() == 1);
+    REQUIRE(schemas.add("car", car2) == 4);
+    // readers concurrent with writers see either snapshot.
+    std::atomic<bool> done{false};
+    std::atomic<bool> seen{true};
+    std::vector<std::thread> readers;
+    for(int t = 0; t < 4; ++t) {
+      readers.emplace_back([&schemas, &car, &done, &seen]() {
+        while(!done) {
+          auto schema = schemas.get("car", 3);
+          if(!schema || !(schema->schema() == car) || !schemas.find(car.id())) {
+            seen = false;
+            return;
+          }
+        }
+      });
+    }
+    for(uint32_t version = 5; version < 205; ++version) {
+      DataModel model{"model" + std::to_string(version), attributes};
+      REQUIRE(schemas.add("car", model, version) == version);
+      // already registered under car.
+      REQUIRE(schemas.registerSchema(model) == version);
+    }
+    done = true;
+    for(auto &t : readers) {
+      t.join();
+    }
+    REQUIRE(seen);
+    REQUIRE(schemas.size() == 202);
+    REQUIRE(schemas.get("car")->version() == 204);
+    REQUIRE(!schemas.get("model100"));
+  }
+  TEST_CASE("servicedirectory registerMany subscriptions", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"price", Type::Int, true}}};
+    std::vector<std::vector<std::string>> notified;
+    sd.subscribe(QueryModel{{Constraint{"price", Relation{Relation::Op::Lt, 10}}}, dm},
+                 [&](const std::vector<std::string> &a, const std::vector<std::string> &) { notified.emplace_back(a); });
+    REQUIRE(notified.size() == 1); // no match yet
+    std::vector<Instance> instances;
+    for(int price : {5, 50, 8}) {
+      instances.emplace_back(Instance{dm, {{"price", VariantType{price}}}});
+    }
+    // Agent1 is added once, by the first matching instance.
+    REQUIRE(sd.registerMany(instances, "Agent1") == (std::vector<uint64_t>{1, 2, 3}));
+    REQUIRE(notified.size() == 2);
+    REQUIRE(notified.back() == std::vector<std::string>{"Agent1"});
+    REQUIRE(sd.registerMany({instances[1]}, "Agent2") == std::vector<uint64_t>{4});
+    REQUIRE(notified.size() == 2);
+    REQUIRE(sd.registerMany({instances[1], instances[2]}, "Agent2") == (std::vector<uint64_t>{0, 5}));
+    REQUIRE(notified.size() == 3);
+    REQUIRE(notified.back() == std::vector<std::string>{"Agent2"});
+    sd.unregisterAll("Agent1");
+    REQUIRE(notified.size() == 4);
+  }
+  TEST_CASE("servicedirectory registerMany", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"price", Type::Int, true}}};
+    std::vector<Instance> instances;
+    for(int i = 0; i < 5; ++i) {
+      instances.emplace_back(Instance{dm, {{"price", VariantType{i}}}});
+    }
+    instances.emplace_back(instances[0]);
+    // as received from the network: not checked.
+    fetch::oef::pb::Query_Instance wrong_type{instances[0].handle()};
+    wrong_type.mutable_values(0)->mutable_value()->set_s("cheap");
+    REQUIRE(!Instance{wrong_type}.valid());
+    fetch::oef::pb::Query_Instance missing{instances[0].handle()};
+    missing.clear_values();
+    REQUIRE(!Instance{missing}.valid());
+    REQUIRE(Instance{instances[4].handle()}.valid());
+    REQUIRE(Instance{instances[4].handle()}.hash() == instances[4].hash());
+    instances.emplace_back(wrong_type);
+    auto handles = sd.registerMany(instances, "Agent1");
+    REQUIRE(handles == (std::vector<uint64_t>{1, 2, 3, 4, 5, 0, 0}));
+    REQUIRE(!sd.registerAgent(Instance{missing}, "Agent1"));
+    REQUIRE(sd.size() == 5);
+    REQUIRE(sd.generation() == 5);
+    auto res = sd.unregisterMany({instances[1], instances[2]}, "Agent2");
+    REQUIRE(res == (std::vector<bool>{false, false}));
+    res = sd.unregisterMany({instances[1], instances[2]}, "Agent1");
+    REQUIRE(res == (std::vector<bool>{true, true}));
+    REQUIRE(sd.size() == 3);
+    sd.unregisterAll("Agent1");
+    REQUIRE(sd.size() == 0);
+  }
+  TEST_CASE("servicedirectory update", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"name", Type::String, true}, Attribute{"price", Type::Int, true},
+                           Attribute{"stock", Type::Int, false}}};
+    Instance offer{dm, {{"name", VariantType{std::string{"apple"}}}, {"price", VariantType{5}}}};
+    auto handle = sd.registerAgent(offer, "Agent1");
+    REQUIRE(handle > 0);
+    REQUIRE(sd.registerAgent(offer, "Agent2") > 0);
+    QueryModel cheap{{Constraint{"price", Relation{Relation::Op::Lt, 10}}}, dm};
+    size_t nb_notifications = 0;
+    std::vector<std::string> removed;
+    sd.subscribe(cheap, [&](const std::vector<std::string> &, const std::vector<std::string> &r) {
+        ++nb_notifications;
+        removed = r;
+      });
+    fetch::oef::pb::ServiceUpdate update;
+    auto *kv = update.add_values();
+    kv->set_key("price");
+    kv->mutable_value()->set_i(50);
+    REQUIRE(!sd.update(handle, "Agent2", update.values())); // not its registration
+    REQUIRE(!sd.update(handle + 100, "Agent1", update.values()));
+    REQUIRE(sd.update(handle, "Agent1", update.values()));
+    REQUIRE(sd.size() == 2);
+    REQUIRE(sd.query(cheap) == std::vector<std::string>{"Agent2"});
+    REQUIRE(nb_notifications == 2);
+    REQUIRE(removed == std::vector<std::string>{"Agent1"});
+    // optional attribute added, the handle is kept.
+    kv->set_key("stock");
+    kv->mutable_value()->set_i(3);
+    REQUIRE(sd.update(handle, "Agent1", update.values()));
+    REQUIRE(sd.query(QueryModel{{Constraint{"stock", Relation{Relation::Op::Eq, 3}}}, dm}) == std::vector<std::string>{"Agent1"});
+    // wrong type.
+    kv->mutable_value()->set_s("many");
+    REQUIRE(!sd.update(handle, "Agent1", update.values()));
+    sd.unregisterAll("Agent1");
+    REQUIRE(!sd.update(handle, "Agent1", update.values()));
+    REQUIRE(sd.size() == 1);
+  }
+  TEST_CASE("servicedirectory unregister handle", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"name", Type::String, true}, Attribute{"price", Type::Int, true}}};
+    Instance offer{dm, {{"name", VariantType{std::string{"apple"}}}, {"price", VariantType{5}}}};
+    auto handle = sd.registerAgent(offer, "Agent1");
+    REQUIRE(sd.registerAgent(offer, "Agent2") > 0);
+    QueryModel cheap{{Constraint{"price", Relation{Relation::Op::Lt, 10}}}, dm};
+    size_t nb_notifications = 0;
+    sd.subscribe(cheap, [&](const std::vector<std::string> &, const std::vector<std::string> &) { ++nb_notifications; });
+    fetch::oef::pb::ServiceUpdate update;
+    auto *kv = update.add_values();
+    kv->set_key("price");
+    kv->mutable_value()->set_i(50);
+    REQUIRE(sd.update(handle, "Agent1", update.values()));
+    REQUIRE(nb_notifications == 2);
+    // the updated registration, found by its handle.
+    REQUIRE(!sd.unregisterAgent(handle, "Agent2"));
+    REQUIRE(sd.unregisterAgent(handle, "Agent1"));
+    REQUIRE(!sd.unregisterAgent(handle, "Agent1"));
+    REQUIRE(!sd.update(handle, "Agent1", update.values()));
+    REQUIRE(sd.size() == 1);
+    REQUIRE(nb_notifications == 2);
+  }
+  TEST_CASE("servicedirectory streamed query", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"price", Type::Int, true}}};
+    for(int i = 0; i < 10; ++i) {
+      Instance instance{dm, {{"price", VariantType{i}}}};
+      REQUIRE(sd.registerAgent(instance, "Agent" + std::to_string(i)));
+      // registered twice, returned once.
+      REQUIRE(sd.registerAgent(Instance{dm, {{"price", VariantType{i + 100}}}}, "Agent" + std::to_string(i)));
+    }
+    QueryModel cheap{{Constraint{"price", Relation{Relation::Op::Lt, 1000}}}, dm};
+    std::vector<std::vector<std::string>> chunks;
+    size_t nb_last = 0;
+    auto collect = [&](std::vector<std::string> &&agents, bool last) {
+      chunks.emplace_back(std::move(agents));
+      nb_last += last;
+    };
+    sd.query(cheap, 4, 0, collect);
+    REQUIRE(chunks.size() == 3);
+    REQUIRE(nb_last == 1);
+    REQUIRE(chunks[2].size() == 2);
+    std::vector<std::string> all;
+    for(auto &c : chunks) {
+      all.insert(all.end(), c.begin(), c.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto expected = sd.query(cheap);
+    std::sort(expected.begin(), expected.end());
+    REQUIRE(all == expected);
+    // the last chunk may be empty.
+    chunks.clear();
+    sd.query(cheap, 5, 0, collect);
+    REQUIRE(chunks.size() == 3);
+    REQUIRE(chunks[2].empty());
+    chunks.clear();
+    sd.query(cheap, 4, 6, collect);
+    REQUIRE(chunks.size() == 2);
+    REQUIRE(chunks[1].size() == 2);
+  }
+  TEST_CASE("servicedirectory limited query", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"price", Type::Int, true}}};
+    for(int i = 0; i < 6; ++i) {
+      REQUIRE(sd.registerAgent(Instance{dm, {{"price", VariantType{i}}}}, "Agent" + std::to_string(i)));
+      REQUIRE(sd.registerAgent(Instance{dm, {{"price", VariantType{i + 10}}}}, "Agent" + std::to_string(i)));
+    }
+    QueryModel cheap{{Constraint{"price", Relation{Relation::Op::Lt, 100}}}, dm};
+    uint64_t generation = 0;
+    auto first = sd.limitedQuery(cheap, 4, {}, generation);
+    REQUIRE(generation == sd.generation());
+    REQUIRE(first.size() == 4);
+    std::unordered_set<std::string> skip(first.begin(), first.end());
+    REQUIRE(skip.size() == 4);
+    auto rest = sd.limitedQuery(cheap, 4, skip, generation);
+    REQUIRE(rest.size() == 2);
+    for(auto &a : rest) {
+      REQUIRE(skip.find(a) == skip.end());
+    }
+    REQUIRE(sd.limitedQuery(cheap, 0, {}, generation).size() == 6);
+  }
+  TEST_CASE("servicedirectory stream", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"offer", {Attribute{"price", Type::Int, true}}};
+    for(int i = 0; i < 6; ++i) {
+      REQUIRE(sd.registerAgent(Instance{dm, {{"price", VariantType{i}}}}, "Agent" + std::to_string(i)));
+    }
+    QueryModel cheap{{Constraint{"price", Relation{Relation::Op::Lt, 100}}}, dm};
+    auto stream = sd.stream(cheap);
+    std::vector<std::string> agents;
+    REQUIRE(!sd.next(stream, 2, agents));
+    REQUIRE(agents.size() == 2);
+    // the directory is not locked between chunks: instances unregistered since the snapshot
+    // are skipped, those registered are not part of it.
+    std::set<std::string> removed;
+    for(int i = 0; i < 6; ++i) {
+      std::string agent = "Agent" + std::to_string(i);
+      if(std::find(agents.begin(), agents.end(), agent) == agents.end() && removed.size() < 2) {
+        REQUIRE(sd.unregisterAgent(Instance{dm, {{"price", VariantType{i}}}}, agent));
+        removed.insert(agent);
+      }
+    }
+    REQUIRE(sd.registerAgent(Instance{dm, {{"price", VariantType{50}}}}, "Late"));
+    REQUIRE(!sd.next(stream, 2, agents));
+    REQUIRE(sd.next(stream, 2, agents));
+    REQUIRE(agents.size() == 4);
+    for(auto &a : agents) {
+      REQUIRE(removed.find(a) == removed.end());
+      REQUIRE(a != "Late");
+    }
+    // f can use the directory.
+    size_t nb = 0;
+    sd.query(cheap, 2, 0, [&sd,&nb](std::vector<std::string> &&chunk, bool) {
+        nb += chunk.size();
+        REQUIRE(sd.size() == 5);
+      });
+    REQUIRE(nb == 5);
+  }
+  TEST_CASE("servicedirectory changes", "[sd]") {
+    ServiceDirectory sd{4};
+    DataModel dm{"offer", {Attribute{"price", Type::Int, true}}};
+    Instance cheap{dm, {{"price", VariantType{5}}}};
+    Instance cheap2{dm, {{"price", VariantType{8}}}};
+    Instance expensive{dm, {{"price", VariantType{50}}}};
+    QueryModel query{{Constraint{"price", Relation{Relation::Op::Lt, 10}}}, dm};
+    REQUIRE(sd.registerAgent(cheap, "Agent1"));
+    REQUIRE(sd.registerAgent(cheap, "Agent2"));
+    uint64_t generation;
+    auto agents = sd.query(query, generation);
+    REQUIRE(agents.size() == 2);
+    REQUIRE(generation == 2);
+    REQUIRE(sd.registerAgent(cheap2, "Agent2")); // still matching
+    REQUIRE(sd.registerAgent(cheap, "Agent3"));
+    REQUIRE(sd.registerAgent(expensive, "Agent4"));
+    sd.unregisterAll("Agent1");
+    std::vector<std::string> added, removed;
+    uint64_t now;
+    REQUIRE(sd.changes(query, generation, added, removed, now));
+    REQUIRE(now == 6);
+    REQUIRE(added == std::vector<std::string>{"Agent3"});
+    REQUIRE(removed == std::vector<std::string>{"Agent1"});
+    added.clear();
+    removed.clear();
+    REQUIRE(sd.changes(query, now, added, removed, now));
+    REQUIRE(added.empty());
+    REQUIRE(removed.empty());
+    // registered then unregistered: no change.
+    REQUIRE(sd.registerAgent(cheap, "Agent5"));
+    REQUIRE(sd.unregisterAgent(cheap, "Agent5"));
+    REQUIRE(sd.changes(query, now, added, removed, now));
+    REQUIRE(added.empty());
+    REQUIRE(removed.empty());
+    // only the last 4 changes are kept.
+    REQUIRE(!sd.changes(query, generation, added, removed, now));
+    REQUIRE(!sd.changes(query, now + 1, added, removed, now));
+  }
+  TEST_CASE("servicedirectory aggregate", "[sd]") {
+    ServiceDirectory sd;
+    DataModel dm{"car", {Attribute{"manufacturer", Type::String, true}, Attribute{"price", Type::Int, true}}};
+    auto car = [&dm](const std::string &manufacturer, int price) {
+      return Instance{dm, {{"manufacturer", VariantType{manufacturer}}, {"price", VariantType{price}}}};
+    };
+    REQUIRE(sd.registerAgent(car("Tesla", 100), "Agent1"));
+    REQUIRE(sd.registerAgent(car("Tesla", 100), "Agent2"));
+    REQUIRE(sd.registerAgent(car("Renault", 40), "Agent2"));
+    REQUIRE(sd.registerAgent(car("Tata", 10), "Agent3"));
+    REQUIRE(sd.registerAgent(car("Tata", 5000), "Agent4"));
+    QueryModel cheap{{Constraint{"price", Relation{Relation::Op::Lt, 1000}}}, dm};
+    fetch::oef::pb::Server_AggregateResult count;
+    sd.aggregate(cheap, "", "", count);
+    REQUIRE(count.services() == 4);
+    REQUIRE(count.agents() == 3);
+    REQUIRE(!count.has_values());
+    REQUIRE(count.groups_size() == 0);
+    fetch::oef::pb::Server_AggregateResult stats;
+    sd.aggregate(cheap, "price", "manufacturer", stats);
+    REQUIRE(stats.values() == 4);
+    REQUIRE(stats.min() == 10.0);
+    REQUIRE(stats.max() == 100.0);
+    REQUIRE(stats.avg() == 62.5);
+    std::map<std::string,uint64_t> groups;
+    for(auto &g : stats.groups()) {
+      groups[g.value()] = g.count();
+    }
+    REQUIRE(groups == (std::map<std::string,uint64_t>{{"Tesla", 2}, {"Renault", 1}, {"Tata", 1}}));
+    // attributes of the wrong type are ignored.
+    fetch::oef::pb::Server_AggregateResult wrong;
+    sd.aggregate(cheap, "manufacturer", "price", wrong);
+    REQUIRE(wrong.values() == 0);
+    REQUIRE(!wrong.has_min());
+    REQUIRE(wrong.groups_size() == 0);
+  }
   TEST_CASE("person", "[query]") {
     DataModel datamodel1{"Person", {Attribute{"firstName", Type::String, true, "The first name."},
                                     Attribute{"lastName", Type::String, true},